@@ -0,0 +1,382 @@
+/*
+ * Control command codec benchmark. Encodes PING and TUNNEL_REQ commands over and over, once with the old two-pass
+ * encoder that packed the arguments, unpacked them and packed the result again, and once with create_command, both
+ * into a fresh buffer per command and into a reused one like Connection does. Then encodes and decodes every
+ * TraneCommand on its own, decoding with Connection::dispatch into the command's parameters like the handlers do.
+ * Then decodes a stream of PING, TUNNEL_REQ and STREAM_DATA commands handed over in reads of a full receive buffer, a
+ * TCP segment and a few bytes, so commands straddle the reads, once with the msgpack::unpacker and switch Connection
+ * used to have and once with Connection::dispatch. Reports the time and heap allocations per command, and commands
+ * per second for decoding on one core. Last, a burst of TUNNEL_REQ is sent from one Connection to another over
+ * loopback, reporting how many writes the burst took.
+ *
+ *     trane_bench_commands [commands=1000000]
+ */
+#include "../inc/trane/connection.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <new>
+#include <string>
+#include <vector>
+
+LogLevel LOGLEVEL = ERROR;
+
+static std::atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    if(void* ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+
+// the encoder create_command replaced
+template<typename... Args>
+static void two_pass_command(trane::TraneCommand cmd, msgpack::sbuffer& buf, Args&&... args)
+{
+    msgpack::sbuffer tmp;
+    msgpack::pack(tmp, std::make_tuple(std::forward<Args>(args)...));
+    msgpack::object_handle handle = msgpack::unpack(tmp.data(), tmp.size());
+    msgpack::pack(buf, std::make_tuple(static_cast<unsigned char>(cmd), handle.get()));
+}
+
+
+template<typename Encode>
+static void run(const std::string& name, size_t count, bool reuse, Encode encode)
+{
+    msgpack::sbuffer reused(256);
+    size_t bytes = 0;
+    uint64_t allocs = allocations;
+    auto begin = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(reuse)
+        {
+            reused.clear();
+            encode(reused, i);
+            bytes += reused.size();
+        }
+        else
+        {
+            msgpack::sbuffer buf;
+            encode(buf, i);
+            bytes += buf.size();
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    allocs = allocations - allocs;
+
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(8) << elapsed * 1e9 / count << " ns  " << std::setprecision(2)
+              << std::setw(6) << static_cast<double>(allocs) / count << " allocs  "
+              << std::setprecision(0) << bytes / count << " bytes per command\n";
+}
+
+
+// counts the commands dispatched to it, touching their arguments like the real handlers do
+class Decoder : public trane::Connection<>
+{
+public:
+    explicit Decoder(asio::io_service& ios) : Connection(ios, 0, [](uint64_t){}) { }
+
+    void handle_cmd_connect(const msgpack::object& obj) override
+    {
+        trane::ParamConnect param;
+        obj.convert(param);
+        bytes += std::get<0>(param).size;
+    }
+
+    void handle_cmd_assign(const msgpack::object& obj) override
+    {
+        trane::ParamAssign param;
+        obj.convert(param);
+        bytes += std::get<0>(param) & 1;
+    }
+
+    void handle_cmd_ping(const msgpack::object& obj) override
+    {
+        trane::ParamPing param;
+        obj.convert(param);
+        bytes += std::get<0>(param).size;
+    }
+
+    void handle_cmd_pong(const msgpack::object& obj) override
+    {
+        trane::ParamPong param;
+        obj.convert(param);
+        bytes += std::get<0>(param).size;
+    }
+
+    void handle_cmd_tunnel_req(const msgpack::object& obj) override
+    {
+        trane::ParamTunnelReq param;
+        obj.convert(param);
+        bytes += std::get<0>(param).size + std::get<2>(param).size;
+    }
+
+    void handle_cmd_tunnel_res(const msgpack::object& obj) override
+    {
+        trane::ParamTunnelRes param;
+        obj.convert(param);
+        bytes += std::get<2>(param).size;
+    }
+
+    void handle_cmd_stream_open(const msgpack::object& obj) override
+    {
+        trane::ParamStreamOpen param;
+        obj.convert(param);
+        bytes += std::get<1>(param).size;
+    }
+
+    void handle_cmd_stream_data(const msgpack::object& obj) override
+    {
+        trane::ParamStreamData param;
+        obj.convert(param);
+        bytes += std::get<1>(param).size;
+    }
+
+    void handle_cmd_stream_window(const msgpack::object& obj) override
+    {
+        trane::ParamStreamWindow param;
+        obj.convert(param);
+        bytes += std::get<1>(param);
+    }
+
+    void handle_cmd_stream_close(const msgpack::object& obj) override
+    {
+        trane::ParamStreamClose param;
+        obj.convert(param);
+        bytes += std::get<1>(param);
+    }
+
+    size_t feed(const char* data, size_t size)
+    {
+        return this->dispatch(data, size);
+    }
+
+    uint64_t bytes{0};
+};
+
+
+// the receive path dispatch replaced, with owned strings like the parameters had
+static void unpacker_decode(Decoder& decoder, msgpack::unpacker& unpacker, const char* data, size_t size)
+{
+    using command_t = std::tuple<unsigned char, msgpack::object>;
+    unpacker.reserve_buffer(size);
+    std::memcpy(unpacker.buffer(), data, size);
+    unpacker.buffer_consumed(size);
+    msgpack::object_handle handle;
+    while(unpacker.next(handle))
+    {
+        command_t cmd;
+        handle.get().convert(cmd);
+        auto obj = std::get<1>(cmd);
+        switch(std::get<0>(cmd))
+        {
+        case trane::PING:
+        {
+            std::tuple<std::string> param;
+            obj.convert(param);
+            decoder.bytes += std::get<0>(param).size();
+            break;
+        }
+        case trane::TUNNEL_REQ:
+        {
+            std::tuple<std::string, uint16_t, std::string, uint16_t, unsigned char, uint64_t, std::string> param;
+            obj.convert(param);
+            decoder.bytes += std::get<0>(param).size() + std::get<2>(param).size();
+            break;
+        }
+        case trane::STREAM_DATA:
+            decoder.handle_cmd_stream_data(obj);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+
+static void run_decode(const std::string& name, const msgpack::sbuffer& stream, size_t count, bool dispatch, size_t chunk = TRANE_BUFSIZE)
+{
+    asio::io_service ios;
+    Decoder decoder(ios);
+    msgpack::unpacker unpacker;
+    uint64_t allocs = allocations;
+    auto begin = std::chrono::steady_clock::now();
+    // hand the stream over a read at a time, commands straddle the reads like they do on the socket
+    size_t parsed = 0;
+    for(size_t end = 0; end < stream.size();)
+    {
+        end = std::min(end + chunk, stream.size());
+        if(dispatch)
+        {
+            parsed += decoder.feed(stream.data() + parsed, end - parsed);
+        }
+        else
+        {
+            unpacker_decode(decoder, unpacker, stream.data() + parsed, end - parsed);
+            parsed = end;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    allocs = allocations - allocs;
+    if(dispatch && decoder.received() != count)
+    {
+        std::cerr << name << ": decoded " << decoder.received() << " of " << count << " commands\n";
+    }
+
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(8) << elapsed * 1e9 / count << " ns  " << std::setprecision(2)
+              << std::setw(6) << static_cast<double>(allocs) / count << " allocs  "
+              << std::setprecision(2) << count / elapsed / 1e6 << " M commands/s\n";
+}
+
+
+// queue a burst of commands at once, the way a session asks a client for many tunnels
+static void run_fanout(size_t count)
+{
+    asio::io_service ios;
+    tcp::acceptor acceptor(ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    Decoder sender(ios), receiver(ios);
+    sender.socket().connect(acceptor.local_endpoint());
+    acceptor.accept(receiver.socket());
+    receiver.do_read();
+
+    auto begin = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < count; ++i)
+    {
+        sender.send_cmd_tunnel_req("198.51.100.7", static_cast<uint16_t>(50000 + i % 10000), "10.1.1.252", 22, trane::TCP, i, "lz4");
+    }
+    while(receiver.received() < count && ios.run_one())
+    {
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::cout << std::left << std::setw(28) << "TUNNEL_REQ burst" << std::right << std::fixed << std::setprecision(1)
+              << std::setw(8) << elapsed * 1e9 / count << " ns  " << std::dec << sender.writes() << " writes for "
+              << count << " commands\n";
+}
+
+
+int main(int argc, char** argv)
+{
+    size_t count = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    const std::string ping = "PING", host_server = "198.51.100.7", host_client = "10.1.1.252", codec = "lz4";
+
+    auto ping_two_pass = [&](msgpack::sbuffer& buf, size_t){
+        two_pass_command(trane::PING, buf, ping);
+    };
+    auto ping_one_pass = [&](msgpack::sbuffer& buf, size_t){
+        trane::cmd_ping(buf, ping);
+    };
+    auto req_two_pass = [&](msgpack::sbuffer& buf, size_t i){
+        two_pass_command(trane::TUNNEL_REQ, buf, host_server, static_cast<uint16_t>(50000 + i % 10000), host_client,
+            static_cast<uint16_t>(22), static_cast<unsigned char>(trane::TCP), static_cast<uint64_t>(i), codec);
+    };
+    auto req_one_pass = [&](msgpack::sbuffer& buf, size_t i){
+        trane::cmd_tunnel_req(buf, host_server, static_cast<uint16_t>(50000 + i % 10000), host_client, 22, trane::TCP, i, codec);
+    };
+
+    // both encoders have to produce the same frames
+    msgpack::sbuffer a, b;
+    req_two_pass(a, 7);
+    req_one_pass(b, 7);
+    if(a.size() != b.size() || std::memcmp(a.data(), b.data(), a.size()) != 0)
+    {
+        std::cerr << "encoders disagree\n";
+        return 1;
+    }
+
+    run("PING two-pass", count, false, ping_two_pass);
+    run("PING one-pass", count, false, ping_one_pass);
+    run("PING one-pass, reused", count, true, ping_one_pass);
+    run("TUNNEL_REQ two-pass", count, false, req_two_pass);
+    run("TUNNEL_REQ one-pass", count, false, req_one_pass);
+    run("TUNNEL_REQ one-pass, reused", count, true, req_one_pass);
+
+    // every command on its own, encoded into a reused buffer and decoded a receive buffer at a time
+    using Encode = std::function<void(msgpack::sbuffer&, size_t)>;
+    const std::string site = "site-0042", host = "internal.example.com";
+    const std::string payload(1024, 'x');
+    const std::vector<std::pair<std::string, Encode>> commands = {
+        {"CONNECT", [&](msgpack::sbuffer& buf, size_t){ trane::cmd_connect(buf, site); }},
+        {"ASSIGN", [&](msgpack::sbuffer& buf, size_t i){ trane::cmd_assign(buf, 0x1234abcd00000000 + i); }},
+        {"PING", ping_one_pass},
+        {"PONG", [&](msgpack::sbuffer& buf, size_t){ trane::cmd_pong(buf, "PONG"); }},
+        {"TUNNEL_REQ", req_one_pass},
+        {"TUNNEL_RES", [&](msgpack::sbuffer& buf, size_t i){ trane::cmd_tunnel_res(buf, i, false, "unsupported codec zstd"); }},
+        {"STREAM_OPEN", [&](msgpack::sbuffer& buf, size_t i){
+            trane::cmd_stream_open(buf, static_cast<uint32_t>(i), host, 443, TRANE_MUX_WINDOW);
+        }},
+        {"STREAM_DATA", [&](msgpack::sbuffer& buf, size_t i){
+            trane::cmd_stream_data(buf, static_cast<uint32_t>(i), msgpack::type::raw_ref(payload.data(), static_cast<uint32_t>(payload.size())));
+        }},
+        {"STREAM_WINDOW", [&](msgpack::sbuffer& buf, size_t i){ trane::cmd_stream_window(buf, static_cast<uint32_t>(i), 65536); }},
+        {"STREAM_CLOSE", [&](msgpack::sbuffer& buf, size_t i){ trane::cmd_stream_close(buf, static_cast<uint32_t>(i), i & 1); }},
+    };
+    std::cout << '\n';
+    for(auto& command : commands)
+    {
+        run("encode " + command.first, count, true, command.second);
+    }
+    std::cout << '\n';
+    for(auto& command : commands)
+    {
+        // at most 64MB of frames, STREAM_DATA carries a whole payload each
+        msgpack::sbuffer frames;
+        command.second(frames, 0);
+        size_t n = std::min(count, std::max<size_t>(1, (64 << 20) / frames.size()));
+        frames.clear();
+        for(size_t i = 0; i < n; ++i)
+        {
+            command.second(frames, i);
+        }
+        run_decode("decode " + command.first, frames, n, true);
+    }
+
+    // a mix of control and data commands as one connection would receive them
+    msgpack::sbuffer stream(count * 64);
+    for(size_t i = 0; i < count; ++i)
+    {
+        switch(i % 4)
+        {
+        case 0:
+            ping_one_pass(stream, i);
+            break;
+        case 1:
+            req_one_pass(stream, i);
+            break;
+        default:
+            trane::cmd_stream_data(stream, static_cast<uint32_t>(i),
+                msgpack::type::raw_ref(payload.data(), static_cast<uint32_t>(payload.size())));
+            break;
+        }
+    }
+    // reads of a full receive buffer, of a TCP segment and of a few bytes, so more and more commands straddle them
+    for(size_t chunk : {static_cast<size_t>(TRANE_BUFSIZE), static_cast<size_t>(1448), static_cast<size_t>(64)})
+    {
+        std::cout << '\n';
+        run_decode("mix unpacker, " + std::to_string(chunk) + "B reads", stream, count, false, chunk);
+        run_decode("mix dispatch, " + std::to_string(chunk) + "B reads", stream, count, true, chunk);
+    }
+
+    // stays under TRANE_CMD_QUEUE_LIMIT, a larger burst fails the connection
+    std::cout << '\n';
+    run_fanout(std::min<size_t>(count, 100000));
+    return 0;
+}
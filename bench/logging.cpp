@@ -0,0 +1,109 @@
+/*
+ * Logging overhead benchmark. Times a relay-style log line on the calling thread, once formatted and written right
+ * away the way Logger used to, once captured into the thread's ring for the log thread, and once at a level that is
+ * filtered out. The ring is flushed between batches outside of the timing, so no line is dropped. Log output goes to
+ * /dev/null.
+ *
+ *     trane_bench_logging [lines=1000000] [threads=1]
+ */
+#include "../inc/trane/logging.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+LogLevel LOGLEVEL = DEBUG;
+
+
+// the synchronous logger LOG used to expand to
+class SyncLogger
+{
+public:
+    explicit SyncLogger(LogLevel level)
+    {
+        m_buf << log_level_name(level);
+    }
+
+    template<typename T>
+    SyncLogger& operator<<(const T& value)
+    {
+        m_buf << value;
+        return *this;
+    }
+
+    ~SyncLogger()
+    {
+        m_buf << '\n';
+        std::cerr << m_buf.str();
+    }
+
+private:
+    std::ostringstream m_buf;
+};
+
+#define SYNC_LOG(level) \
+    if (level > LOGLEVEL) {} \
+    else SyncLogger(level) << __FILE__ << ':' << std::dec << __LINE__ << " - " << __FUNCTION__ << ": "
+
+
+template<typename Log>
+static void run(const std::string& name, size_t lines, unsigned threads, Log log)
+{
+    const size_t batch = TRANE_LOG_RING / 2;
+    std::vector<std::thread> workers;
+    std::vector<double> seconds(threads, 0);
+    for(unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&, t]{
+            for(size_t done = 0; done < lines; done += batch)
+            {
+                auto begin = std::chrono::steady_clock::now();
+                for(size_t i = done; i < done + batch && i < lines; ++i)
+                {
+                    log(i);
+                }
+                seconds[t] += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                LogBackend::instance().flush();
+            }
+        });
+    }
+    for(auto& worker : workers)
+    {
+        worker.join();
+    }
+    double total = 0;
+    for(double s : seconds)
+    {
+        total += s;
+    }
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(8) << total * 1e9 / (lines * threads) << " ns per line\n";
+}
+
+
+int main(int argc, char** argv)
+{
+    size_t lines = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    unsigned threads = argc > 2 ? std::stoul(argv[2]) : 1;
+    threads = threads ? threads : 1;
+    if(!std::freopen("/dev/null", "w", stderr))
+    {
+        std::cerr << "could not redirect stderr\n";
+        return 1;
+    }
+
+    uint64_t tunnelid = 0x1234abcd5678ef90;
+    run("synchronous", lines, threads, [&](size_t i){
+        SYNC_LOG(DEBUG) << "tunnel " << std::setfill('0') << std::setw(16) << std::hex << tunnelid << " wrote " << std::dec << i << " bytes";
+    });
+    run("ring", lines, threads, [&](size_t i){
+        LOG(DEBUG) << "tunnel " << std::setfill('0') << std::setw(16) << std::hex << tunnelid << " wrote " << std::dec << i << " bytes";
+    });
+    run("filtered out", lines, threads, [&](size_t i){
+        LOG(VERBOSE) << "tunnel " << std::setfill('0') << std::setw(16) << std::hex << tunnelid << " wrote " << std::dec << i << " bytes";
+    });
+    return 0;
+}
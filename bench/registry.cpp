@@ -0,0 +1,97 @@
+/*
+ * Registry contention benchmark. A number of threads churn through a Container the way the server's session registry
+ * is used: every thread adds entries, looks them up and deletes them again, while another thread keeps taking
+ * snapshots like the session listing does. Runs once with a single lock and once with the session registry's shard
+ * count, and reports the operations per second of each.
+ *
+ *     trane_bench_registry [seconds=3] [threads=cores] [live entries per thread=1024]
+ */
+#include "../inc/trane/container.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+LogLevel LOGLEVEL = ERROR;
+
+
+struct Entry
+{
+    uint64_t value{0};
+};
+
+
+template<size_t Shards>
+static void run(double seconds, unsigned threads, size_t live)
+{
+    trane::Container<Entry, Shards> registry;
+    std::atomic<bool> done{false};
+    std::atomic<uint64_t> ops{0}, snapshots{0};
+    std::vector<std::thread> workers;
+
+    for(unsigned t = 0; t < threads; ++t)
+    {
+        workers.emplace_back([&]{
+            auto entry = std::make_shared<Entry>();
+            std::vector<uint64_t> ids;
+            ids.reserve(live);
+            uint64_t count = 0;
+            size_t next = 0;
+            while(!done)
+            {
+                // keep `live` entries per thread, replacing the oldest with a new one after each lookup
+                if(ids.size() < live)
+                {
+                    ids.push_back(registry.add(entry));
+                    ++count;
+                    continue;
+                }
+                if(registry.get(ids[next]) == nullptr)
+                {
+                    std::cerr << "lost entry " << ids[next] << '\n';
+                }
+                registry.del(ids[next]);
+                ids[next] = registry.add(entry);
+                next = (next + 1) % live;
+                count += 3;
+            }
+            ops += count;
+        });
+    }
+    workers.emplace_back([&]{
+        while(!done)
+        {
+            snapshots += registry.snapshot().size() ? 1 : 0;
+            std::this_thread::sleep_for(MSEC(10));
+        }
+    });
+
+    auto begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    done = true;
+    for(auto& worker : workers)
+    {
+        worker.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::cout << std::setw(3) << Shards << " shards  " << std::fixed << std::setprecision(2)
+              << ops / elapsed / 1e6 << " Mops/s with " << snapshots << " snapshots\n";
+}
+
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? std::stod(argv[1]) : 3;
+    unsigned threads = argc > 2 ? std::stoul(argv[2]) : std::thread::hardware_concurrency();
+    size_t live = argc > 3 ? std::stoul(argv[3]) : 1024;
+    threads = threads ? threads : 1;
+
+    std::cout << std::dec << threads << " threads, " << live << " live entries each\n";
+    run<1>(seconds, threads, live);
+    run<64>(seconds, threads, live);              // TRANE_SESSION_SHARDS
+    return 0;
+}
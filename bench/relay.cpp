@@ -0,0 +1,417 @@
+/*
+ * Loopback relay benchmark. Admin connections made by a load generator go through ServerProxy and ClientProxy tunnels
+ * to a service standing in for the host behind the client, each part on a thread of its own. Two kinds of runs are
+ * swept over the relay modes:
+ *
+ *     stream  every tunnel pushes `megabytes` into a sink, across buffer profiles and tunnel counts
+ *     echo    every tunnel makes round trips of a message through an echo service, across message sizes and
+ *             tunnel counts, with the standard buffer profile
+ *
+ * One CSV row is printed per run: throughput of the bytes relayed, round trip latency percentiles for echo runs, the
+ * CPU time of the relay thread and the relay system calls per byte. Progress and failures go to stderr. Before the
+ * sweep a tunnel whose client loses a data connection request is checked to still relay the admins that follow.
+ *
+ *     trane_bench_relay [megabytes=64] [mode...]
+ */
+#include "../inc/trane/server_proxy.hpp"
+#include "../inc/trane/client_proxy.hpp"
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define ROUND_TRIPS 2000                    // round trips per tunnel of an echo run, after one to warm up
+#define RUN_TIMEOUT 60                      // seconds a run may take before it counts as failed
+#define REQUEST_TIMEOUT 200                 // milliseconds a tunnel waits for a requested data connection in the check
+
+LogLevel LOGLEVEL = ERROR;
+
+using Server = trane::ServerProxy<tcp, TRANE_BUFSIZE>;
+using Client = trane::ClientProxy<tcp, TRANE_BUFSIZE>;
+
+
+// CPU time of the calling thread
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+/*
+ * The host behind the client, echoing or discarding whatever each connection sends
+ */
+class Service
+{
+public:
+    explicit Service(bool echo)
+        : m_acc{m_ios, tcp::endpoint(asio::ip::address_v4::loopback(), 0)}, m_echo{echo}
+    {
+        this->do_accept();
+        m_thread = std::thread([this]{ m_ios.run(); });
+    }
+
+    ~Service()
+    {
+        m_ios.stop();
+        m_thread.join();
+    }
+
+    uint16_t port() const
+    {
+        return m_acc.local_endpoint().port();
+    }
+
+    std::atomic<uint64_t> received{0};
+
+private:
+    struct Conn
+    {
+        explicit Conn(asio::io_service& ios) : sock{ios}, buf(1 << 16) { }
+
+        tcp::socket sock;
+        std::vector<char> buf;
+    };
+
+    void do_accept()
+    {
+        auto conn = std::make_shared<Conn>(m_ios);
+        m_acc.async_accept(conn->sock, [this, conn](const asio::error_code& err){
+            if(!err)
+            {
+                this->do_read(conn);
+                this->do_accept();
+            }
+        });
+    }
+
+    void do_read(std::shared_ptr<Conn> conn)
+    {
+        conn->sock.async_read_some(asio::buffer(conn->buf), [this, conn](const asio::error_code& err, size_t bytes_transferred){
+            if(err)
+            {
+                return;
+            }
+            received += bytes_transferred;
+            if(!m_echo)
+            {
+                this->do_read(conn);
+                return;
+            }
+            asio::async_write(conn->sock, asio::buffer(conn->buf.data(), bytes_transferred),
+                [this, conn](const asio::error_code& err, size_t){
+                    if(!err)
+                    {
+                        this->do_read(conn);
+                    }
+                }
+            );
+        });
+    }
+
+    asio::io_service m_ios;
+    tcp::acceptor m_acc;
+    bool m_echo;
+    std::thread m_thread;
+};
+
+
+struct Case
+{
+    std::string test, mode, profile;
+    size_t tunnels, msg, bytes;             // bytes per tunnel of a stream run
+};
+
+
+struct Result
+{
+    bool ok{false};
+    uint64_t bytes{0}, syscalls{0};
+    double seconds{0}, cpu{0};
+    std::vector<double> rtt_usec;
+};
+
+
+// one admin connection of an echo run, making round trips one after the other
+struct Pinger
+{
+    explicit Pinger(asio::io_service& ios, size_t msg) : sock{ios}, out(msg, 'p'), in(msg) { }
+
+    void start(size_t round_trips, std::vector<double>& rtt_usec)
+    {
+        if(round_trips == 0)
+        {
+            return;
+        }
+        sent = std::chrono::steady_clock::now();
+        asio::async_write(sock, asio::buffer(out), [](const asio::error_code&, size_t){ });
+        asio::async_read(sock, asio::buffer(in), [this, round_trips, &rtt_usec](const asio::error_code& err, size_t){
+            if(err)
+            {
+                return;
+            }
+            if(round_trips <= ROUND_TRIPS)
+            {
+                rtt_usec.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - sent).count());
+            }
+            ++done;
+            this->start(round_trips - 1, rtt_usec);
+        });
+    }
+
+    tcp::socket sock;
+    std::vector<char> out, in;
+    std::chrono::steady_clock::time_point sent;
+    size_t done{0};
+};
+
+
+static Result run(const Case& c)
+{
+    Result result;
+    trane::parse_relay_mode(c.mode, trane::default_relay_mode());
+    trane::parse_buffer_profile(c.profile, trane::default_buffer_profile());
+    bool echo = c.test == "echo";
+    Service service(echo);
+
+    // every tunnel carries one admin connection over a data connection of its own
+    asio::io_service relay_ios;
+    std::vector<std::shared_ptr<Server>> servers;
+    std::vector<std::unique_ptr<Client>> clients;
+    for(size_t t = 0; t < c.tunnels; ++t)
+    {
+        auto server = std::make_shared<Server>(relay_ios);
+        if(!server->open(trane::PortPool::admin(), trane::PortPool::client()))
+        {
+            return result;
+        }
+        server->listen();
+        clients.emplace_back(new Client(relay_ios, tcp::endpoint(asio::ip::address_v4::loopback(), server->port_up()), "127.0.0.1", service.port()));
+        clients.back()->start();
+        servers.push_back(std::move(server));
+    }
+    std::thread relay_thread([&relay_ios]{ relay_ios.run(); });
+
+    auto relay_cpu = [&relay_ios]{
+        std::promise<double> cpu;
+        relay_ios.post([&cpu]{ cpu.set_value(cpu_seconds()); });
+        return cpu.get_future().get();
+    };
+
+    asio::io_service load_ios;
+    std::vector<std::unique_ptr<Pinger>> admins;
+    asio::error_code ec;
+    for(auto& server : servers)
+    {
+        admins.emplace_back(new Pinger(load_ios, c.msg));
+        admins.back()->sock.connect(tcp::endpoint(asio::ip::address_v4::loopback(), server->port_dn()), ec);
+        if(ec)
+        {
+            std::cerr << "could not connect to tunnel port " << server->port_dn() << ": " << ec.message() << '\n';
+            break;
+        }
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + SEC(RUN_TIMEOUT);
+    double cpu = relay_cpu();
+    auto begin = std::chrono::steady_clock::now();
+    if(!ec && echo)
+    {
+        // the first round trip sets up the downstream connection and is not counted
+        std::vector<std::vector<double>> rtt(admins.size());
+        for(size_t t = 0; t < admins.size(); ++t)
+        {
+            rtt[t].reserve(ROUND_TRIPS);
+            admins[t]->start(ROUND_TRIPS + 1, rtt[t]);
+        }
+        load_ios.run_for(SEC(RUN_TIMEOUT));
+        result.ok = true;
+        for(size_t t = 0; t < admins.size(); ++t)
+        {
+            result.ok = result.ok && admins[t]->done == ROUND_TRIPS + 1;
+            result.rtt_usec.insert(result.rtt_usec.end(), rtt[t].begin(), rtt[t].end());
+        }
+        result.bytes = 2 * c.msg * (ROUND_TRIPS + 1) * admins.size();
+    }
+    else if(!ec)
+    {
+        std::vector<char> chunk(1 << 16, 0x5a);
+        std::vector<size_t> sent(admins.size(), 0);
+        std::function<void(size_t)> do_write = [&](size_t t){
+            size_t size = std::min(chunk.size(), c.bytes - sent[t]);
+            if(size == 0)
+            {
+                return;
+            }
+            asio::async_write(admins[t]->sock, asio::buffer(chunk.data(), size), [&, t, size](const asio::error_code& err, size_t){
+                sent[t] += size;
+                if(!err)
+                {
+                    do_write(t);
+                }
+            });
+        };
+        for(size_t t = 0; t < admins.size(); ++t)
+        {
+            do_write(t);
+        }
+        load_ios.run_for(SEC(RUN_TIMEOUT));
+        result.bytes = c.bytes * admins.size();
+        while(service.received < result.bytes && std::chrono::steady_clock::now() < deadline)
+        {
+            std::this_thread::sleep_for(USEC(100));
+        }
+        result.ok = service.received == result.bytes;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    result.cpu = relay_cpu() - cpu;
+
+    relay_ios.stop();
+    relay_thread.join();
+    for(size_t t = 0; t < servers.size(); ++t)
+    {
+        auto stats = servers[t]->stats();
+        stats += clients[t]->stats();
+        result.syscalls += stats.reads + stats.writes;
+    }
+    return result;
+}
+
+
+/*
+ * The client does not report a data connection it failed to make. The first request of a tunnel without spares is
+ * dropped as if its connect had failed, and both the admin that caused it and a new admin after it must still be
+ * relayed once the lost request has expired and been made again.
+ */
+static bool check_lost_request()
+{
+    Service service(true);
+    asio::io_service relay_ios;
+    auto server = std::make_shared<Server>(relay_ios);
+    std::vector<std::unique_ptr<Client>> clients;
+    if(!server->open(trane::PortPool::admin(), trane::PortPool::client()))
+    {
+        return false;
+    }
+    size_t requests = 0;
+    server->set_demand_handler([&](uint64_t){
+        if(requests++ == 0)
+        {
+            return;
+        }
+        clients.emplace_back(new Client(relay_ios, tcp::endpoint(asio::ip::address_v4::loopback(), server->port_up()), "127.0.0.1", service.port()));
+        clients.back()->start();
+    });
+    server->set_request_timeout(MSEC(REQUEST_TIMEOUT));
+    server->set_spares(0);
+    server->listen();
+    std::thread relay_thread([&relay_ios]{ relay_ios.run(); });
+
+    asio::io_service load_ios;
+    std::vector<std::unique_ptr<Pinger>> admins;
+    std::vector<std::vector<double>> rtt(2);
+    asio::error_code ec;
+    for(size_t t = 0; t < rtt.size() && !ec; ++t)
+    {
+        admins.emplace_back(new Pinger(load_ios, 64));
+        admins.back()->sock.connect(tcp::endpoint(asio::ip::address_v4::loopback(), server->port_dn()), ec);
+        admins.back()->start(1, rtt[t]);
+        std::this_thread::sleep_for(MSEC(REQUEST_TIMEOUT / 4));
+    }
+    load_ios.run_for(MSEC(20 * REQUEST_TIMEOUT));
+
+    relay_ios.stop();
+    relay_thread.join();
+    bool ok = !ec;
+    for(auto& admin : admins)
+    {
+        ok = ok && admin->done == 1;
+    }
+    return ok;
+}
+
+
+static double percentile(const std::vector<double>& sorted, double p)
+{
+    if(sorted.empty())
+    {
+        return 0;
+    }
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+
+int main(int argc, char** argv)
+{
+    size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 64;
+    std::vector<std::string> modes;
+    for(int i = 2; i < argc; ++i)
+    {
+        trane::RelayMode mode;
+        if(!trane::parse_relay_mode(argv[i], mode))
+        {
+            std::cerr << "unknown relay mode " << argv[i] << '\n';
+            return 1;
+        }
+        modes.push_back(argv[i]);
+    }
+    if(modes.empty())
+    {
+        modes = {"lockstep", "pipelined", "splice", "uring"};
+    }
+
+    std::vector<Case> cases;
+    for(const auto& mode : modes)
+    {
+        for(const char* profile : {"interactive", "standard", "bulk"})
+        {
+            for(size_t tunnels : {1, 8})
+            {
+                cases.push_back({"stream", mode, profile, tunnels, 1 << 16, (megabytes << 20) / tunnels});
+            }
+        }
+        for(size_t msg : {64, 1024, 16384})
+        {
+            for(size_t tunnels : {1, 8})
+            {
+                cases.push_back({"echo", mode, "standard", tunnels, msg, 0});
+            }
+        }
+    }
+
+    std::cerr << "lost data connection request\n";
+    bool ok = check_lost_request();
+    if(!ok)
+    {
+        std::cerr << "  failed\n";
+    }
+
+    std::cout << "test,mode,buffers,tunnels,msg_bytes,bytes,seconds,gbit_s,rtt_p50_us,rtt_p99_us,rtt_p999_us,relay_cpu_ns_per_byte,syscalls_per_kib\n";
+    for(const auto& c : cases)
+    {
+        std::cerr << c.test << ' ' << c.mode << ' ' << c.profile << ' ' << c.tunnels << " tunnels " << c.msg << " bytes\n";
+        Result result = run(c);
+        if(!result.ok)
+        {
+            std::cerr << "  failed\n";
+            ok = false;
+            continue;
+        }
+        std::sort(result.rtt_usec.begin(), result.rtt_usec.end());
+        std::cout << c.test << ',' << c.mode << ',' << c.profile << ',' << c.tunnels << ',' << c.msg << ','
+                  << result.bytes << ',' << std::fixed << std::setprecision(4) << result.seconds << ','
+                  << result.bytes * 8 / result.seconds / 1e9 << ',' << std::setprecision(1)
+                  << percentile(result.rtt_usec, 0.5) << ',' << percentile(result.rtt_usec, 0.99) << ','
+                  << percentile(result.rtt_usec, 0.999) << ',' << std::setprecision(3)
+                  << result.cpu * 1e9 / result.bytes << ',' << result.syscalls * 1024.0 / result.bytes << '\n';
+        std::cout.flush();
+    }
+    return ok ? 0 : 1;
+}
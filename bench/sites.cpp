@@ -0,0 +1,216 @@
+/*
+ * Control plane load benchmark. Runs a Server on its own io pool and drives a number of simulated sites against it
+ * over loopback, each a real Client, spread over a few threads of a second pool. Measures, in phases:
+ *
+ *     connect     time from a site starting to connect until its ASSIGN arrives, and sessions set up per second
+ *     memory      resident memory per site once all are connected, client and server side together
+ *     heartbeats  PING/PONG round trips per second with every site pinging again as soon as its PONG arrives
+ *     tunnels     TUNNEL_REQs handled per second when the server asks every site for a tunnel at once
+ *
+ *     trane_bench_sites [sites=1000] [client threads=4] [server threads=2] [seconds=5] [port=39990]
+ */
+#include "../inc/trane/server.hpp"
+#include "../inc/trane/client.hpp"
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define PHASE_TIMEOUT 60                    // seconds a phase waits for every site before giving up
+
+LogLevel LOGLEVEL = ERROR;
+
+
+struct Counters
+{
+    std::atomic<uint64_t> assigned{0}, failed{0}, pongs{0}, tunnels{0};
+    std::atomic<bool> flood{false};
+};
+
+
+/*
+ * A Client that keeps time and counts what the server sends it
+ */
+class Site : public trane::Client<>
+{
+public:
+    Site(asio::io_service& ios, const std::string& name, uint16_t port, Counters& counters)
+        : Client(ios, name, "127.0.0.1", port, [&counters](uint64_t){ ++counters.failed; }), m_counters(counters)
+    { }
+
+    void begin()
+    {
+        m_begin = std::chrono::steady_clock::now();
+        this->start();
+    }
+
+    double assign_usec{0};
+
+protected:
+    void handle_cmd_assign(const msgpack::object& obj) override
+    {
+        assign_usec = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - m_begin).count();
+        Client::handle_cmd_assign(obj);
+        ++m_counters.assigned;
+    }
+
+    void handle_cmd_pong(const msgpack::object& obj) override
+    {
+        ++m_counters.pongs;
+        if(m_counters.flood)
+        {
+            this->send_cmd_ping("PING");
+            return;
+        }
+        Client::handle_cmd_pong(obj);
+    }
+
+    void handle_cmd_tunnel_req(const msgpack::object& obj) override
+    {
+        Client::handle_cmd_tunnel_req(obj);
+        ++m_counters.tunnels;
+    }
+
+private:
+    Counters& m_counters;
+    std::chrono::steady_clock::time_point m_begin;
+};
+
+
+static size_t resident_bytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * ::sysconf(_SC_PAGESIZE);
+}
+
+
+// wait until the counter reaches target, false on timeout
+static bool wait_for(const std::atomic<uint64_t>& counter, uint64_t target, const std::atomic<uint64_t>* failed = nullptr)
+{
+    auto deadline = std::chrono::steady_clock::now() + SEC(PHASE_TIMEOUT);
+    while(counter + (failed ? failed->load() : 0) < target)
+    {
+        if(std::chrono::steady_clock::now() > deadline)
+        {
+            return false;
+        }
+        std::this_thread::sleep_for(MSEC(1));
+    }
+    return true;
+}
+
+
+static void report(const std::string& name, double value, const std::string& unit)
+{
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << value << ' ' << unit << '\n';
+}
+
+
+int main(int argc, char** argv)
+{
+    size_t sites = argc > 1 ? std::stoul(argv[1]) : 1000;
+    size_t client_threads = argc > 2 ? std::stoul(argv[2]) : 4;
+    size_t server_threads = argc > 3 ? std::stoul(argv[3]) : 2;
+    double seconds = argc > 4 ? std::stod(argv[4]) : 5;
+    uint16_t port = argc > 5 ? static_cast<uint16_t>(std::stoul(argv[5])) : 39990;
+
+    // two sockets per site for the control connection, and four more per tunnel
+    struct rlimit files;
+    if(getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+    {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    trane::default_heartbeat() = SEC(1);
+
+    trane::IoPool server_pool(server_threads);
+    trane::Server<> server(server_pool, port);
+    server.listen();
+    server_pool.start();
+
+    Counters counters;
+    size_t resident = resident_bytes();
+    trane::IoPool client_pool(client_threads);
+    client_pool.start();
+    std::vector<std::shared_ptr<Site>> clients;
+    clients.reserve(sites);
+
+    // connect
+    auto begin = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < sites; ++i)
+    {
+        auto site = std::make_shared<Site>(client_pool.next(), "site-" + std::to_string(i), port, counters);
+        clients.push_back(site);
+        site->ios().post([site]{
+            site->begin();
+        });
+    }
+    bool ok = wait_for(counters.assigned, sites, &counters.failed);
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    resident = resident_bytes() - resident;
+
+    std::vector<double> latency;
+    for(auto& site : clients)
+    {
+        if(site->assign_usec > 0)
+        {
+            latency.push_back(site->assign_usec);
+        }
+    }
+    std::sort(latency.begin(), latency.end());
+    std::cout << std::dec << sites << " sites on " << client_pool.size() << " threads against a server on "
+              << server_pool.size() << " threads, " << counters.assigned << " assigned, " << counters.failed << " failed\n";
+    if(!latency.empty())
+    {
+        report("connect to ASSIGN p50", latency[latency.size() / 2], "us");
+        report("connect to ASSIGN p99", latency[std::min(latency.size() - 1, latency.size() * 99 / 100)], "us");
+        report("connect to ASSIGN max", latency.back(), "us");
+        report("sessions set up", latency.size() / elapsed, "per second");
+        report("memory per site", resident / 1024.0 / latency.size(), "KiB");
+    }
+
+    // heartbeats, every connected site already has a PING in flight or scheduled
+    counters.flood = true;
+    for(auto& site : clients)
+    {
+        site->ios().post([site]{
+            site->send_cmd_ping("PING");
+        });
+    }
+    std::this_thread::sleep_for(MSEC(100));
+    uint64_t pongs = counters.pongs;
+    begin = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    report("heartbeats", (counters.pongs - pongs) / elapsed, "PING/PONG per second");
+    counters.flood = false;
+    std::this_thread::sleep_for(MSEC(100));
+
+    // tunnels, one TUNNEL_REQ per site for the tunnel's spare data connection
+    auto sessions = server.sessions().snapshot();
+    size_t tunnels = std::min(sessions.size(), trane::PortPool::admin().available());
+    auto loopback = asio::ip::address::from_string("127.0.0.1");
+    begin = std::chrono::steady_clock::now();
+    for(size_t i = 0; i < tunnels; ++i)
+    {
+        sessions[i].second->create_tunnel(loopback, trane::TraneType::TCP, "127.0.0.1", 9);
+    }
+    ok = wait_for(counters.tunnels, tunnels) && ok;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    report("tunnel setup", counters.tunnels / elapsed, "TUNNEL_REQ per second");
+
+    client_pool.stop();
+    server_pool.stop();
+    clients.clear();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+/*
+ * Loopback UDP tunnel benchmark. Sends datagrams from a number of admin peers through a UdpServerProxy and a
+ * UdpClientProxy into a sink for a fixed time, and reports the packet rates offered and delivered. At most `window`
+ * datagrams are in flight, so the relay is measured at its own pace rather than by how much it drops under overload.
+ * A window of 0 sends as fast as possible.
+ *
+ *     trane_bench_udp [seconds=5] [datagram bytes=64] [peers=4] [window=1024]
+ */
+#include "../inc/trane/udp_proxy.hpp"
+
+#include <sys/resource.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+LogLevel LOGLEVEL = ERROR;
+
+
+// CPU time of the calling thread, so the relay is not charged for the sender and the sink
+static double cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? std::stod(argv[1]) : 5;
+    size_t size = argc > 2 ? std::stoul(argv[2]) : 64;
+    unsigned peers = argc > 3 ? std::stoul(argv[3]) : 4;
+    uint64_t window = argc > 4 ? std::stoul(argv[4]) : 1024;
+    auto loopback = asio::ip::address::from_string("127.0.0.1");
+    uint16_t port_dn = trane::TRANE_ADMIN_PORT_END, port_up = trane::TRANE_CLIENT_PORT_END;
+
+    // sink standing in for the service behind the client, on its own thread like a separate host would be
+    asio::io_service sink_ios;
+    udp::socket sink(sink_ios, udp::endpoint(loopback, 0));
+    sink.non_blocking(true);
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<bool> done{false};
+    std::thread sink_thread([&]{
+        trane::UdpBatch batch;
+        asio::error_code ec;
+        while(!done)
+        {
+            size_t n = batch.recv(sink, ec);
+            if(n == 0)
+            {
+                sink.wait(udp::socket::wait_read, ec);
+                continue;
+            }
+            delivered += n;
+        }
+    });
+
+    asio::io_service ios;
+    trane::UdpServerProxy<TRANE_BUFSIZE> server(ios, port_dn, port_up);
+    trane::UdpClientProxy<TRANE_BUFSIZE> client(ios, tcp::endpoint(loopback, port_up), "127.0.0.1", sink.local_endpoint().port());
+    server.listen();
+    client.start();
+    std::thread relay_thread([&ios]{ ios.run(); });
+    std::this_thread::sleep_for(MSEC(200));
+
+    // every admin peer sends from its own socket, and all of them share the sending thread
+    asio::io_service admin_ios;
+    std::vector<std::unique_ptr<udp::socket>> admins;
+    for(unsigned i = 0; i < peers; ++i)
+    {
+        admins.emplace_back(new udp::socket(admin_ios, udp::endpoint(loopback, 0)));
+        admins.back()->connect(udp::endpoint(loopback, port_dn));
+        admins.back()->non_blocking(true);
+    }
+    std::vector<unsigned char> payload(size, 0x5a);
+    trane::UdpBatch batch;
+    uint64_t offered = 0;
+    asio::error_code ec;
+
+    auto relay_cpu = [&ios]{
+        std::promise<double> cpu;
+        ios.post([&cpu]{ cpu.set_value(cpu_seconds()); });
+        return cpu.get_future().get();
+    };
+    double cpu = relay_cpu();
+    auto begin = std::chrono::steady_clock::now();
+    auto end = begin + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    while(std::chrono::steady_clock::now() < end)
+    {
+        if(window && offered >= delivered + window)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        for(auto& admin : admins)
+        {
+            while(batch.add(payload.data(), payload.size(), nullptr));
+            offered += batch.send(*admin, ec);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::this_thread::sleep_for(MSEC(500));
+    cpu = relay_cpu() - cpu;
+
+    done = true;
+    sink.close(ec);
+    sink_thread.join();
+    auto stats = server.stats();
+    ios.stop();
+    relay_thread.join();
+
+    std::cout << std::fixed << std::setprecision(0)
+              << "offered   " << offered / elapsed << " pps\n"
+              << "relayed   " << stats.packets_in / elapsed << " pps\n"
+              << "delivered " << delivered / elapsed << " pps (" << std::setprecision(1)
+              << (offered ? 100.0 * delivered / offered : 0.0) << "%)\n"
+              << std::setprecision(3) << "cpu       " << cpu / (delivered ? delivered / 1e6 : 1) << " relay cpu-s per million delivered\n";
+    return delivered ? 0 : 1;
+}
@@ -0,0 +1,322 @@
+#ifndef TRANE_BUFFER_POOL_HPP
+#define TRANE_BUFFER_POOL_HPP
+
+#include "utils.hpp"
+#include "logging.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#define TRANE_POOL_SLAB_SIZE (2 * 1024 * 1024)      // slabs are carved into buffers of a single size class
+#define TRANE_POOL_RETAIN (8 * 1024 * 1024)         // free bytes per size class kept resident before pages are returned
+
+namespace trane
+{
+    /*
+     * A buffer on loan from the BufferPool. It goes back to the pool when it is reset or destroyed.
+     */
+    class Buffer
+    {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other);
+        Buffer& operator=(Buffer&& other);
+        Buffer(const Buffer&) = delete;
+        Buffer& operator=(const Buffer&) = delete;
+        ~Buffer();
+
+        unsigned char* data() const;
+        size_t capacity() const;
+        explicit operator bool() const;
+        void reset();
+
+    private:
+        friend class BufferPool;
+        Buffer(unsigned char* data, BufferProfile profile);
+
+        unsigned char* m_data{nullptr};
+        BufferProfile m_profile{STANDARD};
+    };
+
+
+    /*
+     * Process-wide pool of relay buffers, one size class per BufferProfile. Buffers are carved out of large slabs,
+     * optionally backed by huge pages, and handed out only while a tunnel has data in flight. Free buffers beyond the
+     * retained amount have their pages returned to the kernel, so resident memory follows the bytes actually in flight
+     * rather than the number of tunnels.
+     */
+    class BufferPool
+    {
+    public:
+        struct Stats
+        {
+            size_t slab_bytes;      // address space reserved
+            size_t in_use_bytes;    // on loan to tunnels
+            size_t warm_bytes;      // free and still resident
+        };
+
+        static BufferPool& instance();
+        static size_t profile_size(BufferProfile profile);
+
+        // the smallest profile holding size bytes, false if none does
+        static bool profile_for(size_t size, BufferProfile& profile);
+
+        Buffer acquire(BufferProfile profile);
+
+        // huge pages only apply to slabs allocated afterwards and are never trimmed
+        void set_huge_pages(bool huge_pages);
+        void set_retain(size_t bytes);
+        Stats stats();
+
+    private:
+        friend class Buffer;
+
+        struct SizeClass
+        {
+            std::mutex mu;
+            std::vector<unsigned char*> warm, cold;     // free buffers with and without resident pages
+            size_t slab_bytes{0}, in_use{0};
+        };
+
+        BufferPool() = default;
+        ~BufferPool();
+        void release(unsigned char* data, BufferProfile profile);
+        bool grow(SizeClass& cls, size_t size);
+
+        SizeClass m_classes[3];
+        std::mutex m_mu;
+        std::vector<std::pair<void*, size_t>> m_slabs;
+        std::atomic<bool> m_huge_pages{false};
+        std::atomic<size_t> m_retain{TRANE_POOL_RETAIN};
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline trane::Buffer::Buffer(unsigned char* data, BufferProfile profile)
+    : m_data{data}, m_profile{profile}
+{ }
+
+
+inline trane::Buffer::Buffer(Buffer&& other)
+    : m_data{other.m_data}, m_profile{other.m_profile}
+{
+    other.m_data = nullptr;
+}
+
+
+inline trane::Buffer& trane::Buffer::operator=(Buffer&& other)
+{
+    if(this != &other)
+    {
+        this->reset();
+        m_data = other.m_data;
+        m_profile = other.m_profile;
+        other.m_data = nullptr;
+    }
+    return *this;
+}
+
+
+inline trane::Buffer::~Buffer()
+{
+    this->reset();
+}
+
+
+inline unsigned char* trane::Buffer::data() const
+{
+    return m_data;
+}
+
+
+inline size_t trane::Buffer::capacity() const
+{
+    return m_data ? BufferPool::profile_size(m_profile) : 0;
+}
+
+
+inline trane::Buffer::operator bool() const
+{
+    return m_data != nullptr;
+}
+
+
+inline void trane::Buffer::reset()
+{
+    if(m_data)
+    {
+        BufferPool::instance().release(m_data, m_profile);
+        m_data = nullptr;
+    }
+}
+
+
+inline trane::BufferPool& trane::BufferPool::instance()
+{
+    static BufferPool pool;
+    return pool;
+}
+
+
+inline size_t trane::BufferPool::profile_size(BufferProfile profile)
+{
+    switch(profile)
+    {
+        case INTERACTIVE:
+            return 4 * 1024;
+        case STANDARD:
+            return TRANE_BUFSIZE;
+        case BULK:
+            return 128 * 1024;
+    }
+    return TRANE_BUFSIZE;
+}
+
+
+inline bool trane::BufferPool::profile_for(size_t size, BufferProfile& profile)
+{
+    for(BufferProfile p : {INTERACTIVE, STANDARD, BULK})
+    {
+        if(size <= profile_size(p))
+        {
+            profile = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+inline trane::BufferPool::~BufferPool()
+{
+    for(auto& slab : m_slabs)
+    {
+#ifdef __linux__
+        ::munmap(slab.first, slab.second);
+#else
+        delete[] static_cast<unsigned char*>(slab.first);
+#endif
+    }
+}
+
+
+inline trane::Buffer trane::BufferPool::acquire(BufferProfile profile)
+{
+    SizeClass& cls = m_classes[profile];
+    size_t size = profile_size(profile);
+    SCOPELOCK(cls.mu);
+    if(cls.warm.empty() && cls.cold.empty() && !this->grow(cls, size))
+    {
+        return Buffer();
+    }
+    auto& list = cls.warm.empty() ? cls.cold : cls.warm;
+    unsigned char* data = list.back();
+    list.pop_back();
+    ++cls.in_use;
+    return Buffer(data, profile);
+}
+
+
+inline void trane::BufferPool::release(unsigned char* data, BufferProfile profile)
+{
+    SizeClass& cls = m_classes[profile];
+    size_t size = profile_size(profile);
+    SCOPELOCK(cls.mu);
+    --cls.in_use;
+#ifdef __linux__
+    if(!m_huge_pages && cls.warm.size() * size >= m_retain)
+    {
+        ::madvise(data, size, MADV_DONTNEED);
+        cls.cold.push_back(data);
+        return;
+    }
+#endif
+    cls.warm.push_back(data);
+}
+
+
+inline bool trane::BufferPool::grow(SizeClass& cls, size_t size)
+{
+    size_t bytes = TRANE_POOL_SLAB_SIZE > size ? TRANE_POOL_SLAB_SIZE : size;
+    void* slab = nullptr;
+#ifdef __linux__
+    if(m_huge_pages)
+    {
+        slab = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(slab == MAP_FAILED)
+        {
+            LOG(WARNING) << "no huge pages available, using transparent huge pages";
+            slab = nullptr;
+        }
+    }
+    if(!slab)
+    {
+        slab = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(slab == MAP_FAILED)
+        {
+            LOG(ERROR) << "could not allocate a " << std::dec << bytes << " byte buffer slab";
+            return false;
+        }
+        if(m_huge_pages)
+        {
+            ::madvise(slab, bytes, MADV_HUGEPAGE);
+        }
+    }
+#else
+    slab = new unsigned char[bytes];
+#endif
+    {
+        SCOPELOCK(m_mu);
+        m_slabs.emplace_back(slab, bytes);
+    }
+    cls.slab_bytes += bytes;
+
+    // never touched yet, so these start out without resident pages
+    auto base = static_cast<unsigned char*>(slab);
+    for(size_t offset = bytes - bytes % size; offset >= size; offset -= size)
+    {
+        cls.cold.push_back(base + offset - size);
+    }
+    LOG(DEBUG) << "new " << std::dec << bytes << " byte slab for " << size << " byte buffers";
+    return true;
+}
+
+
+inline void trane::BufferPool::set_huge_pages(bool huge_pages)
+{
+    m_huge_pages = huge_pages;
+}
+
+
+inline void trane::BufferPool::set_retain(size_t bytes)
+{
+    m_retain = bytes;
+}
+
+
+inline trane::BufferPool::Stats trane::BufferPool::stats()
+{
+    Stats stats{0, 0, 0};
+    for(unsigned i = 0; i < sizeof(m_classes) / sizeof(m_classes[0]); ++i)
+    {
+        size_t size = profile_size(static_cast<BufferProfile>(i));
+        SCOPELOCK(m_classes[i].mu);
+        stats.slab_bytes += m_classes[i].slab_bytes;
+        stats.in_use_bytes += m_classes[i].in_use * size;
+        stats.warm_bytes += m_classes[i].warm.size() * size;
+    }
+    return stats;
+}
+
+#endif
@@ -5,7 +5,13 @@
 #include "commands.hpp"
 #include "connection.hpp"
 #include "container.hpp"
+#include "io_pool.hpp"
+#include "metrics.hpp"
+#include "mux.hpp"
 #include "resolver.hpp"
+#include "connector.hpp"
+#include "timer_wheel.hpp"
+#include "udp_proxy.hpp"
 #include "utils.hpp"
 
 #include <msgpack.hpp>
@@ -24,11 +30,22 @@ namespace trane
 
     public:
         Client(asio::io_service& ios, const std::string& name, const std::string& host, uint16_t port, ErrorHandler eh);
+        ~Client();
         void start();
 
+        // spread new tunnels over the shards of a pool instead of running them with the control connection
+        void set_io_pool(IoPool* pool);
+
+        // traffic of the process and of every TCP tunnel in the Prometheus text format, from the client's thread
+        void metrics(std::ostream& out) const;
+
     protected:
 
         void handle_connect(const asio::error_code& err);
+        void handle_error(const asio::error_code& err) override;
+
+        // drop the connection when the server sent nothing, not even a PONG, for a whole idle timeout
+        void watch_idle(uint64_t received);
 
         /*
          * Command handlers
@@ -36,15 +53,25 @@ namespace trane
         void handle_cmd_assign(const msgpack::object& obj);
         void handle_cmd_pong(const msgpack::object& obj);
         void handle_cmd_tunnel_req(const msgpack::object& obj);
+        void handle_cmd_stream_open(const msgpack::object& obj);
+        void handle_cmd_stream_data(const msgpack::object& obj);
+        void handle_cmd_stream_window(const msgpack::object& obj);
+        void handle_cmd_stream_close(const msgpack::object& obj);
 
-        asio::steady_timer m_heartbeat_timer;   // timer for executing PING commands for heartbeats
+        TimerWheel& m_wheel;                    // timers for heartbeats and the idle timeout
+        uint64_t m_heartbeat{0}, m_idle{0};
         trane::Resolver<tcp> m_resolver;        // a DNS resolver for creating TCP endpoints
+        trane::Connector<tcp> m_connector;      // races the resolved addresses of the server and of streams
         std::string m_name, m_host;             // store the client's site name and remote host/port
         uint16_t m_port;
+        IoPool* m_pool{nullptr};
+        std::unique_ptr<MetricsServer> m_metrics;   // served while the connection is up
 
     private:
+        Mux<Client, BufSize> m_mux;
         Container<ClientProxy<tcp, BufSize>> m_tcp_tunnels;
-        // Container<ClientProxy<udp, BufSize>> m_udp_tunnels;
+        Container<UdpClientProxy<BufSize>> m_udp_tunnels;
+        TrafficStats m_retired;                     // traffic of the TCP tunnels already closed
     };
 }
 
@@ -71,56 +98,247 @@ void trane::Client<BufSize>::handle_cmd_pong(const msgpack::object& obj)
 
     LOG(DEBUG) << "Client received PONG(\"" << pong << "\")";
 
-    m_heartbeat_timer.expires_after(SEC(10));
-    m_heartbeat_timer.async_wait(
-        [this](const asio::error_code& err)
-        {
-            if(err)
-            {
-                this->handle_error(err);
-            }
-            else
-            {
-                this->send_cmd_ping("PING");
+    m_wheel.cancel(m_heartbeat);
+    m_heartbeat = m_wheel.schedule(default_heartbeat(), [this]{
+        this->m_heartbeat = 0;
+        this->send_cmd_ping("PING");
+    });
+}
 
-            }
+
+/*
+ * The wheel's timers of the client are cancelled by handle_error and the destructor, so they never run on a client
+ * that is gone. The connection is not failed from here, the aborted read does that once the socket is closed.
+ */
+template<size_t BufSize>
+void trane::Client<BufSize>::watch_idle(uint64_t received)
+{
+    m_idle = m_wheel.schedule(default_idle_timeout(), [this, received]{
+        this->m_idle = 0;
+        if(this->received() != received)
+        {
+            this->watch_idle(this->received());
+            return;
         }
-    );
+        LOG(WARNING) << "server is not responding, dropping the connection";
+        this->close();
+    });
+}
+
+
+template<size_t BufSize>
+void trane::Client<BufSize>::handle_error(const asio::error_code& err)
+{
+    // nothing is left to keep the io_service running once the connection is gone
+    m_wheel.cancel(m_heartbeat);
+    m_wheel.cancel(m_idle);
+    m_heartbeat = m_idle = 0;
+    if(m_metrics)
+    {
+        m_metrics->close();
+    }
+    Connection<BufSize>::handle_error(err);
 }
 
 
-//using ParamTunnelReq = std::tuple<std::string, uint16_t, std::string, uint16_t, unsigned char, uint64_t>;
+//using ParamTunnelReq = std::tuple<StrView, uint16_t, StrView, uint16_t, unsigned char, uint64_t, StrView>;
 template<size_t BufSize>
 void trane::Client<BufSize>::handle_cmd_tunnel_req(const msgpack::object& obj)
 {
     ParamTunnelReq param;
     obj.convert(param);
 
+    // the lookup runs while the tunnel connects upstream, and its later admins find the target in the cache
     if(P4(param) == TraneType::TCP)
     {
-        auto trane_server = tcp::endpoint(asio::ip::address::from_string(P0(param)), P1(param));
-        auto tunnel = std::make_shared<ClientProxy<tcp, BufSize>>(this->m_ios, trane_server, P2(param), P3(param));
+        DnsCache<tcp>::instance().prefetch(P2(param).str(), std::to_string(P3(param)));
+        auto trane_server = tcp::endpoint(asio::ip::address::from_string(P0(param).str()), P1(param));
+        auto& ios = m_pool ? m_pool->next() : this->m_ios;
+        auto tunnel = std::make_shared<ClientProxy<tcp, BufSize>>(ios, trane_server, P2(param).str(), P3(param));
+        if(!P6(param).empty() && !tunnel->set_codec(P6(param).str()))
+        {
+            LOG(ERROR) << "Tunnel Request with unsupported codec " << P6(param);
+            this->send_cmd_tunnel_res(P5(param), false, "unsupported codec " + P6(param).str());
+            return;
+        }
         uint64_t id = m_tcp_tunnels.add(tunnel);
         tunnel->set_tunnelid(id);
         tunnel->set_sessionid(this->m_sessionid);
+        // the tunnel closes on its own shard, its bookkeeping is done back on the client's thread and the tunnel is
+        // released on its shard again. The client outlives its io_service's run and the pool is stopped before the
+        // client goes, so this is never used once the client is gone
+        tunnel->set_close_handler([this, id, &ios]{
+            this->m_ios.post([this, id, &ios]{
+                auto tunnel = this->m_tcp_tunnels.get(id);
+                this->m_tcp_tunnels.del(id);
+                if(tunnel)
+                {
+                    this->m_retired.merge(tunnel->traffic().totals());
+                    ios.post([tunnel]{ });
+                }
+            });
+        });
 
         LOG(INFO) << "Tunnel Request: Up: " << P0(param) << ':' << P1(param) << " ~ Down: " << P2(param) << ':' << P3(param)
             << " with ID " << std::setfill('0') << std::setw(16) << std::hex << P5(param);
 
-        tunnel->start();
+        // from here on the tunnel is only touched from its own shard
+        ios.post([tunnel]{
+            tunnel->start();
+        });
+    }
+    else if(P4(param) == TraneType::UDP)
+    {
+        DnsCache<udp>::instance().prefetch(P2(param).str(), std::to_string(P3(param)));
+        auto trane_server = tcp::endpoint(asio::ip::address::from_string(P0(param).str()), P1(param));
+        auto& ios = m_pool ? m_pool->next() : this->m_ios;
+        auto tunnel = std::make_shared<UdpClientProxy<BufSize>>(ios, trane_server, P2(param).str(), P3(param));
+        uint64_t id = m_udp_tunnels.add(tunnel);
+        tunnel->set_tunnelid(id);
+        tunnel->set_sessionid(this->m_sessionid);
+        tunnel->set_close_handler([this, id, &ios]{
+            this->m_ios.post([this, id, &ios]{
+                auto tunnel = this->m_udp_tunnels.get(id);
+                this->m_udp_tunnels.del(id);
+                if(tunnel)
+                {
+                    ios.post([tunnel]{ });
+                }
+            });
+        });
+
+        LOG(INFO) << "UDP Tunnel Request: Up: " << P0(param) << ':' << P1(param) << " ~ Down: " << P2(param) << ':' << P3(param)
+            << " with ID " << std::setfill('0') << std::setw(16) << std::hex << P5(param);
+
+        ios.post([tunnel]{
+            tunnel->start();
+        });
     }
 }
 
 
+/*
+ * Connect a stream the server opened over this connection. Anything the server sends meanwhile is queued by the
+ * stream and written once it connects.
+ */
+template<size_t BufSize>
+void trane::Client<BufSize>::handle_cmd_stream_open(const msgpack::object& obj)
+{
+    std::string host;
+    uint16_t port;
+    uint32_t window;
+    auto stream = m_mux.handle_open(obj, host, port, window);
+    if(stream == nullptr)
+    {
+        return;
+    }
+
+    LOG(INFO) << "Stream Request: " << host << ':' << std::dec << port << " with ID " << stream->streamid();
+    m_resolver.resolve(host, port,
+        [this, stream, window](const asio::error_code& err, tcp::resolver::iterator endpoints)
+        {
+            if(err)
+            {
+                LOG(ERROR) << "Stream resolution failure: " << err.message();
+                stream->reset();
+                return;
+            }
+            this->m_connector.connect(stream->socket(), endpoints,
+                [stream, window](const asio::error_code& err)
+                {
+                    if(err)
+                    {
+                        LOG(ERROR) << "Stream connection failure: " << err.message();
+                        stream->reset();
+                        return;
+                    }
+                    stream->start(window);
+                }
+            );
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::Client<BufSize>::handle_cmd_stream_data(const msgpack::object& obj)
+{
+    m_mux.handle_data(obj);
+}
+
+
+template<size_t BufSize>
+void trane::Client<BufSize>::handle_cmd_stream_window(const msgpack::object& obj)
+{
+    m_mux.handle_window(obj);
+}
+
+
+template<size_t BufSize>
+void trane::Client<BufSize>::handle_cmd_stream_close(const msgpack::object& obj)
+{
+    m_mux.handle_close(obj);
+}
+
+
 template<size_t BufSize>
 trane::Client<BufSize>::Client(asio::io_service& ios, const std::string& name, const std::string& host, uint16_t port, ErrorHandler eh)
-    : Connection<TRANE_BUFSIZE>(ios, 0, eh), m_heartbeat_timer{ios}, m_resolver{ios}, m_name{name}, m_host{host}, m_port{port}
+    : Connection<TRANE_BUFSIZE>(ios, 0, eh), m_wheel{TimerWheel::get(ios)}, m_resolver{ios}, m_connector{ios}, m_name{name}, m_host{host},
+    m_port{port}, m_mux{ios, *this}
 { }
 
 
+template<size_t BufSize>
+trane::Client<BufSize>::~Client()
+{
+    m_wheel.cancel(m_heartbeat);
+    m_wheel.cancel(m_idle);
+}
+
+
+template<size_t BufSize>
+void trane::Client<BufSize>::set_io_pool(IoPool* pool)
+{
+    m_pool = pool;
+}
+
+
+/*
+ * The client is a single session, reported with the ID the server assigned it.
+ */
+template<size_t BufSize>
+void trane::Client<BufSize>::metrics(std::ostream& out) const
+{
+    std::vector<MetricSeries> tunnels;
+    std::string labels = "session=\"" + metric_id(this->m_sessionid) + '"';
+    TrafficTotals traffic = m_retired.totals();
+    size_t open = 0;
+    m_tcp_tunnels.for_each([&](uint64_t tunnelid, const ClientProxy<tcp, BufSize>& tunnel){
+        TrafficTotals totals = tunnel.traffic().totals();
+        traffic += totals;
+        tunnels.push_back({labels + ",tunnel=\"" + metric_id(tunnelid) + '"', totals});
+        ++open;
+    });
+    traffic.tunnels = open;
+
+    TrafficTotals total = Metrics::global();
+    total.tunnels = traffic.tunnels;
+    write_metrics(out, "trane_", {{"", total}}, true);
+    write_metrics(out, "trane_session_", {{labels, traffic}}, true);
+    write_metrics(out, "trane_tunnel_", tunnels, false);
+}
+
+
 template<size_t BufSize>
 void trane::Client<BufSize>::start()
 {
+    if(default_metrics_port())
+    {
+        m_metrics.reset(new MetricsServer(this->m_ios, [this](std::ostream& out){
+            this->metrics(out);
+        }));
+        m_metrics->listen(default_metrics_port());
+    }
     m_resolver.resolve(m_host, m_port,
         [this](const asio::error_code& err, tcp::resolver::iterator endpoints)
         {
@@ -129,7 +347,7 @@ void trane::Client<BufSize>::start()
                 std::cout << "Client resolution failure: " << err.message() << '\n';
                 return;
             }
-            this->m_socket.async_connect(*endpoints,
+            this->m_connector.connect(this->m_socket, endpoints,
                 [this](const asio::error_code& err)
                 {
                     this->handle_connect(err);
@@ -145,10 +363,21 @@ void trane::Client<BufSize>::handle_connect(const asio::error_code& err)
 {
     if(err)
     {
-        this->handle_error(err);
+        this->fail(err);
         return;
     }
     //this->send_cmd_ping("PING");
+    if(default_idle_timeout().count())
+    {
+        if(default_keepalive())
+        {
+            this->set_keepalive(default_idle_timeout());
+        }
+        else
+        {
+            this->watch_idle(this->received());
+        }
+    }
     this->send_cmd_connect(this->m_name);
     this->do_read();
 }
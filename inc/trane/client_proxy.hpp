@@ -2,6 +2,7 @@
 #define ASIO_CLIENT_PROXY_HPP
 
 #include "resolver.hpp"
+#include "connector.hpp"
 #include "proxy.hpp"
 
 namespace trane
@@ -11,24 +12,33 @@ namespace trane
     {
     public:
         ClientProxy(asio::io_service& ios, const tcp::endpoint& trane_server, const std::string& host, uint16_t port);
+        ~ClientProxy();
 
-        // override the default... need to ensure the client is connected on first read
+        // override the default... data read from upstream is held until the downstream connection is established
+        void do_dn_write();
+
+        // an admin that leaves before sending anything never gets a downstream connection
         void handle_up_read(const asio::error_code& err, size_t bytes_transferred);
 
         void start();
 
         void do_up_connect();
-        void do_dn_connect(size_t bytes);
+        void do_dn_connect();
 
         void handle_up_connect(const asio::error_code& err);
-        void handle_dn_connect(size_t bytes, const asio::error_code& err);
+        void handle_dn_connect(const asio::error_code& err);
+
+        // traffic counters of the tunnel, safe to read from any thread
+        const TrafficStats& traffic() const;
 
     private:
-        bool m_connected_up{false}, m_connected_dn{false};
+        bool m_connected_up{false}, m_connected_dn{false}, m_connecting_dn{false};
         tcp::endpoint m_trane_server;
         std::string m_host;
         uint16_t m_port;
         trane::Resolver<Proto> m_resolver;
+        trane::Connector<Proto> m_connector;
+        TrafficStats m_traffic;
     };
 
 }
@@ -39,6 +49,7 @@ namespace trane
 template<typename Proto, size_t BufSize>
 void trane::ClientProxy<Proto, BufSize>::start()
 {
+    m_traffic.set_parent(&Metrics::local());
     this->do_up_connect();
 }
 
@@ -56,22 +67,23 @@ void trane::ClientProxy<Proto, BufSize>::do_up_connect()
 
 
 template<typename Proto, size_t BufSize>
-void trane::ClientProxy<Proto, BufSize>::do_dn_connect(size_t bytes_transferred)
+void trane::ClientProxy<Proto, BufSize>::do_dn_connect()
 {
     if(std::is_same<tcp, Proto>::value)
     {
+        m_connecting_dn = true;
         m_resolver.resolve(m_host, m_port,
-            [this, bytes_transferred](const asio::error_code& err, typename Proto::resolver::iterator endpoints)
+            [this](const asio::error_code& err, typename Proto::resolver::iterator endpoints)
             {
                 if(err)
                 {
-                    LOG(ERROR) << err.message();
+                    this->fail(err.message());
                     return;
                 }
-                this->m_sock_dn.async_connect(*endpoints,
-                    [this, bytes_transferred](const asio::error_code& err)
+                this->m_connector.connect(this->m_sock_dn, endpoints,
+                    [this](const asio::error_code& err)
                     {
-                        this->handle_dn_connect(bytes_transferred, err);
+                        this->handle_dn_connect(err);
                     }
                 );
             }
@@ -85,7 +97,7 @@ void trane::ClientProxy<Proto, BufSize>::handle_up_connect(const asio::error_cod
 {
     if(err)
     {
-        LOG(ERROR) << err.message();
+        this->fail(err.message());
         return;
     }
     LOG(SUCCESS) << "Connected to ServerProxy";
@@ -95,44 +107,79 @@ void trane::ClientProxy<Proto, BufSize>::handle_up_connect(const asio::error_cod
 
 
 template<typename Proto, size_t BufSize>
-void trane::ClientProxy<Proto, BufSize>::handle_dn_connect(size_t bytes_transferred, const asio::error_code& err)
+void trane::ClientProxy<Proto, BufSize>::handle_dn_connect(const asio::error_code& err)
 {
     if(err)
     {
-        LOG(ERROR) << err.message();
+        this->fail(err.message());
+        return;
+    }
+    if(this->m_closed)
+    {
+        // the winner arrived after the tunnel went away
+        asio::error_code ec;
+        this->m_sock_dn.close(ec);
         return;
     }
     this->m_connected_dn = true;
-    this->do_dn_write(bytes_transferred);
+    this->count_connect();
+    this->Proxy<Proto, BufSize>::do_dn_write();
     this->do_dn_read();
 }
 
 
 template<typename Proto, size_t BufSize>
-void trane::ClientProxy<Proto, BufSize>::handle_up_read(const asio::error_code& err, size_t bytes_transferred)
+void trane::ClientProxy<Proto, BufSize>::do_dn_write()
 {
-    if(err)
-    {
-        LOG(ERROR) << err.message();
-        return;
-    }
-    LOG(DEBUG) << "received " << std::dec << bytes_transferred ;
     if(!m_connected_dn)
     {
-        this->do_dn_connect(bytes_transferred);
+        if(!m_connecting_dn)
+        {
+            LOG(DEBUG) << "first data from upstream, connecting downstream";
+            this->do_dn_connect();
+        }
+        return;
     }
-    else
+    this->Proxy<Proto, BufSize>::do_dn_write();
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ClientProxy<Proto, BufSize>::handle_up_read(const asio::error_code& err, size_t bytes_transferred)
+{
+    if(err && !m_connected_dn && !m_connecting_dn)
     {
-        this->Proxy<Proto, BufSize>::handle_up_read(err, bytes_transferred);
+        this->m_chan_up.reading = false;
+        this->m_chan_up.pending.buf.reset();
+        LOG(DEBUG) << "upstream closed before downstream was needed";
+        this->close();
+        return;
     }
+    this->Proxy<Proto, BufSize>::handle_up_read(err, bytes_transferred);
 }
 
 
 template<typename Proto, size_t BufSize>
 trane::ClientProxy<Proto, BufSize>::ClientProxy(asio::io_service& ios, const tcp::endpoint& trane_server, const std::string& host, uint16_t port)
-    : Proxy<Proto, BufSize>::Proxy(ios), m_trane_server{trane_server}, m_host{host}, m_port{port}, m_resolver{ios}
+    : Proxy<Proto, BufSize>::Proxy(ios), m_trane_server{trane_server}, m_host{host}, m_port{port}, m_resolver{ios}, m_connector{ios}
 {
     LOG(VERBOSE);
+    this->set_traffic(&m_traffic);
+}
+
+
+template<typename Proto, size_t BufSize>
+trane::ClientProxy<Proto, BufSize>::~ClientProxy()
+{
+    // the counters go before the base class is done with them
+    this->release_traffic();
+}
+
+
+template<typename Proto, size_t BufSize>
+const trane::TrafficStats& trane::ClientProxy<Proto, BufSize>::traffic() const
+{
+    return m_traffic;
 }
 
 #endif
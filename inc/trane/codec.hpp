@@ -0,0 +1,493 @@
+#ifndef TRANE_CODEC_HPP
+#define TRANE_CODEC_HPP
+
+#include "buffer_pool.hpp"
+#include "logging.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+
+#ifdef TRANE_USE_LIBLZ4
+#include <lz4.h>
+#endif
+
+#define TRANE_CODEC_MIN_CHUNK 128           // smaller chunks are mostly interactive traffic and are sent as they are
+#define TRANE_CODEC_MAX_SKIP 64             // chunks sent uncompressed, at most, after compression did not pay off
+
+namespace trane
+{
+    /*
+     * A block compression algorithm for tunnel payloads. Every chunk is compressed on its own, so a codec keeps no
+     * state between calls.
+     */
+    class Codec
+    {
+    public:
+        virtual ~Codec() = default;
+        virtual const char* name() const = 0;
+
+        // compress into dst, returning the compressed size or 0 if it does not fit in capacity
+        virtual size_t compress(const unsigned char* src, size_t size, unsigned char* dst, size_t capacity) = 0;
+
+        // decompress exactly raw_size bytes into dst, returning false on corrupt input
+        virtual bool decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t raw_size) = 0;
+    };
+
+
+    /*
+     * LZ4 block format. Built in by default, or liblz4 when built with TRANE_USE_LIBLZ4; both produce the same format.
+     */
+    class Lz4Codec : public Codec
+    {
+    public:
+        const char* name() const;
+        size_t compress(const unsigned char* src, size_t size, unsigned char* dst, size_t capacity);
+        bool decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t raw_size);
+
+    private:
+        static const unsigned hash_log = 12;
+        std::unique_ptr<uint32_t[]> m_table;    // match finder, allocated on the first compress so decoders go without
+    };
+
+
+    /*
+     * Codecs by the name used to negotiate them in TUNNEL_REQ. An empty name means no compression.
+     */
+    typedef std::function<std::unique_ptr<Codec>()> CodecFactory;
+
+    inline std::map<std::string, CodecFactory>& codecs()
+    {
+        static std::map<std::string, CodecFactory> registry{
+            {"lz4", []{ return std::unique_ptr<Codec>(new Lz4Codec); }},
+        };
+        return registry;
+    }
+
+    inline void register_codec(const std::string& name, CodecFactory factory)
+    {
+        codecs()[name] = factory;
+    }
+
+    inline std::unique_ptr<Codec> make_codec(const std::string& name)
+    {
+        auto entry = codecs().find(name);
+        return entry == codecs().end() ? nullptr : entry->second();
+    }
+
+    /*
+     * Codec offered for every new tunnel. Empty by default and may be changed at startup.
+     */
+    inline std::string& default_codec()
+    {
+        static std::string codec;
+        return codec;
+    }
+
+
+    /*
+     * Frames chunks for a compressed data connection. Each frame is a 32 bit big endian header holding the payload
+     * size, with the top bit set when the payload is compressed, in which case a second word holds the original size.
+     * Chunks that compress poorly are sent as they are, and after such a chunk the encoder stops trying for a
+     * growing number of chunks so incompressible streams cost next to nothing.
+     */
+    class CodecEncoder
+    {
+    public:
+        static const size_t headroom = 8;       // room readers leave in front of a chunk for the frame header
+
+        explicit CodecEncoder(std::unique_ptr<Codec> codec);
+
+        /*
+         * Frame the size bytes at buf.data() + headroom. On return the frame is at buf.data() + offset, and buf may
+         * have been replaced by a buffer holding the compressed frame.
+         */
+        void encode(Buffer& buf, size_t& offset, size_t& size);
+
+        uint64_t bytes_in() const;
+        uint64_t bytes_out() const;
+
+    private:
+        std::unique_ptr<Codec> m_codec;
+        unsigned m_skip{0}, m_skip_next{1};
+        uint64_t m_in{0}, m_out{0};
+    };
+
+
+    /*
+     * Reassembles frames from a compressed data connection, however the stream was split up by reads.
+     */
+    class CodecDecoder
+    {
+    public:
+        explicit CodecDecoder(std::unique_ptr<Codec> codec);
+
+        /*
+         * Consume wire bytes and call emit(Buffer&&, size_t) with every chunk decoded. Returns false if the stream is
+         * corrupt.
+         */
+        template<typename Emit>
+        bool decode(const unsigned char* data, size_t size, Emit emit);
+
+        // true when the stream ended on a frame boundary
+        bool idle() const;
+
+    private:
+        std::unique_ptr<Codec> m_codec;
+        unsigned char m_header[8];
+        size_t m_header_size{0};
+        Buffer m_payload;
+        size_t m_payload_size{0}, m_frame_size{0}, m_raw_size{0};
+        bool m_compressed{false};
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline const char* trane::Lz4Codec::name() const
+{
+    return "lz4";
+}
+
+
+#ifdef TRANE_USE_LIBLZ4
+
+inline size_t trane::Lz4Codec::compress(const unsigned char* src, size_t size, unsigned char* dst, size_t capacity)
+{
+    int n = LZ4_compress_default(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dst), static_cast<int>(size), static_cast<int>(capacity));
+    return n > 0 ? static_cast<size_t>(n) : 0;
+}
+
+
+inline bool trane::Lz4Codec::decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t raw_size)
+{
+    int n = LZ4_decompress_safe(reinterpret_cast<const char*>(src), reinterpret_cast<char*>(dst), static_cast<int>(size), static_cast<int>(raw_size));
+    return n >= 0 && static_cast<size_t>(n) == raw_size;
+}
+
+#else
+
+/*
+ * Greedy single probe matcher. The step grows with the distance from the last match, so incompressible input is
+ * skipped over quickly.
+ */
+inline size_t trane::Lz4Codec::compress(const unsigned char* src, size_t size, unsigned char* dst, size_t capacity)
+{
+    const size_t min_match = 4, last_literals = 5, match_limit = 12;
+    auto read32 = [src](size_t i){ uint32_t v; std::memcpy(&v, src + i, sizeof(v)); return v; };
+    auto hash = [](uint32_t v){ return (v * 2654435761u) >> (32 - hash_log); };
+
+    size_t ip = 0, anchor = 0, op = 0;
+    auto emit = [&](size_t literals, size_t match, size_t offset) -> bool {
+        size_t need = 1 + literals + literals / 255 + 1 + (match ? 2 + match / 255 + 1 : 0);
+        if(op + need > capacity)
+        {
+            return false;
+        }
+        unsigned char& token = dst[op++];
+        token = static_cast<unsigned char>((literals < 15 ? literals : 15) << 4);
+        if(literals >= 15)
+        {
+            size_t rest = literals - 15;
+            for(; rest >= 255; rest -= 255)
+            {
+                dst[op++] = 255;
+            }
+            dst[op++] = static_cast<unsigned char>(rest);
+        }
+        std::memcpy(dst + op, src + anchor, literals);
+        op += literals;
+        if(match)
+        {
+            dst[op++] = static_cast<unsigned char>(offset);
+            dst[op++] = static_cast<unsigned char>(offset >> 8);
+            size_t extra = match - min_match;
+            token |= static_cast<unsigned char>(extra < 15 ? extra : 15);
+            if(extra >= 15)
+            {
+                size_t rest = extra - 15;
+                for(; rest >= 255; rest -= 255)
+                {
+                    dst[op++] = 255;
+                }
+                dst[op++] = static_cast<unsigned char>(rest);
+            }
+        }
+        return true;
+    };
+
+    if(size > match_limit)
+    {
+        if(!m_table)
+        {
+            m_table.reset(new uint32_t[1 << hash_log]);
+        }
+        std::memset(m_table.get(), 0, sizeof(uint32_t) << hash_log);
+        size_t limit = size - match_limit;
+        while(ip < limit)
+        {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash(seq);
+            size_t candidate = m_table[h];
+            m_table[h] = static_cast<uint32_t>(ip);
+            if(candidate < ip && ip - candidate <= 0xffff && read32(candidate) == seq)
+            {
+                size_t match = min_match;
+                while(ip + match < size - last_literals && src[candidate + match] == src[ip + match])
+                {
+                    ++match;
+                }
+                if(!emit(ip - anchor, match, ip - candidate))
+                {
+                    return 0;
+                }
+                ip += match;
+                anchor = ip;
+                continue;
+            }
+            ip += 1 + ((ip - anchor) >> 6);
+        }
+    }
+    return emit(size - anchor, 0, 0) ? op : 0;
+}
+
+
+inline bool trane::Lz4Codec::decompress(const unsigned char* src, size_t size, unsigned char* dst, size_t raw_size)
+{
+    size_t ip = 0, op = 0;
+    auto length = [&](size_t& value) -> bool {
+        unsigned char b;
+        do
+        {
+            if(ip >= size)
+            {
+                return false;
+            }
+            b = src[ip++];
+            value += b;
+        } while(b == 255);
+        return true;
+    };
+
+    while(ip < size)
+    {
+        unsigned char token = src[ip++];
+        size_t literals = token >> 4;
+        if(literals == 15 && !length(literals))
+        {
+            return false;
+        }
+        if(literals > size - ip || literals > raw_size - op)
+        {
+            return false;
+        }
+        std::memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if(ip == size)
+        {
+            break;
+        }
+
+        if(size - ip < 2)
+        {
+            return false;
+        }
+        size_t offset = src[ip] | (size_t(src[ip + 1]) << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if(match == 15 && !length(match))
+        {
+            return false;
+        }
+        match += 4;
+        if(offset == 0 || offset > op || match > raw_size - op)
+        {
+            return false;
+        }
+
+        // matches may overlap their own output
+        const unsigned char* from = dst + op - offset;
+        if(offset >= match)
+        {
+            std::memcpy(dst + op, from, match);
+        }
+        else
+        {
+            for(size_t i = 0; i < match; ++i)
+            {
+                dst[op + i] = from[i];
+            }
+        }
+        op += match;
+    }
+    return op == raw_size;
+}
+
+#endif
+
+
+inline trane::CodecEncoder::CodecEncoder(std::unique_ptr<Codec> codec)
+    : m_codec{std::move(codec)}
+{ }
+
+
+inline void trane::CodecEncoder::encode(Buffer& buf, size_t& offset, size_t& size)
+{
+    m_in += size;
+    if(size >= TRANE_CODEC_MIN_CHUNK && m_skip == 0)
+    {
+        BufferProfile profile = STANDARD;
+        if(BufferPool::profile_for(buf.capacity(), profile))
+        {
+            Buffer out = BufferPool::instance().acquire(profile);
+
+            // only worth it if it saves an eighth
+            size_t target = size - size / 8;
+            size_t packed = out ? m_codec->compress(buf.data() + headroom, size, out.data() + headroom, target) : 0;
+            if(packed)
+            {
+                unsigned char* p = out.data();
+                uint32_t words[2] = {static_cast<uint32_t>(packed) | 0x80000000u, static_cast<uint32_t>(size)};
+                for(int w = 0; w < 2; ++w)
+                {
+                    for(int i = 0; i < 4; ++i)
+                    {
+                        p[w * 4 + i] = static_cast<unsigned char>(words[w] >> (24 - 8 * i));
+                    }
+                }
+                buf = std::move(out);
+                offset = 0;
+                size = headroom + packed;
+                m_skip_next = 1;
+                m_out += size;
+                return;
+            }
+        }
+        m_skip = m_skip_next;
+        m_skip_next = m_skip_next * 2 < TRANE_CODEC_MAX_SKIP ? m_skip_next * 2 : TRANE_CODEC_MAX_SKIP;
+    }
+    else if(m_skip)
+    {
+        --m_skip;
+    }
+
+    // sent as it is, behind a single header word
+    unsigned char* p = buf.data() + headroom - 4;
+    for(int i = 0; i < 4; ++i)
+    {
+        p[i] = static_cast<unsigned char>(size >> (24 - 8 * i));
+    }
+    offset = headroom - 4;
+    size += 4;
+    m_out += size;
+}
+
+
+inline uint64_t trane::CodecEncoder::bytes_in() const
+{
+    return m_in;
+}
+
+
+inline uint64_t trane::CodecEncoder::bytes_out() const
+{
+    return m_out;
+}
+
+
+inline trane::CodecDecoder::CodecDecoder(std::unique_ptr<Codec> codec)
+    : m_codec{std::move(codec)}
+{ }
+
+
+template<typename Emit>
+bool trane::CodecDecoder::decode(const unsigned char* data, size_t size, Emit emit)
+{
+    while(size)
+    {
+        // header, one or two words
+        size_t header = m_header_size >= 4 && (m_header[0] & 0x80) ? 8 : 4;
+        if(m_header_size < header)
+        {
+            size_t n = header - m_header_size < size ? header - m_header_size : size;
+            std::memcpy(m_header + m_header_size, data, n);
+            m_header_size += n;
+            data += n;
+            size -= n;
+            if(m_header_size == 4 && (m_header[0] & 0x80))
+            {
+                continue;
+            }
+            if(m_header_size < header)
+            {
+                return true;
+            }
+
+            auto word = [this](size_t i){
+                return (uint32_t(m_header[i]) << 24) | (uint32_t(m_header[i + 1]) << 16) | (uint32_t(m_header[i + 2]) << 8) | uint32_t(m_header[i + 3]);
+            };
+            m_compressed = (m_header[0] & 0x80) != 0;
+            m_frame_size = word(0) & 0x7fffffffu;
+            m_raw_size = m_compressed ? word(4) : m_frame_size;
+            m_payload_size = 0;
+
+            BufferProfile profile = STANDARD, raw_profile = STANDARD;
+            if(m_frame_size == 0 || m_frame_size > m_raw_size || !BufferPool::profile_for(m_raw_size, raw_profile)
+                || !BufferPool::profile_for(m_frame_size, profile))
+            {
+                LOG(ERROR) << "bad frame of " << std::dec << m_frame_size << " bytes";
+                return false;
+            }
+            m_payload = BufferPool::instance().acquire(profile);
+            if(!m_payload)
+            {
+                return false;
+            }
+        }
+
+        // payload
+        size_t n = m_frame_size - m_payload_size < size ? m_frame_size - m_payload_size : size;
+        std::memcpy(m_payload.data() + m_payload_size, data, n);
+        m_payload_size += n;
+        data += n;
+        size -= n;
+        if(m_payload_size < m_frame_size)
+        {
+            return true;
+        }
+
+        m_header_size = 0;
+        if(!m_compressed)
+        {
+            emit(std::move(m_payload), m_frame_size);
+            continue;
+        }
+        BufferProfile profile = STANDARD;
+        BufferPool::profile_for(m_raw_size, profile);
+        Buffer raw = BufferPool::instance().acquire(profile);
+        if(!raw || !m_codec->decompress(m_payload.data(), m_frame_size, raw.data(), m_raw_size))
+        {
+            LOG(ERROR) << "could not decompress a frame of " << std::dec << m_frame_size << " bytes";
+            return false;
+        }
+        m_payload.reset();
+        emit(std::move(raw), m_raw_size);
+    }
+    return true;
+}
+
+
+inline bool trane::CodecDecoder::idle() const
+{
+    return m_header_size == 0;
+}
+
+#endif
@@ -5,50 +5,53 @@
 #include "utils.hpp"
 #include <msgpack.hpp>
 #include <iostream>
+#include <string>
 #include <vector>
 
 namespace trane{
 
-    using command_t = std::tuple<unsigned char, msgpack::object>;
-
-    using ParamConnect = std::tuple<std::string>;
-    using ParamAssign = std::tuple<uint64_t>;
-    using ParamPing = std::tuple<std::string>;
-    using ParamPong = std::tuple<std::string>;
-    using ParamTunnelReq = std::tuple<std::string, uint16_t, std::string, uint16_t, unsigned char, uint64_t>;
-    using ParamTunnelRes = std::tuple<uint64_t, bool, std::string>;
-
     /*
-     * Sequence generator used for parameter unpacking
+     * A msgpack string decoded in place. It points into the receive buffer and is only valid while the command is
+     * being handled, use str() to keep it.
      */
-    template<int...> struct seq {};
-    template<int N, int... S> struct gen_seq : gen_seq<N-1, N-1, S...> {};
-    template<int... S> struct gen_seq<0, S...> { typedef seq<S...> type; };
-
-
-    template<typename... Args>
-    void serialize_to_buffer(msgpack::sbuffer& buf, Args&&... args)
+    struct StrView
     {
-        msgpack::pack(buf, std::make_tuple(std::forward<Args>(args)...));
-    }
+        const char* ptr{nullptr};
+        uint32_t size{0};
 
+        std::string str() const { return std::string(ptr, size); }
+        bool empty() const { return size == 0; }
+    };
 
-    template<typename... Args>
-    msgpack::object_handle serialize(msgpack::sbuffer& buf, Args&&... args)
+    inline std::ostream& operator<<(std::ostream& os, const StrView& view)
     {
-        serialize_to_buffer(buf, std::forward<Args>(args)...);
-        msgpack::object_handle handle = msgpack::unpack(buf.data(), buf.size());
-        return handle;
+        return os.write(view.ptr, view.size);
     }
 
+    using ParamConnect = std::tuple<StrView>;
+    using ParamAssign = std::tuple<uint64_t>;
+    using ParamPing = std::tuple<StrView>;
+    using ParamPong = std::tuple<StrView>;
+    using ParamTunnelReq = std::tuple<StrView, uint16_t, StrView, uint16_t, unsigned char, uint64_t, StrView>;
+    using ParamTunnelRes = std::tuple<uint64_t, bool, StrView>;
+    using ParamStreamOpen = std::tuple<uint32_t, StrView, uint16_t, uint32_t>;
+    using ParamStreamData = std::tuple<uint32_t, msgpack::type::raw_ref>;
+    using ParamStreamWindow = std::tuple<uint32_t, uint32_t>;
+    using ParamStreamClose = std::tuple<uint32_t, bool>;
 
+    /*
+     * Write the whole [cmd, [args...]] frame straight into buf in one pass. Each argument is packed by the packer
+     * overload for its own type, so there is no intermediate buffer, unpack or zone.
+     */
     template<typename... Args>
     void create_command(TraneCommand cmd, msgpack::sbuffer &buf, Args&&... args)
     {
-        msgpack::sbuffer tmp;
-        auto handle = serialize(tmp, std::forward<Args>(args)...);
-        auto obj = handle.get();
-        msgpack::pack(buf, std::make_tuple(static_cast<unsigned char>(cmd), obj));
+        msgpack::packer<msgpack::sbuffer> pk(buf);
+        pk.pack_array(2);
+        pk.pack(static_cast<unsigned char>(cmd));
+        pk.pack_array(sizeof...(Args));
+        using expand = int[];
+        (void)expand{0, (pk.pack(std::forward<Args>(args)), 0)...};
     }
 
 
@@ -79,9 +82,9 @@ namespace trane{
     void cmd_tunnel_req(msgpack::sbuffer& buf,
                         const std::string& host_server, uint16_t port_server,
                         const std::string& host_client, uint16_t port_client,
-                        unsigned char trane_type, uint64_t tunnelid)
+                        unsigned char trane_type, uint64_t tunnelid, const std::string& codec)
     {
-        create_command(TUNNEL_REQ, buf, host_server, port_server, host_client, port_client, trane_type, tunnelid);
+        create_command(TUNNEL_REQ, buf, host_server, port_server, host_client, port_client, trane_type, tunnelid, codec);
     }
 
 
@@ -89,6 +92,54 @@ namespace trane{
     {
         create_command(TUNNEL_RES, buf, tunnelid, success, message);
     }
+
+
+    void cmd_stream_open(msgpack::sbuffer& buf, uint32_t streamid, const std::string& host, uint16_t port, uint32_t window)
+    {
+        create_command(STREAM_OPEN, buf, streamid, host, port, window);
+    }
+
+
+    void cmd_stream_data(msgpack::sbuffer& buf, uint32_t streamid, const msgpack::type::raw_ref& data)
+    {
+        create_command(STREAM_DATA, buf, streamid, data);
+    }
+
+
+    void cmd_stream_window(msgpack::sbuffer& buf, uint32_t streamid, uint32_t increment)
+    {
+        create_command(STREAM_WINDOW, buf, streamid, increment);
+    }
+
+
+    void cmd_stream_close(msgpack::sbuffer& buf, uint32_t streamid, bool reset)
+    {
+        create_command(STREAM_CLOSE, buf, streamid, reset);
+    }
 }
 
+
+namespace msgpack {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+    template<>
+    struct convert<trane::StrView>
+    {
+        msgpack::object const& operator()(msgpack::object const& obj, trane::StrView& view) const
+        {
+            if(obj.type != msgpack::type::STR)
+            {
+                throw msgpack::type_error();
+            }
+            view.ptr = obj.via.str.ptr;
+            view.size = obj.via.str.size;
+            return obj;
+        }
+    };
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS)
+} // namespace msgpack
+
 #endif
@@ -4,9 +4,26 @@
 #include "commands.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
 #include <functional>
+#include <iomanip>
 #include <msgpack.hpp>
 
+#ifdef __linux__
+#include <netinet/tcp.h>
+#endif
+
+#define TRANE_CMD_BUFSIZE 256               // initial size of a command buffer
+#define TRANE_CMD_SPARES 16                 // written command buffers kept for reuse per connection
+#define TRANE_CMD_RETAIN 4096               // command buffers that grew past this are freed instead
+#define TRANE_CMD_HIGH_WATERMARK (4 * TRANE_MUX_WINDOW)     // queued command bytes that mark a connection congested
+#define TRANE_CMD_LOW_WATERMARK (TRANE_MUX_WINDOW)          // queued command bytes that clear it again
+#define TRANE_CMD_QUEUE_LIMIT (64 * TRANE_MUX_WINDOW)       // queued command bytes that fail the connection
+
 namespace trane
 {
     enum ConnectionState : unsigned char
@@ -24,13 +41,14 @@ namespace trane
         static_assert(BufSize && ((BufSize & 0x3fff) == 0), "BufSize must be a non-zero multiple of 1024");
     public:
         typedef std::function<void(uint64_t)> ErrorHandler;
+        typedef std::function<void()> DrainHandler;
 
         Connection(asio::io_service& ios, uint64_t sessionid, ErrorHandler eh);
 
         /*
          * Event handlers.
          */
-        virtual void handle_write(std::shared_ptr<buf_t> buf, const asio::error_code& err, size_t bytes_transferred);
+        virtual void handle_write(size_t count, const asio::error_code& err, size_t bytes_transferred);
         virtual void handle_read(const asio::error_code& err, size_t bytes_transferred);
         virtual void handle_error(const asio::error_code& err);
 
@@ -43,9 +61,14 @@ namespace trane
         virtual void handle_cmd_pong(const msgpack::object& obj);           // client
         virtual void handle_cmd_tunnel_req(const msgpack::object& obj);     // client
         virtual void handle_cmd_tunnel_res(const msgpack::object& obj);     // server
+        virtual void handle_cmd_stream_open(const msgpack::object& obj);    // client
+        virtual void handle_cmd_stream_data(const msgpack::object& obj);    // both
+        virtual void handle_cmd_stream_window(const msgpack::object& obj);  // both
+        virtual void handle_cmd_stream_close(const msgpack::object& obj);   // both
 
         /*
-         * Command initiators
+         * Command initiators. Commands are queued and written in order, whatever is queued behind a write in flight
+         * goes out with the next one as a single gathered write.
          */
         template<typename F, typename... Args> void send_cmd(F func, Args&&... args);
 
@@ -55,14 +78,55 @@ namespace trane
         void send_cmd_pong(const std::string& message);
         void send_cmd_tunnel_req(const std::string& host_server, uint16_t port_server,
                                  const std::string& host_client, uint16_t port_client,
-                                 unsigned char trane_type, uint64_t tunnelid);
+                                 unsigned char trane_type, uint64_t tunnelid, const std::string& codec);
         void send_cmd_tunnel_res(uint64_t tunnelid, bool success, const std::string& message);
+        void send_cmd_stream_open(uint32_t streamid, const std::string& host, uint16_t port, uint32_t window);
+        void send_cmd_stream_data(uint32_t streamid, const msgpack::type::raw_ref& data);
+        void send_cmd_stream_window(uint32_t streamid, uint32_t increment);
+        void send_cmd_stream_close(uint32_t streamid, bool reset);
 
-        // reserve unpacker buffer and async read.
+        // reserve receive buffer space and async read.
         virtual void do_read();
 
+        // number of commands received so far
+        uint64_t received() const;
+
+        /*
+         * Backpressure. A connection is congested once more than TRANE_CMD_HIGH_WATERMARK bytes of commands are
+         * waiting to be written, bulk senders should hold off until the drain handler is called, which happens on the
+         * io_service once the queue is back under TRANE_CMD_LOW_WATERMARK. A queue past TRANE_CMD_QUEUE_LIMIT means the
+         * peer stopped reading, the connection fails rather than grow without bounds.
+         */
+        bool congested() const;
+        size_t queued() const;
+        uint64_t writes() const;
+        void set_drain_handler(DrainHandler handler);
+
+        /*
+         * Leave detecting a dead peer to the kernel. Keepalive probes start once the connection has been quiet for a
+         * third of timeout and give up after another third, and where TCP_USER_TIMEOUT is available data that stays
+         * unacknowledged for timeout fails the socket as well. The pending read then fails like any other error.
+         */
+        void set_keepalive(std::chrono::seconds timeout);
+
         // get a const ref to the internal socket
         const tcp::socket& socket() const;
+        tcp::socket& socket();
+
+        // the io_service the connection and everything it owns run on
+        asio::io_service& ios() const;
+
+        /*
+         * Fail the connection, once however many handlers run into errors. The socket is closed so that whatever is
+         * still pending on it is aborted, then handle_error tells the owner, who may drop the connection from within.
+         */
+        void fail(const asio::error_code& err);
+
+        /*
+         * Close the socket from outside of the connection's handlers, such as a timer. The read pending on it is
+         * aborted and fails the connection, so teardown takes the same path as any other error.
+         */
+        void close();
 
         // get state
         ConnectionState state() const;
@@ -73,13 +137,41 @@ namespace trane
     protected:
         void set_state(ConnectionState state);
 
+        /*
+         * What keeps the connection alive while its handlers are pending, captured by each of them. Connections owned
+         * through a shared_ptr hand out a reference to themselves, the others outlive the io_service's run.
+         */
+        virtual std::shared_ptr<void> lifeline();
+
+        size_t dispatch(const char* data, size_t size);
+
+        // keep a single write in flight so that queued commands reach the socket whole and in order
+        void do_write();
+
+        // command buffers are reused once written, so steady traffic does not allocate
+        std::shared_ptr<buf_t> acquire_buf();
+        void release_buf(std::shared_ptr<buf_t> buf);
+
         asio::io_service& m_ios;
         tcp::socket m_socket;
         ConnectionState m_state{INIT};
+        std::atomic<bool> m_failed{false};
         ErrorHandler m_eh;
         uint64_t m_sessionid;
-        msgpack::unpacker m_unpacker;
+        std::vector<char> m_rx_buf;
+        size_t m_rx_begin{0}, m_rx_end{0};
+        msgpack::zone m_zone;
+        uint64_t m_received{0};
+        std::deque<std::shared_ptr<buf_t>> m_outbox;
+        std::vector<asio::const_buffer> m_gather;
+        std::vector<std::shared_ptr<buf_t>> m_spare_bufs;
+        std::atomic<size_t> m_queued{0};
+        uint64_t m_writes{0};
+        std::atomic<bool> m_congested{false}, m_overflow{false};
+        DrainHandler m_on_drain;
+        bool m_writing{false};
         mutable std::mutex m_mu;
+        std::mutex m_spare_mu;
     };
 }
 
@@ -95,12 +187,23 @@ void trane::Connection<BufSize>::do_read()
 {
     if(state() == FAILED)
     {
-        std::cerr << "Failed State. Exiting.\n";
+        LOG(DEBUG) << "connection failed, not reading any more";
         return;
     }
-    m_unpacker.reserve_buffer(BufSize);
-    m_socket.async_read_some(asio::buffer(m_unpacker.buffer(), TRANE_BUFSIZE),
-        [this](const asio::error_code& err, size_t bytes_transferred){
+    // the unparsed tail of the last read moves to the front, with room for a whole read behind it
+    if(m_rx_begin > 0)
+    {
+        std::memmove(m_rx_buf.data(), m_rx_buf.data() + m_rx_begin, m_rx_end - m_rx_begin);
+        m_rx_end -= m_rx_begin;
+        m_rx_begin = 0;
+    }
+    if(m_rx_buf.size() - m_rx_end < BufSize)
+    {
+        m_rx_buf.resize(m_rx_end + BufSize);
+    }
+    auto self = this->lifeline();
+    m_socket.async_read_some(asio::buffer(m_rx_buf.data() + m_rx_end, m_rx_buf.size() - m_rx_end),
+        [this, self](const asio::error_code& err, size_t bytes_transferred){
             this->handle_read(err, bytes_transferred);
         }
     );
@@ -110,11 +213,40 @@ void trane::Connection<BufSize>::do_read()
 template<size_t BufSize>
 void trane::Connection<BufSize>::handle_error(const asio::error_code& err)
 {
-    std::cerr << "ERROR: " << err.category().name() << ": " << err.message() << '\n';
+    LOG(ERROR) << err.category().name() << ": " << err.message();
     this->m_eh(m_sessionid);
 }
 
 
+template<size_t BufSize>
+void trane::Connection<BufSize>::fail(const asio::error_code& err)
+{
+    if(m_failed.exchange(true))
+    {
+        return;
+    }
+    this->set_state(FAILED);
+    asio::error_code ec;
+    m_socket.close(ec);
+    this->handle_error(err);
+}
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::close()
+{
+    asio::error_code ec;
+    m_socket.close(ec);
+}
+
+
+template<size_t BufSize>
+std::shared_ptr<void> trane::Connection<BufSize>::lifeline()
+{
+    return nullptr;
+}
+
+
 template<size_t BufSize>
 const tcp::socket& trane::Connection<BufSize>::socket() const
 {
@@ -123,15 +255,171 @@ const tcp::socket& trane::Connection<BufSize>::socket() const
 
 
 template<size_t BufSize>
-void trane::Connection<BufSize>::handle_write(std::shared_ptr<buf_t> buf, const asio::error_code& err, size_t bytes_transferred)
+tcp::socket& trane::Connection<BufSize>::socket()
 {
-    (void)bytes_transferred;
+    return m_socket;
+}
+
+
+template<size_t BufSize>
+asio::io_service& trane::Connection<BufSize>::ios() const
+{
+    return m_ios;
+}
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::handle_write(size_t count, const asio::error_code& err, size_t bytes_transferred)
+{
+    m_writing = false;
+    for(size_t i = 0; i < count; ++i)
+    {
+        this->release_buf(std::move(m_outbox.front()));
+        m_outbox.pop_front();
+    }
     if(err)
     {
-        handle_error(err);
+        this->fail(err);
+        return;
+    }
+
+    m_queued -= bytes_transferred;
+    if(m_congested && m_queued <= TRANE_CMD_LOW_WATERMARK)
+    {
+        m_congested = false;
+        if(m_on_drain)
+        {
+            m_on_drain();
+        }
+    }
+    this->do_write();
+}
+
+
+/*
+ * Gather everything queued, up to TRANE_WRITE_GATHER commands, into a single write. Commands are never split between
+ * writes and only one write is in flight, so frames reach the socket whole and in order.
+ */
+template<size_t BufSize>
+void trane::Connection<BufSize>::do_write()
+{
+    if(m_writing || m_outbox.empty() || m_failed)
+    {
+        return;
+    }
+    m_writing = true;
+    m_gather.clear();
+    for(auto& buf : m_outbox)
+    {
+        if(m_gather.size() == TRANE_WRITE_GATHER)
+        {
+            break;
+        }
+        m_gather.push_back(asio::buffer(buf->data(), buf->size()));
+    }
+    size_t count = m_gather.size();
+    ++m_writes;
+    auto self = this->lifeline();
+    asio::async_write(m_socket, m_gather,
+        [this, self, count](const asio::error_code& err, size_t bytes_transferred){
+            this->handle_write(count, err, bytes_transferred);
+        }
+    );
+}
+
+
+template<size_t BufSize>
+bool trane::Connection<BufSize>::congested() const
+{
+    return m_congested;
+}
+
+
+template<size_t BufSize>
+size_t trane::Connection<BufSize>::queued() const
+{
+    return m_queued;
+}
+
+
+template<size_t BufSize>
+uint64_t trane::Connection<BufSize>::writes() const
+{
+    return m_writes;
+}
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::set_keepalive(std::chrono::seconds timeout)
+{
+    asio::error_code ec;
+    m_socket.set_option(asio::socket_base::keep_alive(true), ec);
+#ifdef __linux__
+    int idle = std::max<int>(1, timeout.count() / 3);
+    int interval = std::max<int>(1, timeout.count() / 9);
+    if(!ec)
+    {
+        m_socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPIDLE>(idle), ec);
+    }
+    if(!ec)
+    {
+        m_socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPINTVL>(interval), ec);
+    }
+    if(!ec)
+    {
+        m_socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_KEEPCNT>(3), ec);
+    }
+#ifdef TCP_USER_TIMEOUT
+    if(!ec)
+    {
+        m_socket.set_option(asio::detail::socket_option::integer<IPPROTO_TCP, TCP_USER_TIMEOUT>(timeout.count() * 1000), ec);
+    }
+#endif
+#endif
+    if(ec)
+    {
+        LOG(WARNING) << "could not enable keepalive: " << ec.message();
+    }
+}
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::set_drain_handler(DrainHandler handler)
+{
+    m_on_drain = std::move(handler);
+}
+
+
+template<size_t BufSize>
+std::shared_ptr<trane::buf_t> trane::Connection<BufSize>::acquire_buf()
+{
+    {
+        SCOPELOCK(m_spare_mu);
+        if(!m_spare_bufs.empty())
+        {
+            auto buf = std::move(m_spare_bufs.back());
+            m_spare_bufs.pop_back();
+            return buf;
+        }
+    }
+    return std::make_shared<buf_t>(TRANE_CMD_BUFSIZE);
+}
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::release_buf(std::shared_ptr<buf_t> buf)
+{
+    // the write is complete, so a reference the write handler may still hold is never read again
+    if(buf->size() > TRANE_CMD_RETAIN)
+    {
         return;
     }
-    (void)buf;
+    buf->clear();
+    SCOPELOCK(m_spare_mu);
+    if(m_spare_bufs.size() < TRANE_CMD_SPARES)
+    {
+        m_spare_bufs.push_back(std::move(buf));
+    }
 }
 
 
@@ -140,40 +428,97 @@ void trane::Connection<BufSize>::handle_read(const asio::error_code& err, size_t
 {
     if(err)
     {
-        std::cerr << "Error: " << err.message() << std::endl;
+        this->fail(err);
+        return;
+    }
+
+    m_rx_end += bytes_transferred;
+    try
+    {
+        m_rx_begin += this->dispatch(m_rx_buf.data() + m_rx_begin, m_rx_end - m_rx_begin);
+    }
+    catch(const msgpack::unpack_error& e)
+    {
+        LOG(ERROR) << "corrupt command stream: " << e.what();
+        this->fail(asio::error::invalid_argument);
+        return;
+    }
+    if(m_rx_begin == m_rx_end)
+    {
+        m_rx_begin = m_rx_end = 0;
     }
+    this->do_read();
+}
 
-    m_unpacker.buffer_consumed(bytes_transferred);
-    msgpack::object_handle handle;
-    while(m_unpacker.next(handle))
+
+/*
+ * Decode and handle every complete command in data, returning the bytes consumed. Strings and binary payloads are
+ * referenced in place rather than copied, everything else lives in a zone that is cleared, not freed, once the
+ * commands have been handled. Commands are dispatched through a table indexed by the command byte.
+ */
+template<size_t BufSize>
+size_t trane::Connection<BufSize>::dispatch(const char* data, size_t size)
+{
+    using Handler = void (Connection::*)(const msgpack::object&);
+    static const Handler handlers[] = {
+        &Connection::handle_cmd_connect,            // CONNECT
+        &Connection::handle_cmd_assign,             // ASSIGN
+        &Connection::handle_cmd_ping,               // PING
+        &Connection::handle_cmd_pong,               // PONG
+        &Connection::handle_cmd_tunnel_req,         // TUNNEL_REQ
+        &Connection::handle_cmd_tunnel_res,         // TUNNEL_RES
+        &Connection::handle_cmd_stream_open,        // STREAM_OPEN
+        &Connection::handle_cmd_stream_data,        // STREAM_DATA
+        &Connection::handle_cmd_stream_window,      // STREAM_WINDOW
+        &Connection::handle_cmd_stream_close,       // STREAM_CLOSE
+    };
+    static_assert(sizeof(handlers) / sizeof(handlers[0]) == STREAM_CLOSE + 1, "every command needs a handler");
+
+    size_t consumed = 0;
+    while(consumed < size)
     {
-        trane::command_t cmd;
-        auto tmp = handle.get();
-        tmp.convert(cmd);
-        auto obj = std::get<1>(cmd);
-        switch(std::get<0>(cmd))
+        size_t offset = consumed;
+        bool referenced;
+        msgpack::object msg;
+        try
         {
-        case TraneCommand::CONNECT:
-            handle_cmd_connect(obj);
-            break;
-        case TraneCommand::ASSIGN:
-            handle_cmd_assign(obj);
-            break;
-        case TraneCommand::PING:
-            handle_cmd_ping(obj);
-            break;
-        case TraneCommand::PONG:
-            handle_cmd_pong(obj);
-            break;
-        case TraneCommand::TUNNEL_REQ:
-            handle_cmd_tunnel_req(obj);
-            break;
-        case TraneCommand::TUNNEL_RES:
-            handle_cmd_tunnel_res(obj);
+            msg = msgpack::unpack(m_zone, data, size, offset, referenced,
+                [](msgpack::type::object_type, size_t, void*){ return true; });
+        }
+        catch(const msgpack::insufficient_bytes&)
+        {
+            // the rest of the command is still on its way
             break;
         }
+        consumed = offset;
+
+        // [cmd, [args...]]
+        if(msg.type != msgpack::type::ARRAY || msg.via.array.size != 2
+            || msg.via.array.ptr[0].type != msgpack::type::POSITIVE_INTEGER
+            || msg.via.array.ptr[0].via.u64 >= sizeof(handlers) / sizeof(handlers[0]))
+        {
+            LOG(WARNING) << "dropping malformed command";
+            continue;
+        }
+        try
+        {
+            (this->*handlers[msg.via.array.ptr[0].via.u64])(msg.via.array.ptr[1]);
+        }
+        catch(const msgpack::type_error&)
+        {
+            LOG(WARNING) << "dropping command " << std::dec << msg.via.array.ptr[0].via.u64 << " with bad arguments";
+        }
+        ++m_received;
     }
-    this->do_read();
+    m_zone.clear();
+    return consumed;
+}
+
+
+template<size_t BufSize>
+uint64_t trane::Connection<BufSize>::received() const
+{
+    return m_received;
 }
 
 
@@ -235,24 +580,63 @@ template<size_t BufSize>
 void trane::Connection<BufSize>::handle_cmd_tunnel_res(const msgpack::object& obj) { NOP(obj); }
 
 
+template<size_t BufSize>
+void trane::Connection<BufSize>::handle_cmd_stream_open(const msgpack::object& obj) { NOP(obj); }
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::handle_cmd_stream_data(const msgpack::object& obj) { NOP(obj); }
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::handle_cmd_stream_window(const msgpack::object& obj) { NOP(obj); }
+
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::handle_cmd_stream_close(const msgpack::object& obj) { NOP(obj); }
+
+
 template<size_t BufSize>
 template<typename F, typename... Args>
 void trane::Connection<BufSize>::send_cmd(F func, Args&&... args)
 {
-    auto buf = std::make_shared<buf_t>();
+    auto buf = this->acquire_buf();
     try{
         func(*buf, std::forward<Args>(args)...);
     } catch(const msgpack::type_error& err)
     {
         std::cerr << "Error Sending Command: " << err.what() << std::endl;
+        this->release_buf(std::move(buf));
         return;
     }
 
-    asio::async_write(m_socket, asio::buffer(buf->data(), buf->size()),
-        [this, buf](const asio::error_code& err, size_t bytes_transferred){
-            this->handle_write(buf, err, bytes_transferred);
+    size_t queued = m_queued += buf->size();
+    if(queued > TRANE_CMD_QUEUE_LIMIT)
+    {
+        m_queued -= buf->size();
+        this->release_buf(std::move(buf));
+        if(!m_overflow.exchange(true))
+        {
+            LOG(ERROR) << "session " << std::setfill('0') << std::setw(16) << std::hex << m_sessionid
+                << " is not reading its commands, dropping it";
+            auto self = this->lifeline();
+            m_ios.post([this, self]{
+                this->fail(asio::error::no_buffer_space);
+            });
         }
-    );
+        return;
+    }
+    if(queued > TRANE_CMD_HIGH_WATERMARK)
+    {
+        m_congested = true;
+    }
+
+    // commands may be issued from outside the io_service thread, so the outbox is only touched from within it
+    auto self = this->lifeline();
+    m_ios.dispatch([this, self, buf]{
+        this->m_outbox.push_back(buf);
+        this->do_write();
+    });
 }
 
 
@@ -279,9 +663,9 @@ void trane::Connection<BufSize>::send_cmd_pong(const std::string& message) {
 template<size_t BufSize>
 void trane::Connection<BufSize>::send_cmd_tunnel_req(const std::string& host_server, uint16_t port_server,
                                                      const std::string& host_client, uint16_t port_client,
-                                                     unsigned char trane_type, uint64_t tunnelid)
+                                                     unsigned char trane_type, uint64_t tunnelid, const std::string& codec)
 {
-    this->send_cmd(cmd_tunnel_req, host_server, port_server, host_client, port_client, trane_type, tunnelid);
+    this->send_cmd(cmd_tunnel_req, host_server, port_server, host_client, port_client, trane_type, tunnelid, codec);
 }
 
 template<size_t BufSize>
@@ -290,4 +674,28 @@ void trane::Connection<BufSize>::send_cmd_tunnel_res(uint64_t tunnelid, bool suc
     this->send_cmd(cmd_tunnel_res, tunnelid, success, message);
 }
 
+template<size_t BufSize>
+void trane::Connection<BufSize>::send_cmd_stream_open(uint32_t streamid, const std::string& host, uint16_t port, uint32_t window)
+{
+    this->send_cmd(cmd_stream_open, streamid, host, port, window);
+}
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::send_cmd_stream_data(uint32_t streamid, const msgpack::type::raw_ref& data)
+{
+    this->send_cmd(cmd_stream_data, streamid, data);
+}
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::send_cmd_stream_window(uint32_t streamid, uint32_t increment)
+{
+    this->send_cmd(cmd_stream_window, streamid, increment);
+}
+
+template<size_t BufSize>
+void trane::Connection<BufSize>::send_cmd_stream_close(uint32_t streamid, bool reset)
+{
+    this->send_cmd(cmd_stream_close, streamid, reset);
+}
+
 #endif
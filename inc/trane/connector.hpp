@@ -0,0 +1,356 @@
+#ifndef TRANE_CONNECTOR_HPP
+#define TRANE_CONNECTOR_HPP
+
+#include "asio_standalone.hpp"
+#include "utils.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define TRANE_CONNECT_DELAY 250             // milliseconds before the next address is tried while earlier ones are pending
+#define TRANE_CONNECT_HISTORY 4096          // addresses whose connect latency is remembered
+#define TRANE_CONNECT_PENALTY 10            // seconds of latency a failed address counts as when ordering
+
+namespace trane
+{
+    /*
+     * Connect latency of every address and port connected to lately, shared by all Connectors. Those that connected
+     * fast are tried first next time, those that failed last.
+     */
+    class ConnectHistory
+    {
+    public:
+        static ConnectHistory& instance();
+
+        void record(const asio::ip::address& address, uint16_t port, std::chrono::microseconds latency);
+        void fail(const asio::ip::address& address, uint16_t port);
+
+        // smoothed latency of an address and port, unknown ones count as one connect delay
+        std::chrono::microseconds latency(const asio::ip::address& address, uint16_t port) const;
+
+    private:
+        void update(const asio::ip::address& address, uint16_t port, std::chrono::microseconds latency);
+
+        mutable std::mutex m_mu;
+        std::unordered_map<std::string, std::chrono::microseconds> m_latency;
+    };
+
+
+    /*
+     * Connects a socket to the first of a list of endpoints that answers, in the manner of RFC 8305. Address families
+     * are interleaved and the known fast addresses put first, then a connect is started every TRANE_CONNECT_DELAY, or
+     * right away when the previous one failed, until one succeeds. The winner is moved into the socket and the others
+     * are closed. Handlers run on the io_service of the connector and never after it is destroyed or cancelled.
+     */
+    template<typename Proto>
+    class Connector
+    {
+    public:
+        typedef std::function<void(const asio::error_code& err)> Handler;
+
+        Connector(asio::io_service& ios);
+        ~Connector();
+
+        void connect(typename Proto::socket& sock, typename Proto::resolver::iterator endpoints, Handler handler);
+
+        // abandon every connect in flight
+        void cancel();
+
+    private:
+        struct Attempt
+        {
+            explicit Attempt(asio::io_service& ios) : sock{ios} { }
+
+            typename Proto::socket sock;
+            typename Proto::endpoint endpoint;
+            std::chrono::steady_clock::time_point begin;
+        };
+
+        struct Race : public std::enable_shared_from_this<Race>
+        {
+            Race(asio::io_service& ios, typename Proto::socket& sock, Handler handler);
+
+            void launch();
+            void handle_connect(size_t i, const asio::error_code& err);
+            void finish(const asio::error_code& err, size_t winner);
+
+            asio::io_service& ios;
+            typename Proto::socket& target;
+            Handler handler;
+            asio::steady_timer timer;
+            std::vector<typename Proto::endpoint> endpoints;
+            std::vector<std::unique_ptr<Attempt>> attempts;
+            size_t pending{0};
+            bool done{false};
+            asio::error_code error;
+        };
+
+        asio::io_service& m_ios;
+        std::vector<std::weak_ptr<Race>> m_races;
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline trane::ConnectHistory& trane::ConnectHistory::instance()
+{
+    static ConnectHistory history;
+    return history;
+}
+
+
+inline void trane::ConnectHistory::record(const asio::ip::address& address, uint16_t port, std::chrono::microseconds latency)
+{
+    this->update(address, port, latency);
+}
+
+
+inline void trane::ConnectHistory::fail(const asio::ip::address& address, uint16_t port)
+{
+    this->update(address, port, SEC(TRANE_CONNECT_PENALTY));
+}
+
+
+inline std::chrono::microseconds trane::ConnectHistory::latency(const asio::ip::address& address, uint16_t port) const
+{
+    SCOPELOCK(m_mu);
+    auto it = m_latency.find(address.to_string() + ' ' + std::to_string(port));
+    return it == m_latency.end() ? MSEC(TRANE_CONNECT_DELAY) : it->second;
+}
+
+
+/*
+ * Smoothed like TCP's SRTT, a new sample weighs an eighth
+ */
+inline void trane::ConnectHistory::update(const asio::ip::address& address, uint16_t port, std::chrono::microseconds latency)
+{
+    SCOPELOCK(m_mu);
+    if(m_latency.size() >= TRANE_CONNECT_HISTORY)
+    {
+        m_latency.clear();
+    }
+    auto result = m_latency.emplace(address.to_string() + ' ' + std::to_string(port), latency);
+    if(!result.second)
+    {
+        result.first->second += (latency - result.first->second) / 8;
+    }
+}
+
+
+template<typename Proto>
+trane::Connector<Proto>::Connector(asio::io_service& ios)
+    : m_ios{ios}
+{ }
+
+
+template<typename Proto>
+trane::Connector<Proto>::~Connector()
+{
+    this->cancel();
+}
+
+
+template<typename Proto>
+void trane::Connector<Proto>::connect(typename Proto::socket& sock, typename Proto::resolver::iterator endpoints, Handler handler)
+{
+    m_races.erase(std::remove_if(m_races.begin(), m_races.end(), [](const std::weak_ptr<Race>& race){
+        return race.expired();
+    }), m_races.end());
+
+    auto race = std::make_shared<Race>(m_ios, sock, handler);
+    for(typename Proto::resolver::iterator end; endpoints != end; ++endpoints)
+    {
+        race->endpoints.push_back(endpoints->endpoint());
+    }
+    if(race->endpoints.empty())
+    {
+        m_ios.post([race]{
+            race->finish(asio::error::host_not_found, 0);
+        });
+        m_races.push_back(race);
+        return;
+    }
+
+    // alternate the families, keeping the resolver's order within each, then put known fast addresses first
+    auto& list = race->endpoints;
+    std::stable_partition(list.begin(), list.end(), [](const typename Proto::endpoint& endpoint){
+        return endpoint.address().is_v6();
+    });
+    auto v4 = std::find_if(list.begin(), list.end(), [](const typename Proto::endpoint& endpoint){
+        return endpoint.address().is_v4();
+    });
+    std::vector<typename Proto::endpoint> ordered;
+    for(auto v6 = list.begin(), first_v4 = v4; v6 != first_v4 || v4 != list.end();)
+    {
+        if(v6 != first_v4)
+        {
+            ordered.push_back(*v6++);
+        }
+        if(v4 != list.end())
+        {
+            ordered.push_back(*v4++);
+        }
+    }
+    auto& history = ConnectHistory::instance();
+    std::vector<std::chrono::microseconds> latency;
+    for(const auto& endpoint : ordered)
+    {
+        latency.push_back(history.latency(endpoint.address(), endpoint.port()));
+    }
+    std::vector<size_t> order(ordered.size());
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&latency](size_t a, size_t b){
+        return latency[a] < latency[b];
+    });
+    for(size_t i = 0; i < order.size(); ++i)
+    {
+        list[i] = ordered[order[i]];
+    }
+
+    race->launch();
+    m_races.push_back(race);
+}
+
+
+template<typename Proto>
+void trane::Connector<Proto>::cancel()
+{
+    for(auto& weak : m_races)
+    {
+        if(auto race = weak.lock())
+        {
+            race->done = true;
+            race->handler = nullptr;
+            asio::error_code ec;
+            race->timer.cancel(ec);
+            for(auto& attempt : race->attempts)
+            {
+                attempt->sock.close(ec);
+            }
+        }
+    }
+    m_races.clear();
+}
+
+
+template<typename Proto>
+trane::Connector<Proto>::Race::Race(asio::io_service& ios, typename Proto::socket& sock, Handler handler)
+    : ios{ios}, target{sock}, handler{handler}, timer{ios}
+{ }
+
+
+/*
+ * Start a connect to the next address, and arm the delay after which the one after it is started
+ */
+template<typename Proto>
+void trane::Connector<Proto>::Race::launch()
+{
+    size_t i = attempts.size();
+    if(i >= endpoints.size())
+    {
+        return;
+    }
+    attempts.emplace_back(new Attempt(ios));
+    auto& attempt = *attempts.back();
+    attempt.endpoint = endpoints[i];
+    attempt.begin = std::chrono::steady_clock::now();
+    ++pending;
+    LOG(DEBUG) << "connecting to " << attempt.endpoint;
+
+    auto self = this->shared_from_this();
+    attempt.sock.async_connect(attempt.endpoint, [self, i](const asio::error_code& err){
+        self->handle_connect(i, err);
+    });
+    if(attempts.size() < endpoints.size())
+    {
+        timer.expires_after(MSEC(TRANE_CONNECT_DELAY));
+        // an expiry already queued when a failure cancelled the timer must not start another address
+        size_t launched = attempts.size();
+        timer.async_wait([self, launched](const asio::error_code& err){
+            if(!err && !self->done && self->attempts.size() == launched)
+            {
+                self->launch();
+            }
+        });
+    }
+}
+
+
+template<typename Proto>
+void trane::Connector<Proto>::Race::handle_connect(size_t i, const asio::error_code& err)
+{
+    if(done)
+    {
+        return;
+    }
+    --pending;
+    auto& attempt = *attempts[i];
+    if(!err)
+    {
+        ConnectHistory::instance().record(attempt.endpoint.address(), attempt.endpoint.port(),
+            std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - attempt.begin));
+        this->finish(err, i);
+        return;
+    }
+
+    LOG(DEBUG) << "could not connect to " << attempt.endpoint << ": " << err.message();
+    ConnectHistory::instance().fail(attempt.endpoint.address(), attempt.endpoint.port());
+    error = err;
+    asio::error_code ec;
+    attempt.sock.close(ec);
+    if(attempts.size() < endpoints.size())
+    {
+        timer.cancel(ec);
+        this->launch();
+    }
+    else if(pending == 0)
+    {
+        this->finish(error, i);
+    }
+}
+
+
+template<typename Proto>
+void trane::Connector<Proto>::Race::finish(const asio::error_code& err, size_t winner)
+{
+    if(done)
+    {
+        return;
+    }
+    done = true;
+    asio::error_code ec;
+    timer.cancel(ec);
+    for(size_t i = 0; i < attempts.size(); ++i)
+    {
+        if(i != winner || err)
+        {
+            attempts[i]->sock.close(ec);
+        }
+    }
+    if(!err)
+    {
+        target = std::move(attempts[winner]->sock);
+    }
+    auto callback = std::move(handler);
+    handler = nullptr;
+    if(callback)
+    {
+        callback(err);
+    }
+}
+
+#endif
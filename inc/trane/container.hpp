@@ -8,91 +8,159 @@
 #include <unordered_map>
 #include <memory>
 #include <mutex>
+#include <vector>
 
 namespace trane
 {
-    template<typename T>
+    /*
+     * Entries keyed by a unique random ID. The entries are split over a number of shards, each with a lock of its
+     * own, so adding, looking up and deleting entries from many threads rarely contends. Containers only used from a
+     * single shard of the io pool are fine with the one shard they have by default.
+     */
+    template<typename T, size_t Shards = 1>
     class Container
     {
+        static_assert(Shards && (Shards & (Shards - 1)) == 0, "Shards must be a power of two");
     public:
-        Container();
+        using Entry = std::pair<uint64_t, std::shared_ptr<T>>;
 
-        std::unordered_map<uint64_t, std::shared_ptr<T>>& entries();
-        const std::unordered_map<uint64_t, std::shared_ptr<T>>& entries() const;
-        trane::Random<std::mt19937_64>& random();
-
-        uint64_t add(std::shared_ptr<T>& ptr);
-        std::shared_ptr<T> get(uint64_t id);
+        uint64_t add(const std::shared_ptr<T>& ptr);
+        std::shared_ptr<T> get(uint64_t id) const;
         void del(uint64_t id);
+        size_t size() const;
+
+        // copy of every entry taken at a single point in time, safe to iterate while the container changes
+        std::vector<Entry> snapshot() const;
+
+        /*
+         * Call func with the ID of every entry and a reference to it, under the lock of its shard. No reference leaves
+         * the container, so an entry owned by another thread is never released on this one. func must not call back
+         * into the container.
+         */
+        template<typename F>
+        void for_each(F func) const;
 
     private:
-        std::mutex m_mu;
-        std::unordered_map<uint64_t, std::shared_ptr<T>> m_entries;
-        trane::Random<std::mt19937_64> m_random;
+        struct alignas(64) Shard
+        {
+            mutable std::mutex mu;
+            std::unordered_map<uint64_t, std::shared_ptr<T>> entries;
+        };
+
+        Shard& shard(uint64_t id);
+        const Shard& shard(uint64_t id) const;
+
+        Shard m_shards[Shards];
     };
 }
 
 
-template<typename T>
-trane::Container<T>::Container()
+template<typename T, size_t Shards>
+typename trane::Container<T, Shards>::Shard& trane::Container<T, Shards>::shard(uint64_t id)
 {
-    this->m_random.seed();
+    return m_shards[id & (Shards - 1)];
 }
 
 
-template<typename T>
-std::unordered_map<uint64_t, std::shared_ptr<T>>& trane::Container<T>::entries()
+template<typename T, size_t Shards>
+const typename trane::Container<T, Shards>::Shard& trane::Container<T, Shards>::shard(uint64_t id) const
 {
-    return this->m_entries;
+    return m_shards[id & (Shards - 1)];
 }
 
 
-template<typename T>
-const std::unordered_map<uint64_t, std::shared_ptr<T>>& trane::Container<T>::entries() const
+template<typename T, size_t Shards>
+uint64_t trane::Container<T, Shards>::add(const std::shared_ptr<T>& ptr)
 {
-    return this->m_entries;
+    // IDs never repeat, so there is no need to look for a free one
+    uint64_t id = unique_id();
+    auto& shard = this->shard(id);
+    SCOPELOCK(shard.mu);
+    shard.entries[id] = ptr;
+    return id;
 }
 
 
-template<typename T>
-trane::Random<std::mt19937_64>& trane::Container<T>::random()
+template<typename T, size_t Shards>
+std::shared_ptr<T> trane::Container<T, Shards>::get(uint64_t id) const
 {
-    return m_random;
+    auto& shard = this->shard(id);
+    SCOPELOCK(shard.mu);
+    auto entry = shard.entries.find(id);
+    if(entry == shard.entries.end())
+    {
+        return nullptr;
+    }
+    return entry->second;
 }
 
 
-template<typename T>
-uint64_t trane::Container<T>::add(std::shared_ptr<T>& ptr)
+template<typename T, size_t Shards>
+void trane::Container<T, Shards>::del(uint64_t id)
 {
-    SCOPELOCK(m_mu);
-    uint64_t id;
-    do
+    std::shared_ptr<T> ptr;
+    auto& shard = this->shard(id);
     {
-        id = this->m_random.gen();
-    }while(m_entries.find(id) != m_entries.end());
-    m_entries[id] = ptr;
-    return id;
+        SCOPELOCK(shard.mu);
+        auto entry = shard.entries.find(id);
+        if(entry == shard.entries.end())
+        {
+            return;
+        }
+        ptr = std::move(entry->second);
+        shard.entries.erase(entry);
+    }
+    // the entry may be destroyed here, outside of the lock
 }
 
 
-template<typename T>
-std::shared_ptr<T> trane::Container<T>::get(uint64_t id)
+template<typename T, size_t Shards>
+size_t trane::Container<T, Shards>::size() const
 {
-    SCOPELOCK(m_mu);
-    auto entry = m_entries.find(id);
-    if(entry == m_entries.end())
+    size_t size = 0;
+    for(auto& shard : m_shards)
     {
-        return nullptr;
+        SCOPELOCK(shard.mu);
+        size += shard.entries.size();
     }
-    return entry.second;
+    return size;
 }
 
 
-template<typename T>
-void trane::Container<T>::del(uint64_t id)
+template<typename T, size_t Shards>
+std::vector<typename trane::Container<T, Shards>::Entry> trane::Container<T, Shards>::snapshot() const
 {
-    SCOPELOCK(m_mu);
-    m_entries.erase(id);
+    // every other operation holds a single shard lock, so taking all of them in order cannot deadlock
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(Shards);
+    size_t size = 0;
+    for(auto& shard : m_shards)
+    {
+        locks.emplace_back(shard.mu);
+        size += shard.entries.size();
+    }
+    std::vector<Entry> entries;
+    entries.reserve(size);
+    for(auto& shard : m_shards)
+    {
+        entries.insert(entries.end(), shard.entries.begin(), shard.entries.end());
+    }
+    return entries;
+}
+
+
+template<typename T, size_t Shards>
+template<typename F>
+void trane::Container<T, Shards>::for_each(F func) const
+{
+    for(auto& shard : m_shards)
+    {
+        SCOPELOCK(shard.mu);
+        for(auto& entry : shard.entries)
+        {
+            func(entry.first, *entry.second);
+        }
+    }
 }
 
 #endif
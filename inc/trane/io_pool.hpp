@@ -0,0 +1,153 @@
+#ifndef TRANE_IO_POOL_HPP
+#define TRANE_IO_POOL_HPP
+
+#include "asio_standalone.hpp"
+#include "utils.hpp"
+#include "logging.hpp"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace trane
+{
+    /*
+     * One io_service per worker thread. Everything a session owns, its control connection and all of its tunnels, is
+     * created on a single shard and only ever runs on that shard's thread, so none of it needs locking. Work for a
+     * session coming from another thread has to be posted to the session's io_service.
+     */
+    class IoPool
+    {
+    public:
+        // zero shards means one per core
+        explicit IoPool(size_t shards = 1);
+        IoPool(const IoPool&) = delete;
+        IoPool& operator=(const IoPool&) = delete;
+        ~IoPool();
+
+        size_t size() const;
+        asio::io_service& get(size_t shard);
+
+        // shards are handed out round robin to spread new sessions over the threads
+        asio::io_service& next();
+
+        // pin shard i to core i modulo the number of cores, must be set before start()
+        void set_affinity(bool affinity);
+
+        // run every shard on a thread of its own, each keeps running while idle until stop()
+        void start();
+        void stop();
+
+    private:
+        std::vector<std::unique_ptr<asio::io_service>> m_shards;
+        std::vector<std::unique_ptr<asio::io_service::work>> m_work;
+        std::vector<std::thread> m_threads;
+        std::atomic<size_t> m_next{0};
+        bool m_affinity{false};
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline trane::IoPool::IoPool(size_t shards)
+{
+    if(shards == 0)
+    {
+        shards = std::thread::hardware_concurrency();
+        shards = shards ? shards : 1;
+    }
+    for(size_t i = 0; i < shards; ++i)
+    {
+        m_shards.emplace_back(new asio::io_service(1));
+    }
+}
+
+
+inline trane::IoPool::~IoPool()
+{
+    this->stop();
+}
+
+
+inline size_t trane::IoPool::size() const
+{
+    return m_shards.size();
+}
+
+
+inline asio::io_service& trane::IoPool::get(size_t shard)
+{
+    return *m_shards[shard % m_shards.size()];
+}
+
+
+inline asio::io_service& trane::IoPool::next()
+{
+    return this->get(m_next++);
+}
+
+
+inline void trane::IoPool::set_affinity(bool affinity)
+{
+    m_affinity = affinity;
+}
+
+
+inline void trane::IoPool::start()
+{
+    if(!m_threads.empty())
+    {
+        return;
+    }
+#ifdef __linux__
+    unsigned cores = std::thread::hardware_concurrency();
+#endif
+    for(size_t i = 0; i < m_shards.size(); ++i)
+    {
+        auto& ios = *m_shards[i];
+        m_work.emplace_back(new asio::io_service::work(ios));
+        m_threads.emplace_back([&ios]{
+            ios.run();
+        });
+#ifdef __linux__
+        if(m_affinity && cores)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cores, &cpus);
+            if(::pthread_setaffinity_np(m_threads.back().native_handle(), sizeof(cpus), &cpus) != 0)
+            {
+                LOG(WARNING) << "could not pin shard " << std::dec << i << " to core " << i % cores;
+            }
+        }
+#endif
+    }
+    LOG(DEBUG) << "running " << std::dec << m_shards.size() << " io shards";
+}
+
+
+inline void trane::IoPool::stop()
+{
+    m_work.clear();
+    for(auto& shard : m_shards)
+    {
+        shard->stop();
+    }
+    for(auto& thread : m_threads)
+    {
+        thread.join();
+    }
+    m_threads.clear();
+}
+
+#endif
@@ -1,8 +1,20 @@
 #ifndef TRANE_LOGGING_HPP
 #define TRANE_LOGGING_HPP
 
-#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 #ifdef ERROR
 #undef ERROR
@@ -17,6 +29,15 @@ enum LogLevel
     VERBOSE,
 };
 
+// levels above this are compiled out entirely, whatever LOGLEVEL says at runtime
+#ifndef TRANE_LOG_LEVEL
+#define TRANE_LOG_LEVEL VERBOSE
+#endif
+
+#define TRANE_LOG_RECORD 256                // bytes of arguments per log line, longer lines are cut short
+#define TRANE_LOG_RING 1024                 // log lines each thread may have waiting to be written
+#define TRANE_LOG_POLL 2                    // milliseconds the log thread sleeps when there is nothing to write
+
 constexpr const char * log_level_name(LogLevel level)
 {
     switch(level)
@@ -37,35 +58,511 @@ constexpr const char * log_level_name(LogLevel level)
     return "";
 }
 
+
+/*
+ * A log line as it was logged: where it came from and its arguments, not formatted yet. Numbers are stored along with
+ * the stream state they were logged with, so the log thread formats them as the logging thread would have.
+ */
+struct LogRecord
+{
+    LogLevel level;
+    const char* file;
+    const char* function;
+    unsigned line;
+    uint16_t size;
+    bool truncated;
+    char data[TRANE_LOG_RECORD];
+};
+
+
+/*
+ * Log lines of a single thread, written by that thread and read by the log thread without any lock. A line that does
+ * not fit is dropped and counted rather than have the logging thread wait.
+ */
+struct LogRing
+{
+    LogRing() : records(TRANE_LOG_RING) { }
+
+    std::vector<LogRecord> records;
+    alignas(64) std::atomic<size_t> head{0};        // next record the owner writes
+    alignas(64) std::atomic<size_t> tail{0};        // next record the log thread reads
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> orphaned{false};              // the owning thread exited
+};
+
+
+/*
+ * Formats and writes the log lines of every thread on a thread of its own. Lines still waiting are written when the
+ * process exits.
+ */
+class LogBackend
+{
+public:
+    static LogBackend& instance();
+    ~LogBackend();
+
+    // the calling thread's ring, registered on first use
+    LogRing& ring();
+
+    // write everything logged so far, from any thread
+    void flush();
+
+private:
+    LogBackend();
+
+    void run();
+    size_t drain(std::string& out);
+    void format(const LogRecord& record, std::string& out);
+
+    std::mutex m_mu;
+    std::vector<std::shared_ptr<LogRing>> m_rings;
+    std::ostringstream m_fmt;
+    std::atomic<bool> m_stop{false};
+    std::thread m_thread;
+};
+
+
+/*
+ * Captures a single log line into the calling thread's ring. Strings are copied and numbers stored as they are,
+ * anything else is formatted right away with the stream state of the line so far.
+ */
 class Logger
 {
 public:
-    Logger(LogLevel level = INFO)
+    enum Tag : char
     {
-        m_buf << log_level_name(level);
-    }
+        TEXT,
+        SIGNED,
+        UNSIGNED,
+        FLOAT,
+        CHAR,
+        BOOL,
+    };
 
-    template<typename T>
-    Logger& operator<<(const T& value)
+    struct Format
     {
-        m_buf << value;
-        return *this;
-    }
+        uint32_t flags;
+        uint16_t width, precision;
+        char fill;
+    };
 
-    ~Logger()
-    {
-        m_buf << '\n';
-        std::cerr << m_buf.str();
-    }
+    Logger(LogLevel level, const char* file, unsigned line, const char* function);
+    ~Logger();
+
+    Logger& operator<<(const std::string& value);
+    Logger& operator<<(const char* value);
+    Logger& operator<<(bool value);
+    // the manipulators used on hot paths skip the generic path below
+    Logger& operator<<(std::ios_base& (*manip)(std::ios_base&));
+    Logger& operator<<(decltype(std::setw(0)) manip);
+    Logger& operator<<(decltype(std::setfill('0')) manip);
+
+    // single byte integers are characters to a stream
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value && sizeof(T) == 1, Logger&>::type operator<<(T value);
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value && sizeof(T) != 1 && std::is_signed<T>::value, Logger&>::type operator<<(T value);
+    template<typename T>
+    typename std::enable_if<std::is_integral<T>::value && sizeof(T) != 1 && std::is_unsigned<T>::value, Logger&>::type operator<<(T value);
+    template<typename T>
+    typename std::enable_if<std::is_floating_point<T>::value, Logger&>::type operator<<(T value);
+    template<typename T>
+    typename std::enable_if<!std::is_arithmetic<T>::value, Logger&>::type operator<<(const T& value);
 
 protected:
-    std::ostringstream m_buf;
+    // scratch stream of the thread, holding the stream state of the line being logged
+    static std::ostringstream& stream();
+
+    void put_text(const char* text, size_t size);
+    template<typename T> void put_number(Tag tag, T value);
+    bool reserve(size_t size);
+
+    LogRing* m_ring;
+    LogRecord* m_record{nullptr};
 };
 
 extern LogLevel LOGLEVEL;
 
 #define LOG(level) \
-    if (level > LOGLEVEL) {} \
-    else Logger(level) << __FILE__ << ':' << std::dec << __LINE__ << " - " << __FUNCTION__ << ": "
+    if (level > TRANE_LOG_LEVEL || level > LOGLEVEL) {} \
+    else Logger(level, __FILE__, __LINE__, __FUNCTION__)
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline LogBackend& LogBackend::instance()
+{
+    static LogBackend backend;
+    return backend;
+}
+
+
+inline LogBackend::LogBackend()
+{
+    m_thread = std::thread([this]{
+        this->run();
+    });
+}
+
+
+inline LogBackend::~LogBackend()
+{
+    m_stop = true;
+    m_thread.join();
+}
+
+
+inline LogRing& LogBackend::ring()
+{
+    struct Holder
+    {
+        ~Holder()
+        {
+            if(ring)
+            {
+                ring->orphaned = true;
+            }
+        }
+        std::shared_ptr<LogRing> ring;
+    };
+    thread_local Holder holder;
+    if(!holder.ring)
+    {
+        holder.ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> lock(m_mu);
+        m_rings.push_back(holder.ring);
+    }
+    return *holder.ring;
+}
+
+
+inline void LogBackend::flush()
+{
+    std::string out;
+    this->drain(out);
+}
+
+
+inline void LogBackend::run()
+{
+    std::string out;
+    while(true)
+    {
+        // a last pass once stopped picks up whatever was logged while draining
+        bool stop = m_stop;
+        if(this->drain(out) == 0)
+        {
+            if(stop)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(TRANE_LOG_POLL));
+        }
+    }
+}
+
+
+inline size_t LogBackend::drain(std::string& out)
+{
+    std::lock_guard<std::mutex> lock(m_mu);
+    size_t lines = 0;
+    out.clear();
+    for(auto it = m_rings.begin(); it != m_rings.end();)
+    {
+        auto& ring = **it;
+        bool orphaned = ring.orphaned;
+        size_t head = ring.head.load(std::memory_order_acquire);
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        for(; tail != head; ++tail, ++lines)
+        {
+            this->format(ring.records[tail % TRANE_LOG_RING], out);
+            ring.tail.store(tail + 1, std::memory_order_release);
+        }
+        if(uint64_t dropped = ring.dropped.exchange(0))
+        {
+            out += log_level_name(WARNING);
+            out += std::to_string(dropped) + " log lines dropped\n";
+        }
+        it = orphaned ? m_rings.erase(it) : it + 1;
+    }
+    if(!out.empty())
+    {
+        std::cerr.write(out.data(), out.size());
+    }
+    return lines;
+}
+
+
+inline void LogBackend::format(const LogRecord& record, std::string& out)
+{
+    m_fmt.str(std::string());
+    m_fmt.flags(std::ios_base::dec | std::ios_base::skipws);
+    m_fmt << log_level_name(record.level) << record.file << ':' << record.line << " - " << record.function << ": ";
+
+    const char* pos = record.data;
+    const char* end = record.data + record.size;
+    while(pos < end)
+    {
+        Logger::Tag tag = static_cast<Logger::Tag>(*pos++);
+        if(tag == Logger::TEXT)
+        {
+            uint16_t size;
+            std::memcpy(&size, pos, sizeof(size));
+            m_fmt.write(pos + sizeof(size), size);
+            pos += sizeof(size) + size;
+            continue;
+        }
+        Logger::Format fmt;
+        std::memcpy(&fmt, pos, sizeof(fmt));
+        pos += sizeof(fmt);
+        m_fmt.flags(static_cast<std::ios_base::fmtflags>(fmt.flags));
+        m_fmt.width(fmt.width);
+        m_fmt.precision(fmt.precision);
+        m_fmt.fill(fmt.fill);
+        switch(tag)
+        {
+        case Logger::SIGNED:
+        {
+            int64_t value;
+            std::memcpy(&value, pos, sizeof(value));
+            m_fmt << value;
+            pos += sizeof(value);
+            break;
+        }
+        case Logger::UNSIGNED:
+        {
+            uint64_t value;
+            std::memcpy(&value, pos, sizeof(value));
+            m_fmt << value;
+            pos += sizeof(value);
+            break;
+        }
+        case Logger::FLOAT:
+        {
+            double value;
+            std::memcpy(&value, pos, sizeof(value));
+            m_fmt << value;
+            pos += sizeof(value);
+            break;
+        }
+        case Logger::CHAR:
+            m_fmt << *pos++;
+            break;
+        case Logger::BOOL:
+            m_fmt << static_cast<bool>(*pos++);
+            break;
+        default:
+            pos = end;
+            break;
+        }
+    }
+    if(record.truncated)
+    {
+        m_fmt << "...";
+    }
+    m_fmt << '\n';
+    out += m_fmt.str();
+}
+
+
+inline std::ostringstream& Logger::stream()
+{
+    thread_local std::ostringstream stream;
+    return stream;
+}
+
+
+inline Logger::Logger(LogLevel level, const char* file, unsigned line, const char* function)
+    : m_ring{&LogBackend::instance().ring()}
+{
+    size_t head = m_ring->head.load(std::memory_order_relaxed);
+    if(head - m_ring->tail.load(std::memory_order_acquire) >= TRANE_LOG_RING)
+    {
+        ++m_ring->dropped;
+        return;
+    }
+    m_record = &m_ring->records[head % TRANE_LOG_RING];
+    m_record->level = level;
+    m_record->file = file;
+    m_record->function = function;
+    m_record->line = line;
+    m_record->size = 0;
+    m_record->truncated = false;
+
+    auto& s = stream();
+    s.flags(std::ios_base::dec | std::ios_base::skipws);
+    s.width(0);
+    s.precision(6);
+    s.fill(' ');
+}
+
+
+inline Logger::~Logger()
+{
+    if(m_record)
+    {
+        m_ring->head.store(m_ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+}
+
+
+inline bool Logger::reserve(size_t size)
+{
+    if(!m_record || m_record->truncated)
+    {
+        return false;
+    }
+    if(m_record->size + size > TRANE_LOG_RECORD)
+    {
+        m_record->truncated = true;
+        return false;
+    }
+    return true;
+}
+
+
+inline void Logger::put_text(const char* text, size_t size)
+{
+    // the width of the stream pads strings as well
+    auto& s = stream();
+    if(static_cast<size_t>(s.width()) > size)
+    {
+        s << std::string(text, size);
+        std::string padded = s.str();
+        s.str(std::string());
+        this->put_text(padded.data(), padded.size());
+        return;
+    }
+    s.width(0);
+    if(!this->reserve(sizeof(Tag) + sizeof(uint16_t)))
+    {
+        return;
+    }
+    uint16_t chunk = static_cast<uint16_t>(std::min<size_t>(size, TRANE_LOG_RECORD - m_record->size - sizeof(Tag) - sizeof(uint16_t)));
+    char* pos = m_record->data + m_record->size;
+    *pos++ = TEXT;
+    std::memcpy(pos, &chunk, sizeof(chunk));
+    std::memcpy(pos + sizeof(chunk), text, chunk);
+    m_record->size += sizeof(Tag) + sizeof(chunk) + chunk;
+    m_record->truncated = chunk < size;
+}
+
+
+template<typename T>
+void Logger::put_number(Tag tag, T value)
+{
+    auto& s = stream();
+    Format fmt{static_cast<uint32_t>(s.flags()), static_cast<uint16_t>(s.width()), static_cast<uint16_t>(s.precision()), s.fill()};
+    s.width(0);
+    if(!this->reserve(sizeof(Tag) + sizeof(fmt) + sizeof(value)))
+    {
+        return;
+    }
+    char* pos = m_record->data + m_record->size;
+    *pos++ = tag;
+    std::memcpy(pos, &fmt, sizeof(fmt));
+    std::memcpy(pos + sizeof(fmt), &value, sizeof(value));
+    m_record->size += sizeof(Tag) + sizeof(fmt) + sizeof(value);
+}
+
+
+inline Logger& Logger::operator<<(const std::string& value)
+{
+    this->put_text(value.data(), value.size());
+    return *this;
+}
+
+
+inline Logger& Logger::operator<<(const char* value)
+{
+    this->put_text(value, std::strlen(value));
+    return *this;
+}
+
+
+inline Logger& Logger::operator<<(bool value)
+{
+    this->put_number(BOOL, static_cast<char>(value));
+    return *this;
+}
+
+
+inline Logger& Logger::operator<<(std::ios_base& (*manip)(std::ios_base&))
+{
+    manip(stream());
+    return *this;
+}
+
+
+inline Logger& Logger::operator<<(decltype(std::setw(0)) manip)
+{
+    stream() << manip;
+    return *this;
+}
+
+
+inline Logger& Logger::operator<<(decltype(std::setfill('0')) manip)
+{
+    stream() << manip;
+    return *this;
+}
+
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value && sizeof(T) == 1, Logger&>::type Logger::operator<<(T value)
+{
+    this->put_number(CHAR, static_cast<char>(value));
+    return *this;
+}
+
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value && sizeof(T) != 1 && std::is_signed<T>::value, Logger&>::type Logger::operator<<(T value)
+{
+    this->put_number(SIGNED, static_cast<int64_t>(value));
+    return *this;
+}
+
+
+template<typename T>
+typename std::enable_if<std::is_integral<T>::value && sizeof(T) != 1 && std::is_unsigned<T>::value, Logger&>::type Logger::operator<<(T value)
+{
+    this->put_number(UNSIGNED, static_cast<uint64_t>(value));
+    return *this;
+}
+
+
+template<typename T>
+typename std::enable_if<std::is_floating_point<T>::value, Logger&>::type Logger::operator<<(T value)
+{
+    this->put_number(FLOAT, static_cast<double>(value));
+    return *this;
+}
+
+
+/*
+ * Manipulators such as std::setw only change the state of the scratch stream. Other values are formatted on the spot.
+ */
+template<typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value, Logger&>::type Logger::operator<<(const T& value)
+{
+    if(!m_record)
+    {
+        return *this;
+    }
+    // the scratch stream is kept empty, so manipulators leave nothing to copy
+    auto& s = stream();
+    s << value;
+    if(s.tellp() > 0)
+    {
+        std::string text = s.str();
+        s.str(std::string());
+        this->put_text(text.data(), text.size());
+    }
+    return *this;
+}
 
 #endif
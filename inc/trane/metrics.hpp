@@ -0,0 +1,482 @@
+#ifndef TRANE_METRICS_HPP
+#define TRANE_METRICS_HPP
+
+#include "asio_standalone.hpp"
+#include "utils.hpp"
+#include "logging.hpp"
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define TRANE_METRICS_REQUEST 4096          // bytes of a request the stats endpoint reads before it answers anyway
+
+namespace trane
+{
+    /*
+     * A counter only one thread adds to and any thread may read. Adding is a plain load and store, no locked
+     * instruction, and is passed on to the parent counter, so a relay counts into its tunnel and its thread's share of
+     * the process totals with the same call. Every counter in a chain must only be added to from the same thread.
+     * Decrementing wraps around, which keeps sums of gauges right even when they are split over threads.
+     */
+    class Counter
+    {
+    public:
+        Counter() = default;
+        Counter(const Counter&) = delete;
+        Counter& operator=(const Counter&) = delete;
+
+        void set_parent(Counter* parent);
+        uint64_t value() const;
+
+        Counter& operator+=(uint64_t n);
+        Counter& operator-=(uint64_t n);
+        Counter& operator++();
+        Counter& operator--();
+
+        // add from any thread, only for counters nothing adds to with +=
+        void merge(uint64_t n);
+
+    private:
+        std::atomic<uint64_t> m_value{0};
+        Counter* m_parent{nullptr};
+    };
+
+
+    /*
+     * A copy of traffic counters taken for reporting
+     */
+    struct TrafficTotals
+    {
+        uint64_t bytes_up{0}, bytes_dn{0};      // bytes written upstream and downstream
+        uint64_t reads{0}, writes{0};
+        uint64_t connects{0}, errors{0};
+        uint64_t active{0};                     // connections being relayed
+        uint64_t tunnels{0};                    // open tunnels, filled in by whoever adds up the totals
+
+        TrafficTotals& operator+=(const TrafficTotals& other);
+    };
+
+
+    /*
+     * Traffic of a tunnel, a session or a thread. The counters of a tunnel are parented to those of the thread it
+     * runs on, see Metrics::local().
+     */
+    struct TrafficStats
+    {
+        Counter bytes_up, bytes_dn, reads, writes, connects, errors, active;
+
+        void set_parent(TrafficStats* parent);
+        TrafficTotals totals() const;
+
+        // fold in the totals of a tunnel that is gone, from any thread
+        void merge(const TrafficTotals& totals);
+    };
+
+
+    /*
+     * Process wide traffic, kept per thread so that no two threads ever add to the same counter. A thread's share
+     * outlives the thread so the totals never go back.
+     */
+    class Metrics
+    {
+    public:
+        // the calling thread's share, registered on first use
+        static TrafficStats& local();
+
+        // the sum of every thread's share
+        static TrafficTotals global();
+
+    private:
+        static Metrics& instance();
+
+        std::mutex m_mu;
+        std::vector<std::unique_ptr<TrafficStats>> m_threads;
+    };
+
+
+    /*
+     * One labelled series of traffic totals, the labels as they go between the braces
+     */
+    struct MetricSeries
+    {
+        std::string labels;
+        TrafficTotals traffic;
+    };
+
+    // label value of a session or tunnel ID, written the way the log writes them
+    std::string metric_id(uint64_t id);
+
+    /*
+     * Write series in the Prometheus text format, each counter as a metric named with the prefix. The tunnel gauge is
+     * left out for series of single tunnels.
+     */
+    void write_metrics(std::ostream& out, const std::string& prefix, const std::vector<MetricSeries>& series, bool tunnels);
+
+
+    /*
+     * Serves whatever the render callback writes as text/plain over HTTP/1.0 on a loopback port, one response per
+     * connection, for Prometheus to scrape or curl to read. Runs on the io_service it was created with.
+     */
+    class MetricsServer
+    {
+    public:
+        using Render = std::function<void(std::ostream&)>;
+
+        MetricsServer(asio::io_service& ios, Render render);
+
+        // listen on 127.0.0.1, false if the port is taken
+        bool listen(uint16_t port);
+
+        // stop accepting and drop the requests in flight
+        void close();
+
+    private:
+        struct Request
+        {
+            explicit Request(asio::io_service& ios) : sock{ios} { }
+
+            tcp::socket sock;
+            std::array<char, TRANE_METRICS_REQUEST> buf;
+            size_t size{0};
+            std::string response;
+        };
+
+        void do_accept();
+        void do_read(std::shared_ptr<Request> req);
+        void respond(std::shared_ptr<Request> req);
+        void finish(std::shared_ptr<Request> req);
+
+        asio::io_service& m_ios;
+        tcp::acceptor m_acceptor;
+        Render m_render;
+        std::set<std::shared_ptr<Request>> m_requests;
+        bool m_closed{false};
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline void trane::Counter::set_parent(Counter* parent)
+{
+    m_parent = parent;
+}
+
+
+inline uint64_t trane::Counter::value() const
+{
+    return m_value.load(std::memory_order_relaxed);
+}
+
+
+inline trane::Counter& trane::Counter::operator+=(uint64_t n)
+{
+    for(Counter* counter = this; counter; counter = counter->m_parent)
+    {
+        counter->m_value.store(counter->m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    return *this;
+}
+
+
+inline trane::Counter& trane::Counter::operator-=(uint64_t n)
+{
+    return *this += ~n + 1;
+}
+
+
+inline trane::Counter& trane::Counter::operator++()
+{
+    return *this += 1;
+}
+
+
+inline trane::Counter& trane::Counter::operator--()
+{
+    return *this -= 1;
+}
+
+
+inline void trane::Counter::merge(uint64_t n)
+{
+    m_value.fetch_add(n, std::memory_order_relaxed);
+}
+
+
+inline trane::TrafficTotals& trane::TrafficTotals::operator+=(const TrafficTotals& other)
+{
+    bytes_up += other.bytes_up;
+    bytes_dn += other.bytes_dn;
+    reads += other.reads;
+    writes += other.writes;
+    connects += other.connects;
+    errors += other.errors;
+    active += other.active;
+    tunnels += other.tunnels;
+    return *this;
+}
+
+
+inline void trane::TrafficStats::set_parent(TrafficStats* parent)
+{
+    bytes_up.set_parent(parent ? &parent->bytes_up : nullptr);
+    bytes_dn.set_parent(parent ? &parent->bytes_dn : nullptr);
+    reads.set_parent(parent ? &parent->reads : nullptr);
+    writes.set_parent(parent ? &parent->writes : nullptr);
+    connects.set_parent(parent ? &parent->connects : nullptr);
+    errors.set_parent(parent ? &parent->errors : nullptr);
+    active.set_parent(parent ? &parent->active : nullptr);
+}
+
+
+inline trane::TrafficTotals trane::TrafficStats::totals() const
+{
+    TrafficTotals totals;
+    totals.bytes_up = bytes_up.value();
+    totals.bytes_dn = bytes_dn.value();
+    totals.reads = reads.value();
+    totals.writes = writes.value();
+    totals.connects = connects.value();
+    totals.errors = errors.value();
+    totals.active = active.value();
+    return totals;
+}
+
+
+inline void trane::TrafficStats::merge(const TrafficTotals& totals)
+{
+    bytes_up.merge(totals.bytes_up);
+    bytes_dn.merge(totals.bytes_dn);
+    reads.merge(totals.reads);
+    writes.merge(totals.writes);
+    connects.merge(totals.connects);
+    errors.merge(totals.errors);
+    active.merge(totals.active);
+}
+
+
+inline trane::Metrics& trane::Metrics::instance()
+{
+    static Metrics metrics;
+    return metrics;
+}
+
+
+inline trane::TrafficStats& trane::Metrics::local()
+{
+    static thread_local TrafficStats* stats = []{
+        Metrics& metrics = instance();
+        SCOPELOCK(metrics.m_mu);
+        metrics.m_threads.emplace_back(new TrafficStats);
+        return metrics.m_threads.back().get();
+    }();
+    return *stats;
+}
+
+
+inline trane::TrafficTotals trane::Metrics::global()
+{
+    Metrics& metrics = instance();
+    TrafficTotals totals;
+    SCOPELOCK(metrics.m_mu);
+    for(auto& stats : metrics.m_threads)
+    {
+        totals += stats->totals();
+    }
+    return totals;
+}
+
+
+inline std::string trane::metric_id(uint64_t id)
+{
+    std::ostringstream oss;
+    oss << std::setfill('0') << std::setw(16) << std::hex << id;
+    return oss.str();
+}
+
+
+inline void trane::write_metrics(std::ostream& out, const std::string& prefix, const std::vector<MetricSeries>& series, bool tunnels)
+{
+    struct Family
+    {
+        const char* name;
+        const char* label;
+        const char* type;
+        const char* help;
+        uint64_t TrafficTotals::*value;
+    };
+    static const Family families[] = {
+        {"bytes_total", "direction=\"up\"", "counter", "Bytes relayed, by the direction they were written in", &TrafficTotals::bytes_up},
+        {"bytes_total", "direction=\"dn\"", nullptr, nullptr, &TrafficTotals::bytes_dn},
+        {"reads_total", "", "counter", "Reads made to relay the bytes", &TrafficTotals::reads},
+        {"writes_total", "", "counter", "Writes made to relay the bytes", &TrafficTotals::writes},
+        {"connects_total", "", "counter", "Connections relayed", &TrafficTotals::connects},
+        {"errors_total", "", "counter", "Connections that failed", &TrafficTotals::errors},
+        {"connections", "", "gauge", "Connections being relayed", &TrafficTotals::active},
+        {"tunnels", "", "gauge", "Open tunnels", &TrafficTotals::tunnels},
+    };
+    if(series.empty())
+    {
+        return;
+    }
+    out << std::dec;
+    for(auto& family : families)
+    {
+        if(!tunnels && family.value == &TrafficTotals::tunnels)
+        {
+            continue;
+        }
+        if(family.help)
+        {
+            out << "# HELP " << prefix << family.name << ' ' << family.help << '\n';
+            out << "# TYPE " << prefix << family.name << ' ' << family.type << '\n';
+        }
+        for(auto& s : series)
+        {
+            out << prefix << family.name;
+            const char* sep = *family.label && !s.labels.empty() ? "," : "";
+            if(*family.label || !s.labels.empty())
+            {
+                out << '{' << s.labels << sep << family.label << '}';
+            }
+            out << ' ' << s.traffic.*family.value << '\n';
+        }
+    }
+}
+
+
+inline trane::MetricsServer::MetricsServer(asio::io_service& ios, Render render)
+    : m_ios{ios}, m_acceptor{ios}, m_render{render}
+{ }
+
+
+inline bool trane::MetricsServer::listen(uint16_t port)
+{
+    asio::error_code ec;
+    tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+    m_acceptor.open(endpoint.protocol(), ec);
+    if(!ec)
+    {
+        m_acceptor.set_option(asio::socket_base::reuse_address(true), ec);
+    }
+    if(!ec)
+    {
+        m_acceptor.bind(endpoint, ec);
+    }
+    if(!ec)
+    {
+        m_acceptor.listen(asio::socket_base::max_listen_connections, ec);
+    }
+    if(ec)
+    {
+        LOG(ERROR) << "could not serve metrics on 127.0.0.1:" << std::dec << port << ": " << ec.message();
+        m_acceptor.close(ec);
+        return false;
+    }
+    LOG(INFO) << "Serving metrics on 127.0.0.1:" << std::dec << port;
+    this->do_accept();
+    return true;
+}
+
+
+inline void trane::MetricsServer::close()
+{
+    m_closed = true;
+    asio::error_code ec;
+    m_acceptor.close(ec);
+    for(auto& req : m_requests)
+    {
+        req->sock.close(ec);
+    }
+    m_requests.clear();
+}
+
+
+inline void trane::MetricsServer::do_accept()
+{
+    auto req = std::make_shared<Request>(m_ios);
+    m_acceptor.async_accept(req->sock,
+        [this, req](const asio::error_code& err){
+            if(err)
+            {
+                if(!m_closed)
+                {
+                    LOG(ERROR) << "metrics accept failed: " << err.message();
+                }
+                return;
+            }
+            this->m_requests.insert(req);
+            this->do_read(req);
+            this->do_accept();
+        }
+    );
+}
+
+
+/*
+ * The request itself does not matter, it is read up to the blank line that ends its header so the client is done
+ * sending by the time the connection is closed.
+ */
+inline void trane::MetricsServer::do_read(std::shared_ptr<Request> req)
+{
+    req->sock.async_read_some(asio::buffer(req->buf.data() + req->size, req->buf.size() - req->size),
+        [this, req](const asio::error_code& err, size_t bytes_transferred){
+            if(err)
+            {
+                this->finish(req);
+                return;
+            }
+            req->size += bytes_transferred;
+            std::string head(req->buf.data(), req->size);
+            if(req->size == req->buf.size() || head.find("\r\n\r\n") != std::string::npos || head.find("\n\n") != std::string::npos)
+            {
+                this->respond(req);
+                return;
+            }
+            this->do_read(req);
+        }
+    );
+}
+
+
+inline void trane::MetricsServer::respond(std::shared_ptr<Request> req)
+{
+    std::ostringstream body;
+    m_render(body);
+    std::string text = body.str();
+
+    std::ostringstream response;
+    response << "HTTP/1.0 200 OK\r\n"
+             << "Content-Type: text/plain; version=0.0.4\r\n"
+             << "Content-Length: " << std::dec << text.size() << "\r\n"
+             << "Connection: close\r\n\r\n"
+             << text;
+    req->response = response.str();
+    asio::async_write(req->sock, asio::buffer(req->response),
+        [this, req](const asio::error_code&, size_t){
+            this->finish(req);
+        }
+    );
+}
+
+
+inline void trane::MetricsServer::finish(std::shared_ptr<Request> req)
+{
+    asio::error_code ec;
+    req->sock.shutdown(asio::socket_base::shutdown_both, ec);
+    req->sock.close(ec);
+    m_requests.erase(req);
+}
+
+#endif
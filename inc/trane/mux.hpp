@@ -0,0 +1,667 @@
+#ifndef TRANE_MUX_HPP
+#define TRANE_MUX_HPP
+
+#include "asio_standalone.hpp"
+#include "buffer_pool.hpp"
+#include "commands.hpp"
+#include "logging.hpp"
+#include "port_pool.hpp"
+#include "resolver.hpp"
+#include "utils.hpp"
+
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace trane
+{
+    template<typename Conn, size_t BufSize> class Mux;
+
+    /*
+     * One TCP connection carried as a stream over a control connection. Bytes read from the socket are sent as
+     * STREAM_DATA frames, never more than the peer's window allows, and bytes received from the peer are written to
+     * the socket. Consumed bytes are handed back to the peer as STREAM_WINDOW credit, so a slow socket stalls only its
+     * own stream and never the control connection.
+     */
+    template<typename Conn, size_t BufSize>
+    class MuxStream : public std::enable_shared_from_this<MuxStream<Conn, BufSize>>
+    {
+    public:
+        MuxStream(Mux<Conn, BufSize>& mux, uint32_t streamid);
+        ~MuxStream();
+
+        tcp::socket& socket();
+        uint32_t streamid() const;
+        void set_streamid(uint32_t streamid);
+
+        // start relaying once the socket is connected. window is the number of bytes the peer is ready to receive
+        void start(uint32_t window);
+
+        /*
+         * Frame handlers
+         */
+        void handle_data(const char* data, size_t size);
+        void handle_window(uint32_t increment);
+        void handle_close(bool reset);
+
+        // drop the stream, telling the peer to do the same
+        void reset();
+
+        // read again after the control connection drained
+        void resume();
+
+    protected:
+        struct Chunk
+        {
+            Buffer buf;
+            size_t size;
+        };
+
+        void do_read();
+        void do_write();
+        void handle_read(const asio::error_code& err, size_t bytes_transferred);
+        void handle_write(const asio::error_code& err, size_t bytes_transferred);
+        void finish();
+
+        Mux<Conn, BufSize>& m_mux;
+        uint32_t m_streamid;
+        tcp::socket m_sock;
+        std::deque<Chunk> m_queue;      // received from the peer, waiting to be written to the socket
+        Buffer m_pending;
+        size_t m_window{0};             // bytes the peer is still prepared to receive
+        size_t m_queued{0};             // bytes received from the peer and not written yet
+        size_t m_consumed{0};           // bytes written to the socket and not yet credited back to the peer
+        bool m_started{false}, m_reading{false}, m_writing{false};
+        bool m_eof_local{false}, m_eof_remote{false}, m_closed{false};
+    };
+
+
+    /*
+     * The streams of a single control connection.
+     */
+    template<typename Conn, size_t BufSize>
+    class Mux
+    {
+    public:
+        using Stream = MuxStream<Conn, BufSize>;
+
+        Mux(asio::io_service& ios, Conn& conn);
+        ~Mux();
+
+        asio::io_service& io_service();
+        Conn& connection();
+
+        // register a stream opened by this side and give it an ID
+        uint32_t add(std::shared_ptr<Stream> stream);
+        std::shared_ptr<Stream> get(uint32_t streamid);
+        void remove(uint32_t streamid);
+        void close_all();
+
+        // let every stream read again once the control connection is no longer congested
+        void resume_all();
+
+        /*
+         * Decode frames from the control connection and route them to their stream. Returns the stream of an
+         * accepted STREAM_OPEN along with its destination and window so the caller can connect and start it.
+         */
+        std::shared_ptr<Stream> handle_open(const msgpack::object& obj, std::string& host, uint16_t& port, uint32_t& window);
+        void handle_data(const msgpack::object& obj);
+        void handle_window(const msgpack::object& obj);
+        void handle_close(const msgpack::object& obj);
+
+    private:
+        asio::io_service& m_ios;
+        Conn& m_conn;
+        uint32_t m_next{1};
+        std::unordered_map<uint32_t, std::shared_ptr<Stream>> m_streams;
+    };
+
+
+    /*
+     * Accepts admin connections on a single port and opens a stream to the client's host and port for each of them.
+     * Unlike a ServerProxy this needs no second port and no connection back from the client.
+     */
+    template<typename Conn, size_t BufSize>
+    class MuxListener
+    {
+    public:
+        MuxListener(Mux<Conn, BufSize>& mux, const std::string& host_client, uint16_t port_client);
+
+        // bind the admin listener to a port from the pool, given back when the listener is destroyed
+        bool open(PortPool& pool);
+        void listen();
+        void close();
+        uint16_t port() const;
+
+    protected:
+        void do_accept();
+        void handle_accept(std::shared_ptr<MuxStream<Conn, BufSize>> stream, const asio::error_code& err);
+
+        Mux<Conn, BufSize>& m_mux;
+        uint16_t m_port{0};
+        PortLease m_lease;
+        tcp::acceptor m_acceptor;
+        std::string m_host_client;
+        uint16_t m_port_client;
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+template<typename Conn, size_t BufSize>
+trane::MuxStream<Conn, BufSize>::MuxStream(Mux<Conn, BufSize>& mux, uint32_t streamid)
+    : m_mux{mux}, m_streamid{streamid}, m_sock{mux.io_service()}
+{ }
+
+
+template<typename Conn, size_t BufSize>
+trane::MuxStream<Conn, BufSize>::~MuxStream()
+{
+    LOG(VERBOSE);
+}
+
+
+template<typename Conn, size_t BufSize>
+tcp::socket& trane::MuxStream<Conn, BufSize>::socket()
+{
+    return m_sock;
+}
+
+
+template<typename Conn, size_t BufSize>
+uint32_t trane::MuxStream<Conn, BufSize>::streamid() const
+{
+    return m_streamid;
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::set_streamid(uint32_t streamid)
+{
+    m_streamid = streamid;
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::start(uint32_t window)
+{
+    if(m_closed)
+    {
+        return;
+    }
+    m_window = window;
+    m_started = true;
+    m_sock.non_blocking(true);
+    this->do_read();
+    this->do_write();
+}
+
+
+/*
+ * Wait for the socket to become readable before borrowing a buffer, so idle streams hold no memory. Reads are capped
+ * by the peer's window and stop altogether when it is exhausted until STREAM_WINDOW arrives, or while the control
+ * connection is congested until it drains.
+ */
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::do_read()
+{
+    if(m_closed || !m_started || m_reading || m_eof_local || m_window == 0 || m_mux.connection().congested())
+    {
+        return;
+    }
+
+    asio::error_code ec;
+    m_pending = BufferPool::instance().acquire(default_buffer_profile());
+    if(!m_pending)
+    {
+        this->handle_read(asio::error::no_buffer_space, 0);
+        return;
+    }
+    size_t size = m_pending.capacity() < m_window ? m_pending.capacity() : m_window;
+    size_t bytes_transferred = m_sock.read_some(asio::buffer(m_pending.data(), size), ec);
+    if(ec != asio::error::would_block && ec != asio::error::try_again)
+    {
+        this->handle_read(ec, bytes_transferred);
+        return;
+    }
+    m_pending.reset();
+
+    m_reading = true;
+    auto self = this->shared_from_this();
+    m_sock.async_wait(asio::socket_base::wait_read,
+        [this, self](const asio::error_code& err){
+            this->m_reading = false;
+            if(err)
+            {
+                this->handle_read(err, 0);
+                return;
+            }
+            this->do_read();
+        }
+    );
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::handle_read(const asio::error_code& err, size_t bytes_transferred)
+{
+    if(m_closed)
+    {
+        return;
+    }
+    if(err == asio::error::eof)
+    {
+        m_pending.reset();
+        m_eof_local = true;
+        m_mux.connection().send_cmd_stream_close(m_streamid, false);
+        this->finish();
+        return;
+    }
+    if(err)
+    {
+        LOG(DEBUG) << "stream " << std::dec << m_streamid << ": " << err.message();
+        this->reset();
+        return;
+    }
+
+    // the frame is packed into its own buffer, so the pooled one goes straight back
+    m_mux.connection().send_cmd_stream_data(m_streamid,
+        msgpack::type::raw_ref(reinterpret_cast<const char*>(m_pending.data()), static_cast<uint32_t>(bytes_transferred)));
+    m_pending.reset();
+    m_window -= bytes_transferred;
+    this->do_read();
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::do_write()
+{
+    if(m_closed || !m_started || m_writing || m_queue.empty())
+    {
+        return;
+    }
+    m_writing = true;
+    auto self = this->shared_from_this();
+    auto& chunk = m_queue.front();
+    asio::async_write(m_sock, asio::buffer(chunk.buf.data(), chunk.size),
+        [this, self](const asio::error_code& err, size_t bytes_transferred){
+            this->handle_write(err, bytes_transferred);
+        }
+    );
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::handle_write(const asio::error_code& err, size_t bytes_transferred)
+{
+    m_writing = false;
+    if(m_closed)
+    {
+        return;
+    }
+    if(err)
+    {
+        LOG(DEBUG) << "stream " << std::dec << m_streamid << ": " << err.message();
+        this->reset();
+        return;
+    }
+    m_queue.pop_front();
+    m_queued -= bytes_transferred;
+
+    // credit the peer in batches rather than once per chunk
+    m_consumed += bytes_transferred;
+    if(m_consumed >= TRANE_MUX_WINDOW / 4 || (m_queue.empty() && m_consumed >= BufferPool::profile_size(default_buffer_profile())))
+    {
+        m_mux.connection().send_cmd_stream_window(m_streamid, static_cast<uint32_t>(m_consumed));
+        m_consumed = 0;
+    }
+    this->do_write();
+    this->finish();
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::handle_data(const char* data, size_t size)
+{
+    if(m_closed || m_eof_remote)
+    {
+        return;
+    }
+    if(m_queued + size > TRANE_MUX_WINDOW)
+    {
+        LOG(WARNING) << "stream " << std::dec << m_streamid << " overran its window";
+        this->reset();
+        return;
+    }
+    while(size)
+    {
+        Chunk chunk{BufferPool::instance().acquire(default_buffer_profile()), 0};
+        if(!chunk.buf)
+        {
+            this->reset();
+            return;
+        }
+        chunk.size = size < chunk.buf.capacity() ? size : chunk.buf.capacity();
+        std::memcpy(chunk.buf.data(), data, chunk.size);
+        data += chunk.size;
+        size -= chunk.size;
+        m_queued += chunk.size;
+        m_queue.push_back(std::move(chunk));
+    }
+    this->do_write();
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::resume()
+{
+    this->do_read();
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::handle_window(uint32_t increment)
+{
+    m_window += increment;
+    this->do_read();
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::handle_close(bool reset)
+{
+    if(m_closed)
+    {
+        return;
+    }
+    if(reset)
+    {
+        m_closed = true;
+        asio::error_code ec;
+        m_sock.close(ec);
+        m_mux.remove(m_streamid);
+        return;
+    }
+    m_eof_remote = true;
+    this->finish();
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::reset()
+{
+    if(m_closed)
+    {
+        return;
+    }
+    m_mux.connection().send_cmd_stream_close(m_streamid, true);
+    this->handle_close(true);
+}
+
+
+/*
+ * Once the peer is done and everything it sent has been written, pass the EOF on to the socket. The stream is
+ * dropped when both directions are finished.
+ */
+template<typename Conn, size_t BufSize>
+void trane::MuxStream<Conn, BufSize>::finish()
+{
+    if(m_closed || !m_eof_remote || !m_queue.empty() || !m_started)
+    {
+        return;
+    }
+    asio::error_code ec;
+    m_sock.shutdown(tcp::socket::shutdown_send, ec);
+    if(m_eof_local)
+    {
+        m_closed = true;
+        m_sock.close(ec);
+        m_mux.remove(m_streamid);
+    }
+}
+
+
+template<typename Conn, size_t BufSize>
+trane::Mux<Conn, BufSize>::Mux(asio::io_service& ios, Conn& conn)
+    : m_ios{ios}, m_conn{conn}
+{
+    m_conn.set_drain_handler([this]{
+        this->resume_all();
+    });
+}
+
+
+template<typename Conn, size_t BufSize>
+trane::Mux<Conn, BufSize>::~Mux()
+{
+    this->close_all();
+}
+
+
+template<typename Conn, size_t BufSize>
+asio::io_service& trane::Mux<Conn, BufSize>::io_service()
+{
+    return m_ios;
+}
+
+
+template<typename Conn, size_t BufSize>
+Conn& trane::Mux<Conn, BufSize>::connection()
+{
+    return m_conn;
+}
+
+
+template<typename Conn, size_t BufSize>
+uint32_t trane::Mux<Conn, BufSize>::add(std::shared_ptr<Stream> stream)
+{
+    while(m_next == 0 || m_streams.find(m_next) != m_streams.end())
+    {
+        ++m_next;
+    }
+    uint32_t streamid = m_next++;
+    stream->set_streamid(streamid);
+    m_streams[streamid] = stream;
+    return streamid;
+}
+
+
+template<typename Conn, size_t BufSize>
+std::shared_ptr<trane::MuxStream<Conn, BufSize>> trane::Mux<Conn, BufSize>::get(uint32_t streamid)
+{
+    auto entry = m_streams.find(streamid);
+    if(entry == m_streams.end())
+    {
+        return nullptr;
+    }
+    return entry->second;
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::Mux<Conn, BufSize>::remove(uint32_t streamid)
+{
+    m_streams.erase(streamid);
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::Mux<Conn, BufSize>::close_all()
+{
+    auto streams = std::move(m_streams);
+    m_streams.clear();
+    for(auto& entry : streams)
+    {
+        entry.second->handle_close(true);
+    }
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::Mux<Conn, BufSize>::resume_all()
+{
+    // a stream may fail and remove itself while reading
+    std::vector<std::shared_ptr<Stream>> streams;
+    streams.reserve(m_streams.size());
+    for(auto& entry : m_streams)
+    {
+        streams.push_back(entry.second);
+    }
+    for(auto& stream : streams)
+    {
+        stream->resume();
+    }
+}
+
+
+template<typename Conn, size_t BufSize>
+std::shared_ptr<trane::MuxStream<Conn, BufSize>> trane::Mux<Conn, BufSize>::handle_open(const msgpack::object& obj, std::string& host, uint16_t& port, uint32_t& window)
+{
+    ParamStreamOpen param;
+    obj.convert(param);
+
+    if(m_streams.find(P0(param)) != m_streams.end())
+    {
+        LOG(WARNING) << "stream " << std::dec << P0(param) << " is already open";
+        return nullptr;
+    }
+    auto stream = std::make_shared<Stream>(*this, P0(param));
+    m_streams[P0(param)] = stream;
+    host = P1(param).str();
+    port = P2(param);
+    window = P3(param);
+    return stream;
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::Mux<Conn, BufSize>::handle_data(const msgpack::object& obj)
+{
+    ParamStreamData param;
+    obj.convert(param);
+
+    auto stream = this->get(P0(param));
+    if(stream == nullptr)
+    {
+        return;
+    }
+    stream->handle_data(P1(param).ptr, P1(param).size);
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::Mux<Conn, BufSize>::handle_window(const msgpack::object& obj)
+{
+    ParamStreamWindow param;
+    obj.convert(param);
+
+    auto stream = this->get(P0(param));
+    if(stream != nullptr)
+    {
+        stream->handle_window(P1(param));
+    }
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::Mux<Conn, BufSize>::handle_close(const msgpack::object& obj)
+{
+    ParamStreamClose param;
+    obj.convert(param);
+
+    auto stream = this->get(P0(param));
+    if(stream != nullptr)
+    {
+        stream->handle_close(P1(param));
+    }
+}
+
+
+template<typename Conn, size_t BufSize>
+trane::MuxListener<Conn, BufSize>::MuxListener(Mux<Conn, BufSize>& mux, const std::string& host_client, uint16_t port_client)
+    : m_mux{mux}, m_acceptor{mux.io_service()}, m_host_client{host_client}, m_port_client{port_client}
+{ }
+
+
+template<typename Conn, size_t BufSize>
+bool trane::MuxListener<Conn, BufSize>::open(PortPool& pool)
+{
+    asio::error_code ec;
+    if(!pool.bind(m_acceptor, m_lease))
+    {
+        return false;
+    }
+    m_acceptor.listen(asio::socket_base::max_listen_connections, ec);
+    if(ec)
+    {
+        LOG(ERROR) << "could not listen on port " << std::dec << m_lease.port() << ": " << ec.message();
+        return false;
+    }
+    m_port = m_lease.port();
+    return true;
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxListener<Conn, BufSize>::listen()
+{
+    LOG(INFO) << "Listening for multiplexed admin traffic on 0.0.0.0:" << std::dec << m_port;
+    this->do_accept();
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxListener<Conn, BufSize>::close()
+{
+    asio::error_code ec;
+    m_acceptor.close(ec);
+}
+
+
+template<typename Conn, size_t BufSize>
+uint16_t trane::MuxListener<Conn, BufSize>::port() const
+{
+    return m_port;
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxListener<Conn, BufSize>::do_accept()
+{
+    auto stream = std::make_shared<MuxStream<Conn, BufSize>>(m_mux, 0);
+    m_acceptor.async_accept(stream->socket(),
+        [this, stream](const asio::error_code& err)
+        {
+            this->handle_accept(stream, err);
+        }
+    );
+}
+
+
+template<typename Conn, size_t BufSize>
+void trane::MuxListener<Conn, BufSize>::handle_accept(std::shared_ptr<MuxStream<Conn, BufSize>> stream, const asio::error_code& err)
+{
+    if(err)
+    {
+        if(err != asio::error::operation_aborted)
+        {
+            LOG(ERROR) << err.message();
+        }
+        return;
+    }
+    uint32_t streamid = m_mux.add(stream);
+    LOG(DEBUG) << "Opening stream " << std::dec << streamid << " to " << m_host_client << ':' << m_port_client;
+    m_mux.connection().send_cmd_stream_open(streamid, m_host_client, m_port_client, TRANE_MUX_WINDOW);
+
+    // the client starts with the same window we advertise
+    stream->start(TRANE_MUX_WINDOW);
+    this->do_accept();
+}
+
+#endif
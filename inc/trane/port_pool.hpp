@@ -0,0 +1,316 @@
+#ifndef TRANE_PORT_POOL_HPP
+#define TRANE_PORT_POOL_HPP
+
+#include "asio_standalone.hpp"
+#include "utils.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#define TRANE_PORT_BIND_RETRIES 25          // ports tried when binding before giving up on a pool
+#define TRANE_PORT_QUARANTINE 30            // seconds a port some other process held is kept out of the pool
+
+namespace trane
+{
+    class PortPool;
+
+    /*
+     * A port on loan from a PortPool. It goes back to the pool when it is reset or destroyed.
+     */
+    class PortLease
+    {
+    public:
+        PortLease() = default;
+        PortLease(PortLease&& other);
+        PortLease& operator=(PortLease&& other);
+        PortLease(const PortLease&) = delete;
+        PortLease& operator=(const PortLease&) = delete;
+        ~PortLease();
+
+        uint16_t port() const;
+        void reset();
+
+    private:
+        friend class PortPool;
+        PortLease(PortPool* pool, uint16_t port);
+
+        PortPool* m_pool{nullptr};
+        uint16_t m_port{0};
+    };
+
+
+    /*
+     * Tracks which ports of a range are in use with a bitmap of free ports, plus a summary bitmap of the words that
+     * still have a free port, so finding one takes a couple of word scans however many are taken. Ports are handed
+     * out round robin, a released port is not reused until the rest of the range has been.
+     */
+    class PortPool
+    {
+    public:
+        PortPool(uint16_t begin, uint16_t end);
+
+        // the admin and tunnel port ranges, shared by all sessions of the process
+        static PortPool& admin();
+        static PortPool& client();
+
+        bool acquire(PortLease& lease);
+
+        /*
+         * Open and bind a socket or acceptor to a port from the pool. A port some other process holds, such as an
+         * ephemeral port of an outgoing connection, is quarantined for TRANE_PORT_QUARANTINE seconds and the next one
+         * is tried, up to TRANE_PORT_BIND_RETRIES times. No exception is thrown.
+         */
+        template<typename Socket>
+        bool bind(Socket& sock, PortLease& lease);
+
+        size_t available() const;
+
+    private:
+        friend class PortLease;
+
+        void release(uint16_t port);
+        void quarantine(uint16_t port);
+
+        // called with the lock held
+        void free_port(uint16_t port);
+        void release_quarantined();
+
+        static unsigned lowest_bit(uint64_t bits);
+
+        mutable std::mutex m_mu;
+        uint16_t m_begin, m_end;
+        std::vector<uint64_t> m_free, m_summary;
+        size_t m_cursor{0}, m_available{0};
+        std::deque<std::pair<uint16_t, std::chrono::steady_clock::time_point>> m_quarantine;
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline trane::PortLease::PortLease(PortPool* pool, uint16_t port)
+    : m_pool{pool}, m_port{port}
+{ }
+
+
+inline trane::PortLease::PortLease(PortLease&& other)
+    : m_pool{other.m_pool}, m_port{other.m_port}
+{
+    other.m_pool = nullptr;
+    other.m_port = 0;
+}
+
+
+inline trane::PortLease& trane::PortLease::operator=(PortLease&& other)
+{
+    if(this != &other)
+    {
+        this->reset();
+        m_pool = other.m_pool;
+        m_port = other.m_port;
+        other.m_pool = nullptr;
+        other.m_port = 0;
+    }
+    return *this;
+}
+
+
+inline trane::PortLease::~PortLease()
+{
+    this->reset();
+}
+
+
+inline uint16_t trane::PortLease::port() const
+{
+    return m_port;
+}
+
+
+inline void trane::PortLease::reset()
+{
+    if(m_pool)
+    {
+        m_pool->release(m_port);
+        m_pool = nullptr;
+        m_port = 0;
+    }
+}
+
+
+inline trane::PortPool::PortPool(uint16_t begin, uint16_t end)
+    : m_begin{begin}, m_end{end}
+{
+    size_t count = m_end - m_begin + 1;
+    m_free.assign((count + 63) / 64, ~0ULL);
+    m_summary.assign((m_free.size() + 63) / 64, 0);
+    if(count % 64)
+    {
+        m_free.back() = (1ULL << (count % 64)) - 1;
+    }
+    for(size_t i = 0; i < m_free.size(); ++i)
+    {
+        m_summary[i / 64] |= 1ULL << (i % 64);
+    }
+    m_available = count;
+}
+
+
+inline trane::PortPool& trane::PortPool::admin()
+{
+    static PortPool pool(TRANE_ADMIN_PORT_BEGIN, TRANE_ADMIN_PORT_END);
+    return pool;
+}
+
+
+inline trane::PortPool& trane::PortPool::client()
+{
+    static PortPool pool(TRANE_CLIENT_PORT_BEGIN, TRANE_CLIENT_PORT_END);
+    return pool;
+}
+
+
+inline unsigned trane::PortPool::lowest_bit(uint64_t bits)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(bits);
+#else
+    unsigned bit = 0;
+    while(!(bits & 1))
+    {
+        bits >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+
+inline bool trane::PortPool::acquire(PortLease& lease)
+{
+    // an old lease is given back first, outside of the lock
+    lease.reset();
+    SCOPELOCK(m_mu);
+    this->release_quarantined();
+    // look for a word with a free port at or after the cursor, wrapping around to the words before it last
+    size_t words = m_summary.size();
+    for(size_t k = 0; k <= words; ++k)
+    {
+        size_t s = (m_cursor / 64 + k) % words;
+        uint64_t bits = m_summary[s];
+        if(k == 0)
+        {
+            bits &= ~0ULL << (m_cursor % 64);
+        }
+        if(!bits)
+        {
+            continue;
+        }
+        size_t word = s * 64 + lowest_bit(bits);
+        unsigned bit = lowest_bit(m_free[word]);
+        m_free[word] &= ~(1ULL << bit);
+        if(!m_free[word])
+        {
+            m_summary[s] &= ~(1ULL << (word % 64));
+        }
+        m_cursor = (word + 1) % m_free.size();
+        --m_available;
+        lease.m_pool = this;
+        lease.m_port = static_cast<uint16_t>(m_begin + word * 64 + bit);
+        return true;
+    }
+    return false;
+}
+
+
+inline void trane::PortPool::release(uint16_t port)
+{
+    SCOPELOCK(m_mu);
+    this->free_port(port);
+}
+
+
+inline void trane::PortPool::quarantine(uint16_t port)
+{
+    SCOPELOCK(m_mu);
+    m_quarantine.emplace_back(port, std::chrono::steady_clock::now() + SEC(TRANE_PORT_QUARANTINE));
+}
+
+
+inline void trane::PortPool::free_port(uint16_t port)
+{
+    size_t index = port - m_begin;
+    size_t word = index / 64;
+    m_free[word] |= 1ULL << (index % 64);
+    m_summary[word / 64] |= 1ULL << (word % 64);
+    ++m_available;
+}
+
+
+// ports are quarantined for the same time, so the oldest come first
+inline void trane::PortPool::release_quarantined()
+{
+    auto now = std::chrono::steady_clock::now();
+    while(!m_quarantine.empty() && m_quarantine.front().second <= now)
+    {
+        this->free_port(m_quarantine.front().first);
+        m_quarantine.pop_front();
+    }
+}
+
+
+inline size_t trane::PortPool::available() const
+{
+    SCOPELOCK(m_mu);
+    return m_available;
+}
+
+
+template<typename Socket>
+bool trane::PortPool::bind(Socket& sock, PortLease& lease)
+{
+    using Proto = typename Socket::protocol_type;
+    for(int i = 0; i < TRANE_PORT_BIND_RETRIES; ++i)
+    {
+        PortLease candidate;
+        if(!this->acquire(candidate))
+        {
+            LOG(ERROR) << "no ports left between " << std::dec << m_begin << " and " << m_end;
+            return false;
+        }
+        asio::error_code ec;
+        sock.close(ec);
+        sock.open(Proto::v4(), ec);
+        if(!ec && std::is_same<Socket, tcp::acceptor>::value)
+        {
+            sock.set_option(asio::socket_base::reuse_address(true), ec);
+        }
+        if(!ec)
+        {
+            sock.bind(typename Proto::endpoint(Proto::v4(), candidate.port()), ec);
+        }
+        if(!ec)
+        {
+            lease = std::move(candidate);
+            return true;
+        }
+        // held outside of the pool, kept out of it for a while instead of being tried again right away
+        LOG(WARNING) << "port " << std::dec << candidate.port() << " is unavailable: " << ec.message();
+        this->quarantine(candidate.port());
+        candidate.m_pool = nullptr;
+    }
+    asio::error_code ec;
+    sock.close(ec);
+    LOG(ERROR) << "could not bind a port between " << std::dec << m_begin << " and " << m_end;
+    return false;
+}
+
+#endif
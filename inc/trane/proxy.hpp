@@ -3,12 +3,35 @@
 
 #include <iostream>
 #include <array>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <cstring>
 #include "asio_standalone.hpp"
+#include "buffer_pool.hpp"
+#include "codec.hpp"
+#include "metrics.hpp"
+#include "splice.hpp"
+#include "uring.hpp"
 #include "utils.hpp"
 #include "logging.hpp"
 
 namespace trane
 {
+    /*
+     * System calls a relay made to move its bytes. io_uring submissions are not counted.
+     */
+    struct RelayStats
+    {
+        uint64_t bytes_up{0}, bytes_dn{0};      // bytes written upstream and downstream
+        uint64_t reads{0}, writes{0};
+
+        RelayStats& operator+=(const RelayStats& other);
+        double syscalls_per_byte() const;
+    };
+
+
     template<typename Proto = tcp, size_t BufSize = TRANE_BUFSIZE>
     class Proxy
     {
@@ -27,6 +50,58 @@ namespace trane
         uint64_t tunnelid() const;
         uint64_t sessionid() const;
 
+        /*
+         * Relay tuning. Each direction stops reading once `high` bytes are queued for writing and resumes once the
+         * writer has drained it down to `low`. LOCKSTEP is simply a watermark of a single buffer. SPLICE and URING only
+         * apply to TCP tunnels where the kernel supports them and must be selected before the relay starts.
+         */
+        void set_relay_mode(RelayMode mode);
+        void set_watermarks(size_t low, size_t high);
+
+        /*
+         * Size of the pooled buffers used by the buffered relay modes
+         */
+        void set_buffer_profile(BufferProfile profile);
+
+        /*
+         * Compress data written upstream and decompress data read from upstream, so both ends of a data connection
+         * have to agree on the codec. Needs the data in user space, so SPLICE and URING fall back to PIPELINED.
+         * Returns false for an unknown codec.
+         */
+        bool set_codec(const std::string& name);
+
+        /*
+         * Whatever is queued while a write is outstanding goes out with the next write as one gathered writev. A
+         * non-zero window also holds back a write smaller than a relay buffer for up to that long so more data can
+         * join it, trading latency for fewer system calls on chatty tunnels.
+         */
+        void set_coalesce_window(std::chrono::microseconds window);
+
+        RelayStats stats() const;
+
+        /*
+         * Traffic counters of the owner the relay adds to along with its own, for metrics. They have to be added to
+         * from the proxy's thread only, and are let go of once the proxy is closed.
+         */
+        void set_traffic(TrafficStats* traffic);
+
+        // count the relay as a connection made, and as an active one until the proxy is closed
+        void count_connect();
+
+        /*
+         * The sockets, for callers that connect or accept them before starting the relay
+         */
+        tcp::socket& socket_up();
+        typename Proto::socket& socket_dn();
+
+        /*
+         * Close both sockets. The close handler is posted once the relay has finished in both directions or failed,
+         * so the owner can release the proxy.
+         */
+        void close();
+        void set_close_handler(std::function<void()> handler);
+        bool closed() const;
+
         /*
          * Perform socket reading
          */
@@ -35,10 +110,10 @@ namespace trane
 
 
         /*
-         * Perform socket writing
+         * Perform socket writing of whatever has been queued by the opposite reader
          */
-        virtual void do_up_write(size_t bytes_transferred);
-        virtual void do_dn_write(size_t bytes_transferred);
+        virtual void do_up_write();
+        virtual void do_dn_write();
 
         /*
          * Handle reading of data
@@ -52,22 +127,108 @@ namespace trane
         virtual void handle_up_write(const asio::error_code& err, size_t bytes_transferred);
         virtual void handle_dn_write(const asio::error_code& err, size_t bytes_transferred);
 
+        /*
+         * Handle readiness of a socket to be spliced into its direction's pipe
+         */
+        virtual void handle_up_splice(const asio::error_code& err);
+        virtual void handle_dn_splice(const asio::error_code& err);
+
     protected:
+        struct Chunk
+        {
+            Buffer buf;
+            size_t offset{0}, size{0};
+        };
+
+        /*
+         * One direction of the relay. Reads wait for readiness before borrowing a buffer from the pool, so an idle
+         * direction holds no memory. Chunks stay queued until the other socket has written them.
+         */
+        struct Channel
+        {
+            explicit Channel(asio::io_service& ios) : timer{ios}, backoff{ios} { }
+
+            Chunk pending;                                  // chunk filled by the last read
+            std::deque<Chunk> queue;                        // chunks waiting to be written
+            std::vector<asio::const_buffer> gather;         // the queued chunks being written
+            asio::steady_timer timer;                       // coalescing window of a small write
+            asio::steady_timer backoff;                     // wait for the buffer pool to refill
+            SplicePipe pipe;                                // only used in SPLICE mode
+            UringChannel<BufSize> ring;                     // only used in URING mode
+            size_t queued{0};
+            Counter reads, writes, bytes;
+            bool reading{false}, writing{false}, paused{false}, eof{false}, done{false}, coalescing{false};
+        };
+
+        bool should_read(Channel& chan);
+        bool should_resume(Channel& chan);
+
+        template<typename Socket>
+        bool try_read(Socket& sock, Channel& chan, asio::error_code& ec, size_t& bytes_transferred);
+
+        // the buffer pool ran dry, read again after TRANE_BUFFER_BACKOFF rather than fail the relay
+        void backoff_read(Channel& chan, void (Proxy::*do_read)());
+
+        template<typename Socket>
+        void splice_out(Socket& sock, Channel& chan, void (Proxy::*on_drained)());
+
+        // write a direction's queued chunks to the socket on the other side
+        template<typename Socket>
+        void write_out(Socket& sock, Channel& chan, void (Proxy::*on_written)(const asio::error_code&, size_t), bool flush = false);
+        void written(Channel& chan, size_t bytes_transferred);
+
+        // pass a direction's EOF on to the socket it was written to, closing the proxy once both are done
+        template<typename Socket>
+        void finish(Socket& sock, Channel& chan);
+        void set_done(Channel& chan);
+
+        // give up on both directions
+        void fail(const std::string& reason);
+
+        // stop counting into the owner's traffic counters
+        void release_traffic();
+
         uint64_t m_tunnelid, m_sessionid;
         asio::io_service& m_ios;
         tcp::socket m_sock_up;
         typename Proto::socket m_sock_dn;
-        std:: array<unsigned char, BufSize> m_buf_up, m_buf_dn;
+        Channel m_chan_up, m_chan_dn;       // data read from upstream and from downstream respectively
+        size_t m_low{TRANE_RELAY_LOW_WATERMARK}, m_high{TRANE_RELAY_HIGH_WATERMARK};
+        RelayMode m_mode{PIPELINED};
+        BufferProfile m_profile{default_buffer_profile()};
+        std::chrono::microseconds m_window{default_coalesce_window()};
+        std::unique_ptr<CodecEncoder> m_encoder;
+        std::unique_ptr<CodecDecoder> m_decoder;
+        std::function<void()> m_on_close;
+        TrafficStats* m_traffic{nullptr};
+        bool m_closed{false}, m_active{false};
     };
 }
 
 
+inline trane::RelayStats& trane::RelayStats::operator+=(const RelayStats& other)
+{
+    bytes_up += other.bytes_up;
+    bytes_dn += other.bytes_dn;
+    reads += other.reads;
+    writes += other.writes;
+    return *this;
+}
+
+
+inline double trane::RelayStats::syscalls_per_byte() const
+{
+    uint64_t bytes = bytes_up + bytes_dn;
+    return bytes ? static_cast<double>(reads + writes) / bytes : 0.0;
+}
+
 
 template<typename Proto, size_t BufSize>
 trane::Proxy<Proto, BufSize>::Proxy(asio::io_service& ios)
-    : m_ios{ios}, m_sock_up(ios), m_sock_dn{ios}
+    : m_ios{ios}, m_sock_up(ios), m_sock_dn{ios}, m_chan_up{ios}, m_chan_dn{ios}
 {
     LOG(VERBOSE);
+    this->set_relay_mode(default_relay_mode());
 }
 
 
@@ -75,6 +236,7 @@ template<typename Proto, size_t BufSize>
 trane::Proxy<Proto, BufSize>::~Proxy()
 {
     LOG(VERBOSE) << "DESTROYED";
+    this->release_traffic();
 }
 
 
@@ -106,13 +268,388 @@ uint64_t trane::Proxy<Proto, BufSize>::tunnelid() const
 }
 
 
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::set_relay_mode(RelayMode mode)
+{
+    m_chan_up.pipe.close();
+    m_chan_dn.pipe.close();
+    m_chan_up.ring.close();
+    m_chan_dn.ring.close();
+    if(m_encoder && (mode == SPLICE || mode == URING))
+    {
+        mode = PIPELINED;
+    }
+    m_mode = mode;
+
+    if(mode == SPLICE)
+    {
+        if(std::is_same<Proto, tcp>::value && m_chan_up.pipe.open() && m_chan_dn.pipe.open())
+        {
+            // the pipe is the queue, so pause once it is full and resume when half of it has drained
+            this->set_watermarks(m_chan_up.pipe.capacity() / 2, m_chan_up.pipe.capacity());
+            return;
+        }
+        LOG(WARNING) << "splice is unavailable, falling back to pipelined relay";
+        m_chan_up.pipe.close();
+        m_chan_dn.pipe.close();
+        m_mode = mode = PIPELINED;
+    }
+
+    if(mode == URING)
+    {
+        // the ring owns the buffers and its own backpressure, data is announced to the opposite writer. A failed
+        // receive or write closes both sides like in every other mode
+        auto on_fail = [this](int err){ this->fail(std::strerror(err)); };
+        if(std::is_same<Proto, tcp>::value
+            && m_chan_up.ring.open(m_ios, [this]{ this->do_dn_write(); }, [this]{ this->set_done(this->m_chan_up); }, on_fail)
+            && m_chan_dn.ring.open(m_ios, [this]{ this->do_up_write(); }, [this]{ this->set_done(this->m_chan_dn); }, on_fail))
+        {
+            m_chan_up.ring.count(m_chan_up.reads, m_chan_up.writes, m_chan_up.bytes);
+            m_chan_dn.ring.count(m_chan_dn.reads, m_chan_dn.writes, m_chan_dn.bytes);
+            return;
+        }
+        LOG(WARNING) << "io_uring is unavailable, falling back to pipelined relay";
+        m_chan_up.ring.close();
+        m_chan_dn.ring.close();
+        m_mode = mode = PIPELINED;
+    }
+
+    if(mode == LOCKSTEP)
+    {
+        this->set_watermarks(0, 1);
+    }
+    else
+    {
+        this->set_watermarks(TRANE_RELAY_LOW_WATERMARK, TRANE_RELAY_HIGH_WATERMARK);
+    }
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::set_watermarks(size_t low, size_t high)
+{
+    m_high = high ? high : 1;
+    m_low = low < m_high ? low : m_high - 1;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::set_buffer_profile(BufferProfile profile)
+{
+    m_profile = profile;
+}
+
+
+template<typename Proto, size_t BufSize>
+bool trane::Proxy<Proto, BufSize>::set_codec(const std::string& name)
+{
+    auto encoder = make_codec(name), decoder = make_codec(name);
+    if(!encoder || !decoder)
+    {
+        return false;
+    }
+    m_encoder.reset(new CodecEncoder(std::move(encoder)));
+    m_decoder.reset(new CodecDecoder(std::move(decoder)));
+    this->set_relay_mode(m_mode);
+    return true;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::set_coalesce_window(std::chrono::microseconds window)
+{
+    m_window = window;
+}
+
+
+template<typename Proto, size_t BufSize>
+trane::RelayStats trane::Proxy<Proto, BufSize>::stats() const
+{
+    RelayStats stats;
+    stats.bytes_up = m_chan_dn.bytes.value();
+    stats.bytes_dn = m_chan_up.bytes.value();
+    stats.reads = m_chan_up.reads.value() + m_chan_dn.reads.value();
+    stats.writes = m_chan_up.writes.value() + m_chan_dn.writes.value();
+    return stats;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::set_traffic(TrafficStats* traffic)
+{
+    this->release_traffic();
+    if(traffic == nullptr)
+    {
+        return;
+    }
+    m_traffic = traffic;
+    m_chan_up.reads.set_parent(&traffic->reads);
+    m_chan_dn.reads.set_parent(&traffic->reads);
+    m_chan_up.writes.set_parent(&traffic->writes);
+    m_chan_dn.writes.set_parent(&traffic->writes);
+    m_chan_up.bytes.set_parent(&traffic->bytes_dn);
+    m_chan_dn.bytes.set_parent(&traffic->bytes_up);
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::count_connect()
+{
+    if(m_traffic && !m_active)
+    {
+        ++m_traffic->connects;
+        ++m_traffic->active;
+        m_active = true;
+    }
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::release_traffic()
+{
+    if(m_traffic && m_active)
+    {
+        --m_traffic->active;
+    }
+    m_active = false;
+    m_traffic = nullptr;
+    m_chan_up.reads.set_parent(nullptr);
+    m_chan_dn.reads.set_parent(nullptr);
+    m_chan_up.writes.set_parent(nullptr);
+    m_chan_dn.writes.set_parent(nullptr);
+    m_chan_up.bytes.set_parent(nullptr);
+    m_chan_dn.bytes.set_parent(nullptr);
+}
+
+
+template<typename Proto, size_t BufSize>
+tcp::socket& trane::Proxy<Proto, BufSize>::socket_up()
+{
+    return m_sock_up;
+}
+
+
+template<typename Proto, size_t BufSize>
+typename Proto::socket& trane::Proxy<Proto, BufSize>::socket_dn()
+{
+    return m_sock_dn;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::close()
+{
+    if(m_closed)
+    {
+        return;
+    }
+    m_closed = true;
+    asio::error_code ec;
+    m_sock_up.close(ec);
+    m_sock_dn.close(ec);
+    m_chan_up.timer.cancel(ec);
+    m_chan_dn.timer.cancel(ec);
+    m_chan_up.backoff.cancel(ec);
+    m_chan_dn.backoff.cancel(ec);
+    this->release_traffic();
+    if(m_on_close)
+    {
+        // outstanding handlers are aborted first, the owner may destroy the proxy from within the close handler
+        m_ios.post(m_on_close);
+    }
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::set_close_handler(std::function<void()> handler)
+{
+    m_on_close = handler;
+}
+
+
+template<typename Proto, size_t BufSize>
+bool trane::Proxy<Proto, BufSize>::closed() const
+{
+    return m_closed;
+}
+
+
+template<typename Proto, size_t BufSize>
+template<typename Socket>
+void trane::Proxy<Proto, BufSize>::finish(Socket& sock, Channel& chan)
+{
+    if(chan.done)
+    {
+        return;
+    }
+    asio::error_code ec;
+    sock.shutdown(asio::socket_base::shutdown_send, ec);
+    this->set_done(chan);
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::set_done(Channel& chan)
+{
+    chan.done = true;
+    if(m_chan_up.done && m_chan_dn.done)
+    {
+        RelayStats stats = this->stats();
+        LOG(DEBUG) << "relay finished, " << std::dec << stats.reads + stats.writes << " system calls for "
+            << stats.bytes_up + stats.bytes_dn << " bytes";
+        if(m_encoder)
+        {
+            LOG(DEBUG) << "compressed " << std::dec << m_encoder->bytes_in() << " bytes to " << m_encoder->bytes_out();
+        }
+        this->close();
+    }
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::fail(const std::string& reason)
+{
+    if(m_closed)
+    {
+        return;
+    }
+    LOG(ERROR) << reason;
+    if(m_traffic)
+    {
+        ++m_traffic->errors;
+    }
+    this->close();
+}
+
+
+/*
+ * Non-blocking read into a freshly borrowed buffer. Returns false, with the buffer back in the pool, if the socket
+ * had nothing to read, and with no_buffer_space if the pool had no buffer to lend. Data on its way to the encoder
+ * leaves room in front for the frame header.
+ */
+template<typename Proto, size_t BufSize>
+template<typename Socket>
+bool trane::Proxy<Proto, BufSize>::try_read(Socket& sock, Channel& chan, asio::error_code& ec, size_t& bytes_transferred)
+{
+    chan.pending.buf = BufferPool::instance().acquire(m_profile);
+    if(!chan.pending.buf)
+    {
+        ec = asio::error::no_buffer_space;
+        bytes_transferred = 0;
+        return false;
+    }
+    chan.pending.offset = &chan == &m_chan_dn && m_encoder ? CodecEncoder::headroom : 0;
+    ++chan.reads;
+    bytes_transferred = sock.read_some(asio::buffer(chan.pending.buf.data() + chan.pending.offset, chan.pending.buf.capacity() - chan.pending.offset), ec);
+    if(ec == asio::error::would_block || ec == asio::error::try_again)
+    {
+        chan.pending.buf.reset();
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Buffers go back to the pool as the other relays write, so a read that found it empty only waits a moment. Nothing
+ * else starts the read meanwhile, as the direction is still marked reading.
+ */
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::backoff_read(Channel& chan, void (Proxy::*do_read)())
+{
+    LOG(DEBUG) << "no relay buffer left, reading again in " << std::dec << TRANE_BUFFER_BACKOFF << "ms";
+    chan.backoff.expires_after(MSEC(TRANE_BUFFER_BACKOFF));
+    chan.backoff.async_wait([this, &chan, do_read](const asio::error_code& err){
+        chan.reading = false;
+        if(!err && !this->m_closed)
+        {
+            (this->*do_read)();
+        }
+    });
+}
+
+
+/*
+ * A direction may start another read unless one is already outstanding, the peer has closed, or the writer has
+ * fallen behind by the high watermark.
+ */
+template<typename Proto, size_t BufSize>
+bool trane::Proxy<Proto, BufSize>::should_read(Channel& chan)
+{
+    if(chan.reading || chan.eof || chan.paused)
+    {
+        return false;
+    }
+    if(chan.queued >= m_high)
+    {
+        LOG(VERBOSE) << "pausing reads with " << std::dec << chan.queued << " bytes queued";
+        chan.paused = true;
+        return false;
+    }
+    return true;
+}
+
+
+template<typename Proto, size_t BufSize>
+bool trane::Proxy<Proto, BufSize>::should_resume(Channel& chan)
+{
+    if(chan.paused && chan.queued <= m_low)
+    {
+        chan.paused = false;
+        return true;
+    }
+    return false;
+}
+
+
 template<typename Proto, size_t BufSize>
 void trane::Proxy<Proto, BufSize>::do_up_read()
 {
+    if(m_mode == URING)
+    {
+        m_chan_up.ring.start(m_sock_up.native_handle());
+        return;
+    }
+    if(!should_read(m_chan_up))
+    {
+        return;
+    }
     LOG(VERBOSE) << "reading upstream";
-    m_sock_up.async_read_some(asio::buffer(m_buf_up.data(), BufSize),
-        [this](const asio::error_code& err, size_t bytes_transferred){
-            this->handle_up_read(err, bytes_transferred);
+    m_chan_up.reading = true;
+    asio::error_code ec;
+    if(!m_sock_up.non_blocking())
+    {
+        m_sock_up.non_blocking(true, ec);
+    }
+    if(m_mode == SPLICE)
+    {
+        m_sock_up.async_wait(asio::socket_base::wait_read,
+            [this](const asio::error_code& err){
+                this->handle_up_splice(err);
+            }
+        );
+        return;
+    }
+    size_t bytes_transferred;
+    if(this->try_read(m_sock_up, m_chan_up, ec, bytes_transferred))
+    {
+        this->handle_up_read(ec, bytes_transferred);
+        return;
+    }
+    if(ec == asio::error::no_buffer_space)
+    {
+        this->backoff_read(m_chan_up, &Proxy::do_up_read);
+        return;
+    }
+    m_sock_up.async_wait(asio::socket_base::wait_read,
+        [this](const asio::error_code& err){
+            this->m_chan_up.reading = false;
+            if(err)
+            {
+                this->handle_up_read(err, 0);
+                return;
+            }
+            this->do_up_read();
         }
     );
 }
@@ -121,103 +658,424 @@ void trane::Proxy<Proto, BufSize>::do_up_read()
 template<typename Proto, size_t BufSize>
 void trane::Proxy<Proto, BufSize>::do_dn_read()
 {
+    if(m_mode == URING)
+    {
+        m_chan_dn.ring.start(m_sock_dn.native_handle());
+        return;
+    }
+    if(!should_read(m_chan_dn))
+    {
+        return;
+    }
     LOG(VERBOSE) << "reading downstream";
     if(std::is_same<Proto, tcp>::value)
     {
-        m_sock_dn.async_read_some(asio::buffer(m_buf_dn.data(), BufSize),
-            [this](const asio::error_code& err, size_t bytes_transferred){
-                this->handle_dn_read(err, bytes_transferred);
+        m_chan_dn.reading = true;
+        asio::error_code ec;
+        if(!m_sock_dn.non_blocking())
+        {
+            m_sock_dn.non_blocking(true, ec);
+        }
+        if(m_mode == SPLICE)
+        {
+            m_sock_dn.async_wait(asio::socket_base::wait_read,
+                [this](const asio::error_code& err){
+                    this->handle_dn_splice(err);
+                }
+            );
+            return;
+        }
+        size_t bytes_transferred;
+        if(this->try_read(m_sock_dn, m_chan_dn, ec, bytes_transferred))
+        {
+            this->handle_dn_read(ec, bytes_transferred);
+            return;
+        }
+        if(ec == asio::error::no_buffer_space)
+        {
+            this->backoff_read(m_chan_dn, &Proxy::do_dn_read);
+            return;
+        }
+        m_sock_dn.async_wait(asio::socket_base::wait_read,
+            [this](const asio::error_code& err){
+                this->m_chan_dn.reading = false;
+                if(err)
+                {
+                    this->handle_dn_read(err, 0);
+                    return;
+                }
+                this->do_dn_read();
             }
         );
     }
-    /*
-     * TODO: Implement UDP
-     */
+    // UDP tunnels are relayed by UdpServerProxy and UdpClientProxy in udp_proxy.hpp
 }
 
 
 template<typename Proto, size_t BufSize>
-void trane::Proxy<Proto, BufSize>::do_up_write(size_t bytes_transferred)
+void trane::Proxy<Proto, BufSize>::do_up_write()
 {
-    LOG(VERBOSE) << "writing upstream";
-    asio::async_write(m_sock_up, asio::buffer(m_buf_dn.data(), bytes_transferred),
-        [this](const asio::error_code& err, size_t bytes_transferred)
-        {
-            this->handle_up_write(err, bytes_transferred);
-        }
-    );
+    if(m_mode == SPLICE)
+    {
+        this->splice_out(m_sock_up, m_chan_dn, &Proxy::do_dn_read);
+        return;
+    }
+    if(m_mode == URING)
+    {
+        m_chan_dn.ring.flush(m_sock_up.native_handle());
+        return;
+    }
+    this->write_out(m_sock_up, m_chan_dn, &Proxy::handle_up_write);
 }
 
 
 template<typename Proto, size_t BufSize>
-void trane::Proxy<Proto, BufSize>::do_dn_write(size_t bytes_transferred)
+void trane::Proxy<Proto, BufSize>::do_dn_write()
 {
-    LOG(VERBOSE) << "writing downstream";
+    if(m_mode == SPLICE)
+    {
+        this->splice_out(m_sock_dn, m_chan_up, &Proxy::do_up_read);
+        return;
+    }
+    if(m_mode == URING)
+    {
+        m_chan_up.ring.flush(m_sock_dn.native_handle());
+        return;
+    }
     if(std::is_same<Proto, tcp>::value)
     {
-        asio::async_write(m_sock_dn, asio::buffer(m_buf_up.data(), bytes_transferred),
-            [this](const asio::error_code& err, size_t bytes_transferred){
-                this->handle_dn_write(err, bytes_transferred);
-            }
-        );
+        this->write_out(m_sock_dn, m_chan_up, &Proxy::handle_dn_write);
     }
-    /*
-     * TODO: Handle UDP
-     */
+    // UDP tunnels are relayed by UdpServerProxy and UdpClientProxy in udp_proxy.hpp
 }
 
 
 template<typename Proto, size_t BufSize>
 void trane::Proxy<Proto, BufSize>::handle_up_read(const asio::error_code& err, size_t bytes_transferred)
 {
+    m_chan_up.reading = false;
+    Chunk chunk = std::move(m_chan_up.pending);
     if(err)
     {
-        LOG(ERROR) << err.message();
+        chunk.buf.reset();
+        m_chan_up.eof = true;
+        if(err != asio::error::eof)
+        {
+            this->fail(err.message());
+            return;
+        }
+        LOG(DEBUG) << "upstream closed";
+        if(m_decoder && !m_decoder->idle())
+        {
+            this->fail("upstream closed in the middle of a compressed frame");
+            return;
+        }
+        if(m_chan_up.queue.empty())
+        {
+            this->finish(m_sock_dn, m_chan_up);
+        }
         return;
     }
     LOG(VERBOSE) << "received " << std::dec << bytes_transferred << " from upstream";
-    this->do_dn_write(bytes_transferred);
+    if(m_decoder)
+    {
+        bool valid = m_decoder->decode(chunk.buf.data() + chunk.offset, bytes_transferred,
+            [this](Buffer&& buf, size_t size){
+                Chunk decoded;
+                decoded.buf = std::move(buf);
+                decoded.size = size;
+                this->m_chan_up.queued += size;
+                this->m_chan_up.queue.push_back(std::move(decoded));
+            }
+        );
+        if(!valid)
+        {
+            this->fail("corrupt compressed stream from upstream");
+            return;
+        }
+    }
+    else
+    {
+        chunk.size = bytes_transferred;
+        m_chan_up.queued += bytes_transferred;
+        m_chan_up.queue.push_back(std::move(chunk));
+    }
+    this->do_dn_write();
+    this->do_up_read();
 }
 
 
 template<typename Proto, size_t BufSize>
 void trane::Proxy<Proto, BufSize>::handle_dn_read(const asio::error_code& err, size_t bytes_transferred)
 {
+    m_chan_dn.reading = false;
+    Chunk chunk = std::move(m_chan_dn.pending);
     if(err)
     {
-        LOG(ERROR) << err.message();
+        chunk.buf.reset();
+        m_chan_dn.eof = true;
+        if(err != asio::error::eof)
+        {
+            this->fail(err.message());
+            return;
+        }
+        LOG(DEBUG) << "downstream closed";
+        if(m_chan_dn.queue.empty())
+        {
+            this->finish(m_sock_up, m_chan_dn);
+        }
         return;
     }
     LOG(VERBOSE) << "received " << std::dec << bytes_transferred << " from downstream";
-    this->do_up_write(bytes_transferred);
+    chunk.size = bytes_transferred;
+    if(m_encoder)
+    {
+        m_encoder->encode(chunk.buf, chunk.offset, chunk.size);
+    }
+    m_chan_dn.queued += chunk.size;
+    m_chan_dn.queue.push_back(std::move(chunk));
+    this->do_up_write();
+    this->do_dn_read();
 }
 
 
 template<typename Proto, size_t BufSize>
 void trane::Proxy<Proto, BufSize>::handle_up_write(const asio::error_code& err, size_t bytes_transferred)
 {
+    m_chan_dn.writing = false;
     if(err)
     {
-        LOG(ERROR) << err.message();
+        this->fail(err.message());
         return;
     }
     LOG(VERBOSE) << "sent " << std::dec << bytes_transferred << " bytes upstream";
-    NOP(bytes_transferred);
-    this->do_dn_read();
+    this->written(m_chan_dn, bytes_transferred);
+
+    if(m_chan_dn.eof && m_chan_dn.queue.empty())
+    {
+        this->finish(m_sock_up, m_chan_dn);
+        return;
+    }
+    if(this->should_resume(m_chan_dn))
+    {
+        this->do_dn_read();
+    }
+    this->do_up_write();
 }
 
 
 template<typename Proto, size_t BufSize>
 void trane::Proxy<Proto, BufSize>::handle_dn_write(const asio::error_code& err, size_t bytes_transferred)
 {
+    m_chan_up.writing = false;
     if(err)
     {
-        LOG(ERROR) << err.message();
+        this->fail(err.message());
         return;
     }
     LOG(VERBOSE) << "sent " << std::dec << bytes_transferred << " bytes downstream";
-    NOP(bytes_transferred);
+    this->written(m_chan_up, bytes_transferred);
+
+    if(m_chan_up.eof && m_chan_up.queue.empty())
+    {
+        this->finish(m_sock_dn, m_chan_up);
+        return;
+    }
+    if(this->should_resume(m_chan_up))
+    {
+        this->do_up_read();
+    }
+    this->do_dn_write();
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::handle_up_splice(const asio::error_code& err)
+{
+    m_chan_up.reading = false;
+    if(err)
+    {
+        this->fail(err.message());
+        return;
+    }
+    ++m_chan_up.reads;
+    long n = m_chan_up.pipe.fill(m_sock_up.native_handle());
+    if(n < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            this->do_up_read();
+            return;
+        }
+        m_chan_up.eof = true;
+        this->fail(std::strerror(errno));
+        return;
+    }
+    if(n == 0)
+    {
+        LOG(DEBUG) << "upstream closed";
+        m_chan_up.eof = true;
+        if(m_chan_up.pipe.buffered() == 0)
+        {
+            this->finish(m_sock_dn, m_chan_up);
+        }
+        return;
+    }
+    LOG(VERBOSE) << "spliced " << std::dec << n << " from upstream";
+    m_chan_up.queued = m_chan_up.pipe.buffered();
+    this->do_dn_write();
     this->do_up_read();
 }
 
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::handle_dn_splice(const asio::error_code& err)
+{
+    m_chan_dn.reading = false;
+    if(err)
+    {
+        this->fail(err.message());
+        return;
+    }
+    ++m_chan_dn.reads;
+    long n = m_chan_dn.pipe.fill(m_sock_dn.native_handle());
+    if(n < 0)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            this->do_dn_read();
+            return;
+        }
+        m_chan_dn.eof = true;
+        this->fail(std::strerror(errno));
+        return;
+    }
+    if(n == 0)
+    {
+        LOG(DEBUG) << "downstream closed";
+        m_chan_dn.eof = true;
+        if(m_chan_dn.pipe.buffered() == 0)
+        {
+            this->finish(m_sock_up, m_chan_dn);
+        }
+        return;
+    }
+    LOG(VERBOSE) << "spliced " << std::dec << n << " from downstream";
+    m_chan_dn.queued = m_chan_dn.pipe.buffered();
+    this->do_up_write();
+    this->do_dn_read();
+}
+
+
+/*
+ * Drain a direction's pipe into the socket on the other side. Whatever the socket does not accept stays in the pipe
+ * until the socket becomes writable again, which in turn keeps the reader paused once the pipe is full.
+ */
+template<typename Proto, size_t BufSize>
+template<typename Socket>
+void trane::Proxy<Proto, BufSize>::splice_out(Socket& sock, Channel& chan, void (Proxy::*on_drained)())
+{
+    if(chan.writing || chan.pipe.buffered() == 0)
+    {
+        return;
+    }
+    asio::error_code ec;
+    if(!sock.non_blocking())
+    {
+        sock.non_blocking(true, ec);
+    }
+    ++chan.writes;
+    long n = chan.pipe.drain(sock.native_handle());
+    if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+        this->fail(std::strerror(errno));
+        return;
+    }
+    chan.bytes += n > 0 ? n : 0;
+    chan.queued = chan.pipe.buffered();
+    if(chan.queued > 0)
+    {
+        chan.writing = true;
+        sock.async_wait(asio::socket_base::wait_write,
+            [this, &sock, &chan, on_drained](const asio::error_code& err){
+                chan.writing = false;
+                if(err)
+                {
+                    this->fail(err.message());
+                    return;
+                }
+                this->splice_out(sock, chan, on_drained);
+            }
+        );
+    }
+    else if(chan.eof)
+    {
+        this->finish(sock, chan);
+        return;
+    }
+    if(this->should_resume(chan))
+    {
+        (this->*on_drained)();
+    }
+}
+
+/*
+ * Gather as many queued chunks as one writev takes. A write smaller than a relay buffer waits out the coalescing
+ * window first, unless the direction has ended and nothing more is coming.
+ */
+template<typename Proto, size_t BufSize>
+template<typename Socket>
+void trane::Proxy<Proto, BufSize>::write_out(Socket& sock, Channel& chan, void (Proxy::*on_written)(const asio::error_code&, size_t), bool flush)
+{
+    if(chan.writing || chan.queue.empty())
+    {
+        return;
+    }
+    if(!flush && m_window.count() && !chan.eof && chan.queued < BufferPool::profile_size(m_profile))
+    {
+        if(!chan.coalescing)
+        {
+            chan.coalescing = true;
+            chan.timer.expires_after(m_window);
+            chan.timer.async_wait(
+                [this, &sock, &chan, on_written](const asio::error_code& err){
+                    chan.coalescing = false;
+                    if(!err)
+                    {
+                        this->write_out(sock, chan, on_written, true);
+                    }
+                }
+            );
+        }
+        return;
+    }
+
+    chan.writing = true;
+    chan.gather.clear();
+    for(auto& chunk : chan.queue)
+    {
+        if(chan.gather.size() == TRANE_WRITE_GATHER)
+        {
+            break;
+        }
+        chan.gather.push_back(asio::buffer(chunk.buf.data() + chunk.offset, chunk.size));
+    }
+    LOG(VERBOSE) << "writing " << std::dec << chan.gather.size() << " chunks";
+    ++chan.writes;
+    asio::async_write(sock, chan.gather,
+        [this, on_written](const asio::error_code& err, size_t bytes_transferred){
+            (this->*on_written)(err, bytes_transferred);
+        }
+    );
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::Proxy<Proto, BufSize>::written(Channel& chan, size_t bytes_transferred)
+{
+    chan.queued -= bytes_transferred;
+    chan.bytes += bytes_transferred;
+    chan.queue.erase(chan.queue.begin(), chan.queue.begin() + chan.gather.size());
+}
+
 #endif
@@ -3,7 +3,11 @@
 
 #include <random>
 #include <array>
+#include <atomic>
 #include <algorithm>
+#include <cstdint>
+
+#define TRANE_ID_BLOCK 1024                 // IDs a thread reserves at a time
 
 namespace trane
 {
@@ -24,6 +28,36 @@ namespace trane
         std::random_device m_rd;
         Generator m_gen;
     };
+
+    /*
+     * Random looking, non-zero 64 bit IDs that never repeat within the process. A counter is scrambled by the
+     * splitmix64 finalizer, which is a bijection, after adding a key drawn once per process. Threads reserve blocks of
+     * the counter so they only touch the shared atomic once every TRANE_ID_BLOCK IDs.
+     */
+    inline uint64_t unique_id()
+    {
+        static const uint64_t key = []{
+            std::random_device rd;
+            return (static_cast<uint64_t>(rd()) << 32) ^ rd();
+        }();
+        static std::atomic<uint64_t> counter{0};
+        thread_local uint64_t next = 0, end = 0;
+
+        uint64_t id;
+        do
+        {
+            if(next == end)
+            {
+                next = counter.fetch_add(TRANE_ID_BLOCK, std::memory_order_relaxed);
+                end = next + TRANE_ID_BLOCK;
+            }
+            uint64_t z = key + next++ * 0x9e3779b97f4a7c15ULL;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            id = z ^ (z >> 31);
+        }while(id == 0);
+        return id;
+    }
 }
 
 
@@ -2,11 +2,100 @@
 #define TRANE_RESOLVER_HPP
 
 #include "asio_standalone.hpp"
-#include <string>
+#include "utils.hpp"
+#include "logging.hpp"
+
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define TRANE_DNS_NEGATIVE_TTL 5            // seconds a failed lookup is remembered
+#define TRANE_DNS_STALE 300                 // seconds past its TTL an address is still used while it is looked up again
+#define TRANE_DNS_ENTRIES 4096              // names cached per protocol
+#define TRANE_DNS_THREADS 4                 // lookups running at once
 
 namespace trane
 {
+    /*
+     * Process wide cache of name lookups, shared by every Resolver of a protocol. getaddrinfo does not tell the TTL
+     * of a record, so addresses are kept for default_dns_ttl() and failures for TRANE_DNS_NEGATIVE_TTL. An address up
+     * to TRANE_DNS_STALE past its TTL is still answered right away while it is looked up again in the background.
+     * Concurrent requests for a name share one lookup. Lookups block a thread of their own, TRANE_DNS_THREADS of them
+     * run at once, so a slow name does not hold up the others.
+     */
+    template<typename Proto>
+    class DnsCache
+    {
+    public:
+        using Endpoints = std::vector<typename Proto::endpoint>;
+        using Callback = std::function<void(const asio::error_code&, const Endpoints&)>;
+
+        struct Stats
+        {
+            uint64_t hits{0}, stale{0}, misses{0}, lookups{0};
+        };
+
+        static DnsCache& instance();
+        ~DnsCache();
+
+        /*
+         * Call back on ios with the addresses of host, right away from the cache or once looked up. The io_service
+         * is kept running until then. A request is dropped if its owner cancels it first.
+         */
+        void resolve(asio::io_service& ios, const void* owner, const std::string& host, const std::string& port, Callback callback);
+        void cancel(const void* owner);
+
+        // look a name up ahead of time, unless it is cached or already being looked up
+        void prefetch(const std::string& host, const std::string& port);
+
+        Stats stats() const;
+        void clear();
+
+    private:
+        struct Waiter
+        {
+            const void* owner;
+            asio::io_service* ios;
+            std::shared_ptr<asio::io_service::work> work;
+            Callback callback;
+        };
+
+        struct Entry
+        {
+            Endpoints endpoints;
+            asio::error_code error;
+            std::chrono::steady_clock::time_point expires;
+            bool valid{false}, pending{false};
+            std::vector<Waiter> waiters;
+        };
+
+        DnsCache();
+
+        // called with the lock held
+        void lookup(const std::string& key, Entry& entry, const std::string& host, const std::string& port);
+        void evict();
+
+        void complete(const std::string& key, const asio::error_code& err, const Endpoints& endpoints);
+
+        mutable std::mutex m_mu;
+        std::unordered_map<std::string, Entry> m_entries;
+        Stats m_stats;
+        asio::io_service m_lookups;
+        std::unique_ptr<asio::io_service::work> m_work;
+        std::vector<std::thread> m_threads;
+    };
+
+
+    /*
+     * Name resolution for tunnels and control connections, answered from the DnsCache. Address literals are never
+     * looked up. Callbacks run on the resolver's io_service and are dropped once the resolver is destroyed.
+     */
     template<typename Proto>
     class Resolver
     {
@@ -15,25 +104,282 @@ namespace trane
     public:
         typedef std::function<void(const asio::error_code& ec, typename Proto::resolver::iterator)> Callback;
         Resolver(asio::io_service& ios);
+        virtual ~Resolver();
         virtual void resolve(const std::string& host, const std::string& port, Callback callback);
         virtual void resolve(const std::string& host, uint16_t port, Callback callback);
 
     private:
-        typename Proto::resolver m_resolver;
+        using Results = typename Proto::resolver::results_type;
+
+        asio::io_service& m_ios;
+        std::shared_ptr<bool> m_alive;
     };
 }
 
 
+/*
+ * IMPLEMENTATION
+ */
+
+
+template<typename Proto>
+trane::DnsCache<Proto>& trane::DnsCache<Proto>::instance()
+{
+    static DnsCache cache;
+    return cache;
+}
+
+
+template<typename Proto>
+trane::DnsCache<Proto>::DnsCache()
+    : m_work{new asio::io_service::work(m_lookups)}
+{
+    for(int i = 0; i < TRANE_DNS_THREADS; ++i)
+    {
+        m_threads.emplace_back([this]{
+            m_lookups.run();
+        });
+    }
+}
+
+
+template<typename Proto>
+trane::DnsCache<Proto>::~DnsCache()
+{
+    m_work.reset();
+    m_lookups.stop();
+    for(auto& thread : m_threads)
+    {
+        thread.join();
+    }
+}
+
+
+template<typename Proto>
+void trane::DnsCache<Proto>::resolve(asio::io_service& ios, const void* owner, const std::string& host, const std::string& port, Callback callback)
+{
+    std::string key = port + ' ' + host;
+    auto now = std::chrono::steady_clock::now();
+    SCOPELOCK(m_mu);
+    Entry& entry = m_entries[key];
+    if(entry.valid && now < entry.expires)
+    {
+        ++m_stats.hits;
+        auto error = entry.error;
+        auto endpoints = entry.endpoints;
+        ios.post([callback, error, endpoints]{
+            callback(error, endpoints);
+        });
+        return;
+    }
+    if(entry.valid && !entry.error && now < entry.expires + SEC(TRANE_DNS_STALE))
+    {
+        ++m_stats.stale;
+        auto endpoints = entry.endpoints;
+        ios.post([callback, endpoints]{
+            callback(asio::error_code(), endpoints);
+        });
+        if(!entry.pending)
+        {
+            this->lookup(key, entry, host, port);
+        }
+        return;
+    }
+    ++m_stats.misses;
+    entry.waiters.push_back({owner, &ios, std::make_shared<asio::io_service::work>(ios), callback});
+    if(!entry.pending)
+    {
+        this->lookup(key, entry, host, port);
+    }
+}
+
+
+template<typename Proto>
+void trane::DnsCache<Proto>::cancel(const void* owner)
+{
+    std::vector<Waiter> cancelled;
+    {
+        SCOPELOCK(m_mu);
+        for(auto& entry : m_entries)
+        {
+            auto& waiters = entry.second.waiters;
+            for(auto waiter = waiters.begin(); waiter != waiters.end();)
+            {
+                if(waiter->owner == owner)
+                {
+                    cancelled.push_back(std::move(*waiter));
+                    waiter = waiters.erase(waiter);
+                }
+                else
+                {
+                    ++waiter;
+                }
+            }
+        }
+    }
+    // the callbacks may own the canceller, so they go outside of the lock
+    cancelled.clear();
+}
+
+
+template<typename Proto>
+void trane::DnsCache<Proto>::prefetch(const std::string& host, const std::string& port)
+{
+    std::string key = port + ' ' + host;
+    SCOPELOCK(m_mu);
+    Entry& entry = m_entries[key];
+    if(entry.pending || (entry.valid && std::chrono::steady_clock::now() < entry.expires))
+    {
+        return;
+    }
+    this->lookup(key, entry, host, port);
+}
+
+
+template<typename Proto>
+typename trane::DnsCache<Proto>::Stats trane::DnsCache<Proto>::stats() const
+{
+    SCOPELOCK(m_mu);
+    return m_stats;
+}
+
+
+template<typename Proto>
+void trane::DnsCache<Proto>::clear()
+{
+    SCOPELOCK(m_mu);
+    for(auto entry = m_entries.begin(); entry != m_entries.end();)
+    {
+        entry = entry->second.pending ? std::next(entry) : m_entries.erase(entry);
+    }
+}
+
+
+template<typename Proto>
+void trane::DnsCache<Proto>::lookup(const std::string& key, Entry& entry, const std::string& host, const std::string& port)
+{
+    ++m_stats.lookups;
+    entry.pending = true;
+    if(m_entries.size() > TRANE_DNS_ENTRIES)
+    {
+        this->evict();
+    }
+    m_lookups.post([this, key, host, port]{
+        asio::error_code ec;
+        typename Proto::resolver resolver(m_lookups);
+        Endpoints endpoints;
+        for(auto& result : resolver.resolve(host, port, ec))
+        {
+            endpoints.push_back(result.endpoint());
+        }
+        if(!ec && endpoints.empty())
+        {
+            ec = asio::error::host_not_found;
+        }
+        this->complete(key, ec, endpoints);
+    });
+}
+
+
+/*
+ * Entries nobody waits for go, those past their stale time first and then any, until a tenth of the cache is free
+ */
+template<typename Proto>
+void trane::DnsCache<Proto>::evict()
+{
+    auto now = std::chrono::steady_clock::now();
+    for(auto entry = m_entries.begin(); entry != m_entries.end();)
+    {
+        bool expired = entry->second.valid && now > entry->second.expires + SEC(TRANE_DNS_STALE);
+        entry = expired && !entry->second.pending ? m_entries.erase(entry) : std::next(entry);
+    }
+    for(auto entry = m_entries.begin(); entry != m_entries.end() && m_entries.size() > TRANE_DNS_ENTRIES * 9 / 10;)
+    {
+        entry = entry->second.pending ? std::next(entry) : m_entries.erase(entry);
+    }
+}
+
+
+template<typename Proto>
+void trane::DnsCache<Proto>::complete(const std::string& key, const asio::error_code& err, const Endpoints& endpoints)
+{
+    std::vector<Waiter> waiters;
+    {
+        SCOPELOCK(m_mu);
+        Entry& entry = m_entries[key];
+        entry.pending = false;
+        if(err)
+        {
+            LOG(WARNING) << "could not resolve " << key.substr(key.find(' ') + 1) << ": " << err.message();
+        }
+        // a failed refresh keeps the stale address around until it is too old
+        if(!err || !entry.valid || entry.error)
+        {
+            entry.valid = true;
+            entry.error = err;
+            entry.endpoints = endpoints;
+            entry.expires = std::chrono::steady_clock::now() + (err ? SEC(TRANE_DNS_NEGATIVE_TTL) : default_dns_ttl());
+        }
+        waiters.swap(entry.waiters);
+    }
+    for(auto& waiter : waiters)
+    {
+        auto callback = std::move(waiter.callback);
+        auto work = std::move(waiter.work);
+        waiter.ios->post([callback, work, err, endpoints]{
+            callback(err, endpoints);
+        });
+    }
+}
+
+
 template<typename Proto>
 trane::Resolver<Proto>::Resolver(asio::io_service& ios)
-    : m_resolver{ios}
+    : m_ios{ios}, m_alive{std::make_shared<bool>(true)}
 { }
 
 
+template<typename Proto>
+trane::Resolver<Proto>::~Resolver()
+{
+    DnsCache<Proto>::instance().cancel(this);
+}
+
+
 template<typename Proto>
 void trane::Resolver<Proto>::resolve(const std::string& host, const std::string& port, Callback callback)
 {
-    m_resolver.async_resolve(host, port, callback);
+    asio::error_code ec;
+    auto address = asio::ip::make_address(host, ec);
+    bool numeric = !port.empty() && port.find_first_not_of("0123456789") == std::string::npos;
+    if(!ec && numeric)
+    {
+        typename Proto::endpoint endpoint(address, static_cast<uint16_t>(std::stoul(port)));
+        std::weak_ptr<bool> alive = m_alive;
+        m_ios.post([alive, callback, endpoint, host, port]{
+            if(!alive.expired())
+            {
+                callback(asio::error_code(), Results::create(endpoint, host, port));
+            }
+        });
+        return;
+    }
+
+    std::weak_ptr<bool> alive = m_alive;
+    DnsCache<Proto>::instance().resolve(m_ios, this, host, port,
+        [alive, callback, host, port](const asio::error_code& err, const typename DnsCache<Proto>::Endpoints& endpoints){
+            if(alive.expired())
+            {
+                return;
+            }
+            if(err)
+            {
+                callback(err, typename Proto::resolver::iterator());
+                return;
+            }
+            callback(err, Results::create(endpoints.begin(), endpoints.end(), host, port));
+        }
+    );
 }
 
 template<typename Proto>
@@ -1,6 +1,8 @@
 #ifndef TRANE_SERVER_HPP
 #define TRANE_SERVER_HPP
 
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <random>
 #include <unordered_map>
@@ -9,86 +11,185 @@
 
 #include "session.hpp"
 #include "container.hpp"
+#include "io_pool.hpp"
+#include "metrics.hpp"
 #include "random.hpp"
 #include "asio_standalone.hpp"
 #include "server_proxy.hpp"
 #include "logging.hpp"
 
+#define TRANE_ACCEPT_BATCH 64               // connections taken off the listen queue per wakeup
+#define TRANE_ACCEPT_BACKOFF 100            // milliseconds an acceptor waits after running out of file descriptors
+#define TRANE_SESSION_SHARDS 64             // lock shards of the session registry
+
 namespace trane
 {
     /*
-     * Trane server wil always use TCP to communicate with clients.
+     * Accept counters of the control port, summed over every acceptor. Latency runs from an acceptor waking up to the
+     * session of each connection it took being started, time spent in the kernel's listen queue is not included.
+     */
+    struct AcceptStats
+    {
+        uint64_t accepted{0}, wakeups{0};
+        uint64_t total_usec{0}, max_usec{0};
+    };
+
+
+    /*
+     * Trane server wil always use TCP to communicate with clients. Where SO_REUSEPORT is available every shard of the
+     * pool listens on the control port with an acceptor of its own, the kernel spreads incoming connections over them
+     * and each session stays on the shard that accepted it. Otherwise a single acceptor hands sessions to the shards
+     * round robin. Either way a session and its tunnels run on one shard from then on.
      */
     template<size_t BufSize = TRANE_BUFSIZE>
     class Server
     {
     public:
-        Server(asio::io_service& ios, uint16_t port);
-        std::shared_ptr<Session<BufSize>> gen_session();
-        const Container<Session<BufSize>>& sessions() const;
+        Server(IoPool& pool, uint16_t port);
+        std::shared_ptr<Session<BufSize>> gen_session(asio::io_service& ios);
+        using Sessions = Container<Session<BufSize>, TRANE_SESSION_SHARDS>;
+
+        const Sessions& sessions() const;
+        AcceptStats accept_stats() const;
+
+        // traffic of the process, every session and every TCP tunnel in the Prometheus text format, from any thread
+        void metrics(std::ostream& out) const;
+
         void listen();
 
     protected:
-        void do_accept();
+        struct Acceptor
+        {
+            explicit Acceptor(asio::io_service& ios) : ios{ios}, acceptor{ios}, backoff{ios} { }
+
+            asio::io_service& ios;
+            tcp::acceptor acceptor;
+            asio::steady_timer backoff;
+            std::atomic<uint64_t> accepted{0}, wakeups{0}, total_usec{0}, max_usec{0};
+        };
+
+        void do_accept(Acceptor& acc);
 
-        void handle_accept(std::shared_ptr<Session<BufSize>> session, const asio::error_code& err);
+        void handle_accept(Acceptor& acc, const asio::error_code& err);
+
+        // wait for TRANE_ACCEPT_BACKOFF before accepting again, the listen queue stays readable meanwhile
+        void backoff_accept(Acceptor& acc);
 
         void delete_session(std::uint64_t sessionid);
 
         // constructor initialization list
         uint16_t m_port;
-        asio::io_service& m_ios;
-        tcp::acceptor m_acceptor;
+        IoPool& m_pool;
 
         // initialized elsewhere
-        trane::Random<std::mt19937_64> m_random;
-        Container<Session<BufSize>> m_sessions;
+        std::vector<std::unique_ptr<Acceptor>> m_acceptors;
+        Sessions m_sessions;
     };
 }
 
 
 template<size_t BufSize>
-const trane::Container<trane::Session<BufSize>>& trane::Server<BufSize>::sessions() const
+const typename trane::Server<BufSize>::Sessions& trane::Server<BufSize>::sessions() const
 {
     return m_sessions;
 }
 
 
+template<size_t BufSize>
+trane::AcceptStats trane::Server<BufSize>::accept_stats() const
+{
+    AcceptStats stats;
+    for(auto& acc : m_acceptors)
+    {
+        stats.accepted += acc->accepted;
+        stats.wakeups += acc->wakeups;
+        stats.total_usec += acc->total_usec;
+        stats.max_usec = std::max<uint64_t>(stats.max_usec, acc->max_usec);
+    }
+    return stats;
+}
+
+
+/*
+ * The process totals come from the threads, so they include sessions that are gone, while sessions and tunnels only
+ * report the ones still open.
+ */
+template<size_t BufSize>
+void trane::Server<BufSize>::metrics(std::ostream& out) const
+{
+    std::vector<MetricSeries> sessions, tunnels;
+    TrafficTotals total = Metrics::global();
+    m_sessions.for_each([&](uint64_t sessionid, const Session<BufSize>& session){
+        std::string labels = "session=\"" + metric_id(sessionid) + '"';
+        TrafficTotals traffic = session.traffic(labels, tunnels);
+        total.tunnels += traffic.tunnels;
+        sessions.push_back({labels, traffic});
+    });
+    write_metrics(out, "trane_", {{"", total}}, true);
+    write_metrics(out, "trane_session_", sessions, true);
+    write_metrics(out, "trane_tunnel_", tunnels, false);
+}
+
+
 template<size_t BufSize>
 void trane::Server<BufSize>::listen()
 {
-    this->do_accept();
+    for(auto& acc : m_acceptors)
+    {
+        auto& ref = *acc;
+        acc->ios.post([this, &ref]{
+            this->do_accept(ref);
+        });
+    }
 }
 
 template<size_t BufSize>
-trane::Server<BufSize>::Server(asio::io_service& ios, uint16_t port)
-    : m_port{port}, m_ios{ios}, m_acceptor{ios, tcp::endpoint(tcp::v4(), port)}
+trane::Server<BufSize>::Server(IoPool& pool, uint16_t port)
+    : m_port{port}, m_pool{pool}
 {
     LOG(VERBOSE) << "Server Constructor";
+    size_t count = 1;
+#ifdef SO_REUSEPORT
+    count = pool.size();
+#endif
+    for(size_t i = 0; i < count; ++i)
+    {
+        std::unique_ptr<Acceptor> acc(new Acceptor(pool.get(i)));
+        acc->acceptor.open(tcp::v4());
+        acc->acceptor.set_option(tcp::acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        if(count > 1)
+        {
+            acc->acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+        }
+#endif
+        acc->acceptor.bind(tcp::endpoint(tcp::v4(), port));
+        acc->acceptor.listen(asio::socket_base::max_listen_connections);
+        acc->acceptor.non_blocking(true);
+        m_acceptors.push_back(std::move(acc));
+    }
+    LOG(DEBUG) << "listening on control port " << port << " with " << m_acceptors.size() << " acceptors";
 }
 
 
 template<size_t BufSize>
-void trane::Server<BufSize>::do_accept()
+void trane::Server<BufSize>::do_accept(Acceptor& acc)
 {
-    LOG(INFO) << "Creating a new session";
-    auto new_session = gen_session();
-
-    // create a new session and set the current function as the next callback for the next accept() call
-    m_acceptor.async_accept(
-        const_cast<tcp::socket&>(new_session->socket()),
-        std::bind(&trane::Server<BufSize>::handle_accept, this, new_session, std::placeholders::_1)
+    acc.acceptor.async_wait(tcp::acceptor::wait_read,
+        [this, &acc](const asio::error_code& err){
+            this->handle_accept(acc, err);
+        }
     );
 }
 
 
 /*
- * Generate a session with a valid session ID. Session will be deleted upon error.
+ * Generate a session with a valid session ID on the given shard. Session will be deleted upon error.
  */
 template<size_t BufSize>
-std::shared_ptr<trane::Session<BufSize>> trane::Server<BufSize>::gen_session()
+std::shared_ptr<trane::Session<BufSize>> trane::Server<BufSize>::gen_session(asio::io_service& ios)
 {
-    auto ptr = std::make_shared<Session<BufSize>>(m_ios, 0, std::bind(&Server::delete_session, this, std::placeholders::_1));
+    auto ptr = std::make_shared<Session<BufSize>>(ios, 0, std::bind(&Server::delete_session, this, std::placeholders::_1));
     uint64_t id = m_sessions.add(ptr);
     ptr->set_sessionid(id);
     return ptr;
@@ -96,27 +197,87 @@ std::shared_ptr<trane::Session<BufSize>> trane::Server<BufSize>::gen_session()
 
 
 /*
- * Asynchronous handling of accepting sessions. Accept shared ownership of a session object to prevent it from going out
- * of scope.
+ * Drain the listen queue once the acceptor is readable, up to TRANE_ACCEPT_BATCH connections per wakeup. A session is
+ * only created once a connection has actually been accepted. Running out of file descriptors, or a failed wait, pauses
+ * the acceptor for TRANE_ACCEPT_BACKOFF rather than spinning on a listen queue that stays readable.
  */
-
 template<size_t BufSize>
-void trane::Server<BufSize>::handle_accept(std::shared_ptr<trane::Session<BufSize>> session, const asio::error_code& err)
+void trane::Server<BufSize>::handle_accept(Acceptor& acc, const asio::error_code& err)
 {
+    if(err == asio::error::operation_aborted)
+    {
+        return;
+    }
     if(err)
     {
-        // TODO: improve error handling
         LOG(ERROR) << "Accept Error: " << err.message();
+        this->backoff_accept(acc);
         return;
     }
 
-    // if the session is valid start the session.
-    if(session != nullptr)
+    auto start = std::chrono::steady_clock::now();
+    bool own_shard = m_acceptors.size() > 1;
+    size_t accepted = 0;
+    for(size_t tries = 0; tries < TRANE_ACCEPT_BATCH; ++tries)
+    {
+        auto& ios = own_shard ? acc.ios : m_pool.next();
+        tcp::socket sock(ios);
+        asio::error_code ec;
+        acc.acceptor.accept(sock, ec);
+        if(ec == asio::error::would_block || ec == asio::error::try_again)
+        {
+            break;
+        }
+        if(ec == asio::error::no_descriptors || ec.value() == ENFILE || ec == asio::error::no_buffer_space
+            || ec == asio::error::no_memory)
+        {
+            LOG(ERROR) << "Accept Error: " << ec.message() << ", pausing for " << TRANE_ACCEPT_BACKOFF << "ms";
+            acc.accepted += accepted;
+            ++acc.wakeups;
+            this->backoff_accept(acc);
+            return;
+        }
+        if(ec)
+        {
+            // a connection reset while queued, the rest of the queue is still worth draining
+            LOG(WARNING) << "Accept Error: " << ec.message();
+            continue;
+        }
+
+        ++accepted;
+        auto session = this->gen_session(ios);
+        session->socket() = std::move(sock);
+        ios.dispatch([session]{
+            session->start();
+        });
+
+        uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        acc.total_usec += usec;
+        if(usec > acc.max_usec)
+        {
+            acc.max_usec = usec;
+        }
+    }
+    acc.accepted += accepted;
+    ++acc.wakeups;
+    if(accepted)
     {
-        session->start();
-        LOG(DEBUG) << "Staring Session";
+        LOG(DEBUG) << "accepted " << accepted << " sessions";
     }
-    this->do_accept();
+    this->do_accept(acc);
+}
+
+
+template<size_t BufSize>
+void trane::Server<BufSize>::backoff_accept(Acceptor& acc)
+{
+    acc.backoff.expires_after(MSEC(TRANE_ACCEPT_BACKOFF));
+    acc.backoff.async_wait([this, &acc](const asio::error_code& err){
+        if(!err)
+        {
+            this->do_accept(acc);
+        }
+    });
 }
 
 
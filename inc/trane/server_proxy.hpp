@@ -2,39 +2,114 @@
 #define ASIO_SERVER_PROXY_HPP
 
 #include "logging.hpp"
+#include "port_pool.hpp"
 #include "proxy.hpp"
+#include <algorithm>
+#include <chrono>
+#include <deque>
 #include <functional>
+#include <unordered_map>
 
+#define TRANE_TUNNEL_REQUEST_TIMEOUT 10     // seconds a requested data connection is waited for before it is asked for again
 
 namespace trane
 {
     /*
      * This proxy only receives connections.
      *
-     * The ClientProxy will connect to this class and so will the admin. The admin traffic will be proxied to
-     * ClientProxy which will send it to the client.
+     * ClientProxies connect to the upstream port and admins connect to the downstream port. Both acceptors stay armed
+     * for the lifetime of the tunnel, and every admin connection is paired with its own ClientProxy data connection
+     * in a Proxy of its own, so a single tunnel carries any number of parallel connections. The tunnel keeps a
+     * number of spare data connections connected ahead of time so a new admin is relayed immediately, and asks the
+     * client for more through the demand handler whenever they run short. Tunnels are owned through a shared_ptr.
      */
     template<typename Proto, size_t BufSize>
-    class ServerProxy : public Proxy<Proto, BufSize>
+    class ServerProxy : public std::enable_shared_from_this<ServerProxy<Proto, BufSize>>
     {
     public:
+        typedef std::function<void(uint64_t)> DemandHandler;
+
         // All we need are two ports. One for the admin (dn) and the ClientProxy (up)
         ServerProxy(asio::io_service& ios, uint16_t port_dn, uint16_t port_up);
+
+        // a tunnel whose ports are taken from port pools by open(), and given back when it is destroyed
+        explicit ServerProxy(asio::io_service& ios);
         ~ServerProxy();
+
+        // bind both listeners to ports from the pools, false if either pool has no usable port left
+        bool open(PortPool& pool_dn, PortPool& pool_up);
         virtual void listen();
 
+        // handlers aborted by closing still refer to the tunnel, its owner keeps it alive until they have run
+        void close();
+
+        void set_tunnelid(uint64_t tunnelid);
+        uint64_t tunnelid() const;
+        void set_demand_handler(DemandHandler handler);
+
+        // the number of idle data connections to keep ready, requested right away
+        void set_spares(size_t spares);
+
+        /*
+         * How long a requested data connection is waited for. The client does not report a data connection it could
+         * not make, so a request that is not answered in time is given up and asked for again.
+         */
+        void set_request_timeout(std::chrono::milliseconds timeout);
+
+        // codec applied to every data connection, empty for none
+        void set_codec(const std::string& codec);
+
         uint16_t port_up() const;
         uint16_t port_dn() const;
 
+        // number of admin connections currently being relayed
+        size_t connections() const;
+
+        // relay system calls and bytes of every connection the tunnel carried so far
+        RelayStats stats() const;
+
+        // traffic counters of the tunnel, safe to read from any thread
+        const TrafficStats& traffic() const;
+
     protected:
-        virtual void handle_up_accept(const asio::error_code& err);
-        virtual void handle_dn_accept(const asio::error_code& err);
+        using Pair = Proxy<Proto, BufSize>;
 
+        virtual void do_up_accept();
+        virtual void do_dn_accept();
+        virtual void handle_up_accept(std::shared_ptr<tcp::socket> sock, const asio::error_code& err);
+        virtual void handle_dn_accept(std::shared_ptr<typename Proto::socket> sock, const asio::error_code& err);
+
+        // an idle data connection only becomes readable when the client drops it
+        void handle_idle(std::shared_ptr<tcp::socket> sock, const asio::error_code& err);
+
+        // match waiting admins with idle data connections and ask for more when they run short
+        void do_pair();
+
+        // give up on requests past their deadline, and wake up for the next one
+        void expire_requests();
+
+        asio::io_service& m_ios;
         uint64_t m_tunnelid;
         uint16_t m_port_dn, m_port_up;
+        PortLease m_lease_dn, m_lease_up;                                   // outlive the acceptors bound to them
         tcp::acceptor m_acc_up;
         typename Proto::acceptor m_acc_dn;
         asio::ip::address m_host_dn, m_host_up;
+        DemandHandler m_on_demand;
+
+        std::deque<std::shared_ptr<tcp::socket>> m_idle_up;                 // data connections without an admin
+        std::deque<std::shared_ptr<typename Proto::socket>> m_waiting_dn;   // admins without a data connection
+        std::deque<std::chrono::steady_clock::time_point> m_requested;      // deadlines of data connections asked for, not yet accepted
+        std::chrono::milliseconds m_request_timeout{SEC(TRANE_TUNNEL_REQUEST_TIMEOUT)};
+        asio::steady_timer m_expiry;
+        bool m_expiring{false};
+        size_t m_spares{default_tunnel_spares()};
+        std::string m_codec;
+        std::unordered_map<uint64_t, std::shared_ptr<Pair>> m_pairs;
+        uint64_t m_next_pair{0};
+        RelayStats m_finished;                                              // stats of pairs already closed
+        TrafficStats m_traffic;
+        bool m_closed{false};
     };
 }
 
@@ -46,30 +121,157 @@ namespace trane
 
 template<typename Proto, size_t BufSize>
 trane::ServerProxy<Proto, BufSize>::ServerProxy(asio::io_service& ios, uint16_t port_dn, uint16_t port_up)
-    : trane::Proxy<Proto, BufSize>::Proxy(ios), m_port_dn{port_dn}, m_port_up{port_up},
-    m_acc_up{ios, tcp::endpoint(tcp::v4(), port_up)}, m_acc_dn{ios, tcp::endpoint(tcp::v4(), port_dn)}
+    : m_ios{ios}, m_port_dn{port_dn}, m_port_up{port_up},
+    m_acc_up{ios, tcp::endpoint(tcp::v4(), port_up)}, m_acc_dn{ios, tcp::endpoint(tcp::v4(), port_dn)}, m_expiry{ios}
+{
+    LOG(VERBOSE);
+}
+
+
+template<typename Proto, size_t BufSize>
+trane::ServerProxy<Proto, BufSize>::ServerProxy(asio::io_service& ios)
+    : m_ios{ios}, m_port_dn{0}, m_port_up{0}, m_acc_up{ios}, m_acc_dn{ios}, m_expiry{ios}
 {
     LOG(VERBOSE);
 }
 
 
+template<typename Proto, size_t BufSize>
+bool trane::ServerProxy<Proto, BufSize>::open(PortPool& pool_dn, PortPool& pool_up)
+{
+    asio::error_code ec;
+    if(!pool_dn.bind(m_acc_dn, m_lease_dn) || !pool_up.bind(m_acc_up, m_lease_up))
+    {
+        return false;
+    }
+    m_acc_dn.listen(asio::socket_base::max_listen_connections, ec);
+    if(!ec)
+    {
+        m_acc_up.listen(asio::socket_base::max_listen_connections, ec);
+    }
+    if(ec)
+    {
+        LOG(ERROR) << "could not listen on tunnel ports: " << ec.message();
+        return false;
+    }
+    m_port_dn = m_lease_dn.port();
+    m_port_up = m_lease_up.port();
+    return true;
+}
+
+
 template<typename Proto, size_t BufSize>
 trane::ServerProxy<Proto, BufSize>::~ServerProxy()
 {
     LOG(VERBOSE);
+    // connections still relayed stop counting into the tunnel before it goes, and outlive it until their aborted
+    // handlers have run
+    for(auto& entry : m_pairs)
+    {
+        auto pair = entry.second;
+        pair->set_close_handler(nullptr);
+        pair->close();
+        m_ios.post([pair]{ });
+    }
 }
 
 
 template<typename Proto, size_t BufSize>
 void trane::ServerProxy<Proto, BufSize>::listen()
 {
+    m_traffic.set_parent(&Metrics::local());
     LOG(INFO) << "Listening for trane tunnel on 0.0.0.0:" << std::dec << m_port_up;
-    m_acc_up.async_accept(this->m_sock_up,
-        [this](const asio::error_code& err)
+    this->do_up_accept();
+    if(std::is_same<Proto, tcp>::value)
+    {
+        LOG(INFO) << "Listening for admin traffic on 0.0.0.0:" << std::dec << m_port_dn;
+        this->do_dn_accept();
+    }
+    // UDP tunnels are served by UdpServerProxy in udp_proxy.hpp
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::close()
+{
+    if(!m_closed)
+    {
+        RelayStats stats = this->stats();
+        LOG(DEBUG) << "tunnel on port " << std::dec << m_port_dn << " closed, " << stats.syscalls_per_byte()
+            << " system calls per byte over " << stats.bytes_up + stats.bytes_dn << " bytes";
+    }
+    m_closed = true;
+    asio::error_code ec;
+    m_acc_up.close(ec);
+    m_acc_dn.close(ec);
+    m_expiry.cancel(ec);
+    m_requested.clear();
+    for(auto& sock : m_idle_up)
+    {
+        sock->close(ec);
+    }
+    m_idle_up.clear();
+    m_waiting_dn.clear();
+    for(auto& entry : m_pairs)
+    {
+        // kept alive until the handlers aborted by closing it have run
+        auto pair = entry.second;
+        pair->set_close_handler(nullptr);
+        pair->close();
+        m_ios.post([pair]{ });
+    }
+    m_pairs.clear();
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::set_tunnelid(uint64_t tunnelid)
+{
+    m_tunnelid = tunnelid;
+}
+
+
+template<typename Proto, size_t BufSize>
+uint64_t trane::ServerProxy<Proto, BufSize>::tunnelid() const
+{
+    return m_tunnelid;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::set_demand_handler(DemandHandler handler)
+{
+    m_on_demand = handler;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::set_spares(size_t spares)
+{
+    m_spares = spares;
+    // the tunnel may be closed and dropped before this runs
+    std::weak_ptr<ServerProxy> weak = this->shared_from_this();
+    m_ios.post([weak]{
+        auto self = weak.lock();
+        if(self != nullptr && !self->m_closed)
         {
-            this->handle_up_accept(err);
+            self->do_pair();
         }
-    );
+    });
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::set_request_timeout(std::chrono::milliseconds timeout)
+{
+    m_request_timeout = timeout;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::set_codec(const std::string& codec)
+{
+    m_codec = codec;
 }
 
 
@@ -88,40 +290,191 @@ uint16_t trane::ServerProxy<Proto, BufSize>::port_dn() const
 
 
 template<typename Proto, size_t BufSize>
-void trane::ServerProxy<Proto, BufSize>::handle_up_accept(const asio::error_code& err)
+size_t trane::ServerProxy<Proto, BufSize>::connections() const
+{
+    return m_pairs.size();
+}
+
+
+template<typename Proto, size_t BufSize>
+trane::RelayStats trane::ServerProxy<Proto, BufSize>::stats() const
+{
+    RelayStats stats = m_finished;
+    for(auto& entry : m_pairs)
+    {
+        stats += entry.second->stats();
+    }
+    return stats;
+}
+
+
+template<typename Proto, size_t BufSize>
+const trane::TrafficStats& trane::ServerProxy<Proto, BufSize>::traffic() const
+{
+    return m_traffic;
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::do_up_accept()
+{
+    auto sock = std::make_shared<tcp::socket>(m_ios);
+    m_acc_up.async_accept(*sock,
+        [this, sock](const asio::error_code& err)
+        {
+            this->handle_up_accept(sock, err);
+        }
+    );
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::do_dn_accept()
+{
+    auto sock = std::make_shared<typename Proto::socket>(m_ios);
+    m_acc_dn.async_accept(*sock,
+        [this, sock](const asio::error_code& err)
+        {
+            this->handle_dn_accept(sock, err);
+        }
+    );
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::handle_up_accept(std::shared_ptr<tcp::socket> sock, const asio::error_code& err)
 {
     if(err)
     {
-        LOG(ERROR) << err.message();
+        if(!m_closed)
+        {
+            LOG(ERROR) << err.message();
+        }
         return;
     }
     LOG(DEBUG) << "Connected";
-    if(std::is_same<Proto, tcp>::value)
+    if(!m_requested.empty())
     {
-        LOG(INFO) << "Listening for admin traffic on 0.0.0.0:" << std::dec << m_port_dn;
-        m_acc_dn.async_accept(this->m_sock_dn,
-            [this](const asio::error_code& err)
+        m_requested.pop_front();
+    }
+    m_idle_up.push_back(sock);
+    sock->async_wait(asio::socket_base::wait_read,
+        [this, sock](const asio::error_code& err)
+        {
+            this->handle_idle(sock, err);
+        }
+    );
+    this->do_pair();
+    this->do_up_accept();
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::handle_idle(std::shared_ptr<tcp::socket> sock, const asio::error_code& err)
+{
+    if(err == asio::error::operation_aborted || m_closed)
+    {
+        return;
+    }
+    auto idle = std::find(m_idle_up.begin(), m_idle_up.end(), sock);
+    if(idle == m_idle_up.end())
+    {
+        return;
+    }
+    LOG(DEBUG) << "spare data connection dropped by the client";
+    m_idle_up.erase(idle);
+    this->do_pair();
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::handle_dn_accept(std::shared_ptr<typename Proto::socket> sock, const asio::error_code& err)
+{
+    if(err)
+    {
+        if(!m_closed)
+        {
+            LOG(ERROR) << err.message();
+        }
+        return;
+    }
+    m_waiting_dn.push_back(sock);
+    this->do_pair();
+    this->do_dn_accept();
+}
+
+
+template<typename Proto, size_t BufSize>
+void trane::ServerProxy<Proto, BufSize>::do_pair()
+{
+    while(!m_idle_up.empty() && !m_waiting_dn.empty())
+    {
+        auto pair = std::make_shared<Pair>(m_ios);
+        pair->set_tunnelid(m_tunnelid);
+        if(!m_codec.empty())
+        {
+            pair->set_codec(m_codec);
+        }
+        asio::error_code ec;
+        m_idle_up.front()->cancel(ec);
+        pair->socket_up() = std::move(*m_idle_up.front());
+        pair->socket_dn() = std::move(*m_waiting_dn.front());
+        m_idle_up.pop_front();
+        m_waiting_dn.pop_front();
+
+        uint64_t id = m_next_pair++;
+        m_pairs[id] = pair;
+        pair->set_close_handler([this, id]{
+            auto pair = this->m_pairs.find(id);
+            if(pair != this->m_pairs.end())
             {
-                this->handle_dn_accept(err);
+                this->m_finished += pair->second->stats();
+                this->m_pairs.erase(pair);
             }
-        );
+        });
+        pair->set_traffic(&m_traffic);
+        pair->count_connect();
+        LOG(DEBUG) << "relaying " << std::dec << m_pairs.size() << " connections on tunnel port " << m_port_dn;
+        pair->do_up_read();
+        pair->do_dn_read();
     }
-    /*
-     * TODO: Implement UDP
-     */
+
+    // every waiting admin needs a data connection that is neither idle nor already on its way, plus the spares
+    this->expire_requests();
+    while(m_on_demand && !m_closed && m_waiting_dn.size() + m_spares > m_idle_up.size() + m_requested.size())
+    {
+        m_requested.push_back(std::chrono::steady_clock::now() + m_request_timeout);
+        m_on_demand(m_tunnelid);
+    }
+    this->expire_requests();
 }
 
 
+/*
+ * Requests are made with the same timeout, so the oldest expire first and the timer only ever waits for the front
+ */
 template<typename Proto, size_t BufSize>
-void trane::ServerProxy<Proto, BufSize>::handle_dn_accept(const asio::error_code& err)
+void trane::ServerProxy<Proto, BufSize>::expire_requests()
 {
-    if(err)
+    auto now = std::chrono::steady_clock::now();
+    while(!m_requested.empty() && m_requested.front() <= now)
+    {
+        LOG(WARNING) << "data connection requested for tunnel port " << std::dec << m_port_dn << " never arrived";
+        m_requested.pop_front();
+    }
+    if(m_requested.empty() || m_expiring || m_closed)
     {
-        LOG(ERROR) << err.message();
         return;
     }
-    this->do_up_read();
-    this->do_dn_read();
+    m_expiring = true;
+    m_expiry.expires_at(m_requested.front());
+    m_expiry.async_wait([this](const asio::error_code& err){
+        this->m_expiring = false;
+        if(!err && !this->m_closed)
+        {
+            this->do_pair();
+        }
+    });
 }
 
 #endif
@@ -4,7 +4,11 @@
 #include "commands.hpp"
 #include "connection.hpp"
 #include "container.hpp"
+#include "metrics.hpp"
+#include "mux.hpp"
 #include "server_proxy.hpp"
+#include "timer_wheel.hpp"
+#include "udp_proxy.hpp"
 
 #include <random>
 #include <msgpack.hpp>
@@ -18,84 +22,129 @@ namespace trane
      * A session object represents a single connection from a Trane Client to a Trane Server
      */
     template <size_t BufSize = TRANE_BUFSIZE>
-    class Session : public Connection<BufSize>
+    class Session : public Connection<BufSize>, public std::enable_shared_from_this<Session<BufSize>>
     {
         using ErrorHandler = typename Connection<BufSize>::ErrorHandler;
 
     public:
         Session(asio::io_service& ios, uint64_t sessionid, ErrorHandler error_handler);
+        ~Session();
         void start();
+
+        /*
+         * Create a tunnel on the session's shard. May be called from any thread.
+         */
         void create_tunnel(const asio::ip::address& trane_server, TraneType trane_type, const std::string& client_host, uint16_t client_port);
 
+        /*
+         * Create a tunnel whose connections are carried as streams over this session instead of their own TCP
+         * connections, on the session's shard. The admin port is logged once it listens. May be called from any thread.
+         */
+        void create_mux_tunnel(TraneType trane_type, const std::string& client_host, uint16_t client_port);
+
+        /*
+         * Traffic of the session's TCP tunnels so far, including the closed ones. Appends a series per open tunnel,
+         * labelled with the session's labels and the tunnel ID. May be called from any thread.
+         */
+        TrafficTotals traffic(const std::string& labels, std::vector<MetricSeries>& tunnels) const;
+
     protected:
+        // pending reads and writes keep the session alive, it is only destroyed once they have run
+        std::shared_ptr<void> lifeline() override;
+
         /*
          * Send a request to the client to establish a new tunnel
          */
         void send_request(const ParamTunnelReq& param);
 
+        void do_create_tunnel(const asio::ip::address& trane_server, TraneType trane_type, const std::string& client_host, uint16_t client_port);
+        void do_create_mux_tunnel(TraneType trane_type, const std::string& client_host, uint16_t client_port);
+
         /*
-         * Generating tunnels (max_retries = the maximum number of random ports to check before returning with an error
+         * Generating tunnels, nullptr when no ports are left
          */
-        std::shared_ptr<ServerProxy<tcp, BufSize>> gen_tcp_tunnel(uint64_t& id, int max_retries=25);
-        std::shared_ptr<ServerProxy<tcp, BufSize>> gen_udp_tunnel(uint64_t& id, int max_retries=25);
+        std::shared_ptr<ServerProxy<tcp, BufSize>> gen_tcp_tunnel(uint64_t& id);
+        std::shared_ptr<UdpServerProxy<BufSize>> gen_udp_tunnel(uint64_t& id);
+
+        /*
+         * Liveness checks on the shard's timer wheel. A session is dropped when no command arrived for a whole idle
+         * timeout, so a dead client is gone within two of them. A tunnel is closed when it carried no connection and
+         * no byte for a whole tunnel idle timeout.
+         */
+        void watch_idle(uint64_t received);
+        void watch_tunnel(uint64_t tunnelid, uint64_t bytes);
+
+        // close a TCP or UDP tunnel and drop it once its handlers have run, keeping TCP traffic in the session's
+        void close_tunnel(uint64_t tunnelid);
 
         /*
          * Handle server-side commands
          */
         void handle_cmd_connect(const msgpack::object& obj);
         void handle_cmd_ping(const msgpack::object& obj);
+        void handle_cmd_tunnel_res(const msgpack::object& obj);
+        void handle_cmd_stream_data(const msgpack::object& obj);
+        void handle_cmd_stream_window(const msgpack::object& obj);
+        void handle_cmd_stream_close(const msgpack::object& obj);
 
     private:
+        Mux<Session, BufSize> m_mux;
+        Container<MuxListener<Session, BufSize>> m_mux_tunnels;
         Container<ServerProxy<tcp, BufSize>> m_tcp_tunnels;
-        // Container<ServerProxy<udp, BufSize>> m_udp_tunnels;
+        Container<UdpServerProxy<BufSize>> m_udp_tunnels;
+        TrafficStats m_retired;                 // traffic of the TCP tunnels already dropped
     };
 }
 
 
 /*
- * TODO: FINISH THIS
+ * Tunnel ports come from the process-wide port pools and go back to them when the tunnel is destroyed.
  */
 
 template<size_t BufSize>
-std::shared_ptr<trane::ServerProxy<tcp, BufSize>> trane::Session<BufSize>::gen_tcp_tunnel(uint64_t& id, int max_retries)
+std::shared_ptr<trane::ServerProxy<tcp, BufSize>> trane::Session<BufSize>::gen_tcp_tunnel(uint64_t& id)
 {
-    uint16_t port1 = 0, port2 = 0;
-
-    for(int i = 0; i < max_retries; ++i)
+    auto tunnel = std::make_shared<trane::ServerProxy<tcp, BufSize>>(this->m_ios);
+    if(!tunnel->open(PortPool::admin(), PortPool::client()))
     {
-        auto& random = m_tcp_tunnels.random();
-        port1 = port1 ? port1 : random.template randrange<uint16_t>(TRANE_ADMIN_PORT_BEGIN, TRANE_ADMIN_PORT_END);
-        port2 = port2 ? port2 : random.template randrange<uint16_t>(TRANE_CLIENT_PORT_BEGIN, TRANE_CLIENT_PORT_END);
-        try
-        {
-            auto tunnel = std::make_shared<trane::ServerProxy<tcp, BufSize>>(this->m_ios, port1, port2);
-            id = m_tcp_tunnels.add(tunnel);
-            tunnel->set_tunnelid(id);
-            tunnel->listen();
-            return tunnel;
-        }
-        catch(asio::system_error& err)
-        {
-            // TODO: determine offending port so we don't re-generate both.
-            LOG(WARNING) << "regenerating ports";
-            port1 = 0;
-            port2 = 0;
-            continue;
-        }
+        LOG(ERROR) << "could not find open ports";
+        return nullptr;
     }
-    LOG(ERROR) << "could not find open ports";
-    return nullptr;
+    id = m_tcp_tunnels.add(tunnel);
+    tunnel->set_tunnelid(id);
+    tunnel->listen();
+    return tunnel;
 }
 
 
-        /*
-         * void send_cmd_tunnel_req(const std::string& host_server, uint16_t port_server,
-                                 const std::string& host_client, uint16_t port_client,
-                                 unsigned char trane_type, uint64_t tunnelid);
-         */
+template<size_t BufSize>
+std::shared_ptr<trane::UdpServerProxy<BufSize>> trane::Session<BufSize>::gen_udp_tunnel(uint64_t& id)
+{
+    auto tunnel = std::make_shared<trane::UdpServerProxy<BufSize>>(this->m_ios);
+    if(!tunnel->open(PortPool::admin(), PortPool::client()))
+    {
+        LOG(ERROR) << "could not find open ports";
+        return nullptr;
+    }
+    id = m_udp_tunnels.add(tunnel);
+    tunnel->set_tunnelid(id);
+    tunnel->listen();
+    return tunnel;
+}
+
 
 template<size_t BufSize>
 void trane::Session<BufSize>::create_tunnel(const asio::ip::address& trane_server, TraneType trane_type, const std::string& client_host, uint16_t client_port)
+{
+    auto self = this->shared_from_this();
+    this->m_ios.dispatch([self, trane_server, trane_type, client_host, client_port]{
+        self->do_create_tunnel(trane_server, trane_type, client_host, client_port);
+    });
+}
+
+
+template<size_t BufSize>
+void trane::Session<BufSize>::do_create_tunnel(const asio::ip::address& trane_server, TraneType trane_type, const std::string& client_host, uint16_t client_port)
 {
     if(trane_type == TraneType::TCP)
     {
@@ -105,11 +154,102 @@ void trane::Session<BufSize>::create_tunnel(const asio::ip::address& trane_serve
         {
             return;
         }
-        this->send_cmd_tunnel_req(trane_server.to_string(), tunnel->port_up(), client_host, client_port, static_cast<unsigned char>(trane_type), tunnelid);
+        uint16_t port_up = tunnel->port_up();
+        std::string codec = default_codec();
+        tunnel->set_codec(codec);
+
+        // every TUNNEL_REQ has the client connect one more data connection, starting with the tunnel's spares
+        std::weak_ptr<Session> weak = this->shared_from_this();
+        tunnel->set_demand_handler([weak, trane_server, port_up, client_host, client_port, trane_type, codec](uint64_t tunnelid){
+            auto self = weak.lock();
+            if(self == nullptr)
+            {
+                return;
+            }
+            self->send_cmd_tunnel_req(trane_server.to_string(), port_up, client_host, client_port, static_cast<unsigned char>(trane_type), tunnelid, codec);
+        });
+        tunnel->set_spares(default_tunnel_spares());
+        if(default_tunnel_idle().count())
+        {
+            this->watch_tunnel(tunnelid, 0);
+        }
+    }
+    else if(trane_type == TraneType::UDP)
+    {
+        uint64_t tunnelid;
+        auto tunnel = this->gen_udp_tunnel(tunnelid);
+        if(tunnel == nullptr)
+        {
+            return;
+        }
+        uint16_t port_up = tunnel->port_up();
+
+        // all peers share one data connection, which is only requested again if it is lost. Datagrams are small and
+        // framed individually, so UDP tunnels are never compressed
+        std::weak_ptr<Session> weak = this->shared_from_this();
+        tunnel->set_demand_handler([weak, trane_server, port_up, client_host, client_port, trane_type](uint64_t tunnelid){
+            auto self = weak.lock();
+            if(self == nullptr)
+            {
+                return;
+            }
+            self->send_cmd_tunnel_req(trane_server.to_string(), port_up, client_host, client_port, static_cast<unsigned char>(trane_type), tunnelid, "");
+        });
+        this->send_cmd_tunnel_req(trane_server.to_string(), port_up, client_host, client_port, static_cast<unsigned char>(trane_type), tunnelid, "");
     }
 }
 
 
+template<size_t BufSize>
+void trane::Session<BufSize>::create_mux_tunnel(TraneType trane_type, const std::string& client_host, uint16_t client_port)
+{
+    auto self = this->shared_from_this();
+    this->m_ios.dispatch([self, trane_type, client_host, client_port]{
+        self->do_create_mux_tunnel(trane_type, client_host, client_port);
+    });
+}
+
+
+template<size_t BufSize>
+void trane::Session<BufSize>::do_create_mux_tunnel(TraneType trane_type, const std::string& client_host, uint16_t client_port)
+{
+    if(trane_type != TraneType::TCP)
+    {
+        LOG(ERROR) << "only TCP tunnels can be multiplexed";
+        return;
+    }
+    auto tunnel = std::make_shared<MuxListener<Session, BufSize>>(m_mux, client_host, client_port);
+    if(!tunnel->open(PortPool::admin()))
+    {
+        LOG(ERROR) << "could not find an open port";
+        return;
+    }
+    m_mux_tunnels.add(tunnel);
+    tunnel->listen();
+}
+
+
+template<size_t BufSize>
+void trane::Session<BufSize>::handle_cmd_stream_data(const msgpack::object& obj)
+{
+    m_mux.handle_data(obj);
+}
+
+
+template<size_t BufSize>
+void trane::Session<BufSize>::handle_cmd_stream_window(const msgpack::object& obj)
+{
+    m_mux.handle_window(obj);
+}
+
+
+template<size_t BufSize>
+void trane::Session<BufSize>::handle_cmd_stream_close(const msgpack::object& obj)
+{
+    m_mux.handle_close(obj);
+}
+
+
 template<size_t BufSize>
 void trane::Session<BufSize>::handle_cmd_connect(const msgpack::object& obj)
 {
@@ -134,11 +274,108 @@ void trane::Session<BufSize>::handle_cmd_ping(const msgpack::object& obj)
 }
 
 
+/*
+ * The client only answers TUNNEL_REQ when it cannot serve the tunnel, for instance because it does not support the
+ * codec requested, so the tunnel is torn down.
+ */
+template<size_t BufSize>
+void trane::Session<BufSize>::handle_cmd_tunnel_res(const msgpack::object& obj)
+{
+    ParamTunnelRes param;
+    obj.convert(param);
+    if(P1(param))
+    {
+        return;
+    }
+
+    LOG(ERROR) << "Tunnel " << std::setfill('0') << std::setw(16) << std::hex << P0(param) << " refused: " << P2(param);
+    this->close_tunnel(P0(param));
+}
+
+
+template<size_t BufSize>
+void trane::Session<BufSize>::close_tunnel(uint64_t tunnelid)
+{
+    auto self = this->shared_from_this();
+    auto udp = m_udp_tunnels.get(tunnelid);
+    if(udp != nullptr)
+    {
+        udp->close();
+        this->m_ios.post([self, udp, tunnelid]{
+            self->m_udp_tunnels.del(tunnelid);
+        });
+        return;
+    }
+    auto tunnel = m_tcp_tunnels.get(tunnelid);
+    if(tunnel == nullptr)
+    {
+        return;
+    }
+    tunnel->close();
+    this->m_ios.post([self, tunnel, tunnelid]{
+        self->m_tcp_tunnels.del(tunnelid);
+        self->m_retired.merge(tunnel->traffic().totals());
+    });
+}
+
+
+template<size_t BufSize>
+trane::TrafficTotals trane::Session<BufSize>::traffic(const std::string& labels, std::vector<MetricSeries>& tunnels) const
+{
+    TrafficTotals traffic = m_retired.totals();
+    size_t open = 0;
+    m_tcp_tunnels.for_each([&](uint64_t tunnelid, const ServerProxy<tcp, BufSize>& tunnel){
+        TrafficTotals totals = tunnel.traffic().totals();
+        traffic += totals;
+        tunnels.push_back({labels + ",tunnel=\"" + metric_id(tunnelid) + '"', totals});
+        ++open;
+    });
+    traffic.tunnels = open;
+    return traffic;
+}
+
+
 template<size_t BufSize>
 trane::Session<BufSize>::Session(asio::io_service& ios, uint64_t sessionid, ErrorHandler eh)
-    : Connection<BufSize>(ios, sessionid, eh)
+    : Connection<BufSize>(ios, sessionid, eh), m_mux{ios, *this}
+{
+    LOG(VERBOSE);
+}
+
+
+/*
+ * The session goes once the last of its aborted handlers has run. Its tunnels are closed first and kept alive until the handlers
+ * that closing aborted have run, as those hold the tunnels by reference.
+ */
+template<size_t BufSize>
+trane::Session<BufSize>::~Session()
 {
     LOG(VERBOSE);
+    for(auto& entry : m_mux_tunnels.snapshot())
+    {
+        auto tunnel = entry.second;
+        tunnel->close();
+        this->m_ios.post([tunnel]{ });
+    }
+    for(auto& entry : m_tcp_tunnels.snapshot())
+    {
+        auto tunnel = entry.second;
+        tunnel->close();
+        this->m_ios.post([tunnel]{ });
+    }
+    for(auto& entry : m_udp_tunnels.snapshot())
+    {
+        auto tunnel = entry.second;
+        tunnel->close();
+        this->m_ios.post([tunnel]{ });
+    }
+}
+
+
+template<size_t BufSize>
+std::shared_ptr<void> trane::Session<BufSize>::lifeline()
+{
+    return this->shared_from_this();
 }
 
 
@@ -146,9 +383,70 @@ template<size_t BufSize>
 void trane::Session<BufSize>::start()
 {
     LOG(DEBUG) << "starting session";
+    if(default_idle_timeout().count())
+    {
+        if(default_keepalive())
+        {
+            this->set_keepalive(default_idle_timeout());
+        }
+        else
+        {
+            this->watch_idle(this->received());
+        }
+    }
     this->do_read();
 };
 
 
+template<size_t BufSize>
+void trane::Session<BufSize>::watch_idle(uint64_t received)
+{
+    std::weak_ptr<Session> weak = this->shared_from_this();
+    TimerWheel::get(this->m_ios).schedule(default_idle_timeout(), [weak, received]{
+        auto self = weak.lock();
+        if(self == nullptr)
+        {
+            return;
+        }
+        if(self->received() != received)
+        {
+            self->watch_idle(self->received());
+            return;
+        }
+        // the read pending on the socket is aborted and takes the session down the usual error path
+        LOG(WARNING) << "session " << std::setfill('0') << std::setw(16) << std::hex << self->sessionid() << " is idle, dropping it";
+        self->close();
+    });
+}
+
+
+template<size_t BufSize>
+void trane::Session<BufSize>::watch_tunnel(uint64_t tunnelid, uint64_t bytes)
+{
+    std::weak_ptr<Session> weak = this->shared_from_this();
+    TimerWheel::get(this->m_ios).schedule(default_tunnel_idle(), [weak, tunnelid, bytes]{
+        auto self = weak.lock();
+        if(self == nullptr)
+        {
+            return;
+        }
+        auto tunnel = self->m_tcp_tunnels.get(tunnelid);
+        if(tunnel == nullptr)
+        {
+            return;
+        }
+        auto stats = tunnel->stats();
+        uint64_t total = stats.bytes_up + stats.bytes_dn;
+        if(tunnel->connections() || total != bytes)
+        {
+            self->watch_tunnel(tunnelid, total);
+            return;
+        }
+        LOG(INFO) << "Tunnel " << std::setfill('0') << std::setw(16) << std::hex << tunnelid << " is idle, closing it";
+        self->close_tunnel(tunnelid);
+    });
+}
+
+
 #endif
 
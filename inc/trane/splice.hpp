@@ -0,0 +1,162 @@
+#ifndef TRANE_SPLICE_HPP
+#define TRANE_SPLICE_HPP
+
+#include <cstddef>
+#include <cerrno>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#define TRANE_HAS_SPLICE 1
+#endif
+
+namespace trane
+{
+    /*
+     * A kernel pipe used to move bytes between two sockets with splice(2) without copying them through user space.
+     * On platforms without splice open() always fails so callers can fall back to buffered relaying.
+     */
+    class SplicePipe
+    {
+    public:
+        SplicePipe() = default;
+        SplicePipe(const SplicePipe&) = delete;
+        SplicePipe& operator=(const SplicePipe&) = delete;
+        ~SplicePipe();
+
+        bool open();
+        void close();
+        bool is_open() const;
+
+        /*
+         * Move bytes from a socket into the pipe (fill) or from the pipe into a socket (drain). Both return the number
+         * of bytes moved, 0 on EOF from the socket, or -1 with errno set (EAGAIN when the socket is not ready).
+         */
+        long fill(int fd);
+        long drain(int fd);
+
+        size_t buffered() const;
+        size_t capacity() const;
+        bool full() const;
+
+    private:
+        int m_rd{-1}, m_wr{-1};
+        size_t m_buffered{0}, m_capacity{0};
+    };
+}
+
+
+inline trane::SplicePipe::~SplicePipe()
+{
+    this->close();
+}
+
+
+inline bool trane::SplicePipe::open()
+{
+#ifdef TRANE_HAS_SPLICE
+    if(is_open())
+    {
+        return true;
+    }
+    int fds[2];
+    if(::pipe2(fds, O_NONBLOCK | O_CLOEXEC) != 0)
+    {
+        return false;
+    }
+    m_rd = fds[0];
+    m_wr = fds[1];
+    int size = ::fcntl(m_wr, F_GETPIPE_SZ);
+    m_capacity = size > 0 ? static_cast<size_t>(size) : 4096;
+    m_buffered = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+inline void trane::SplicePipe::close()
+{
+#ifdef TRANE_HAS_SPLICE
+    if(m_rd >= 0)
+    {
+        ::close(m_rd);
+    }
+    if(m_wr >= 0)
+    {
+        ::close(m_wr);
+    }
+#endif
+    m_rd = m_wr = -1;
+    m_buffered = 0;
+}
+
+
+inline bool trane::SplicePipe::is_open() const
+{
+    return m_rd >= 0 && m_wr >= 0;
+}
+
+
+inline long trane::SplicePipe::fill(int fd)
+{
+#ifdef TRANE_HAS_SPLICE
+    if(full())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t n = ::splice(fd, nullptr, m_wr, nullptr, m_capacity - m_buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0)
+    {
+        m_buffered += static_cast<size_t>(n);
+    }
+    return static_cast<long>(n);
+#else
+    (void)fd;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+inline long trane::SplicePipe::drain(int fd)
+{
+#ifdef TRANE_HAS_SPLICE
+    if(m_buffered == 0)
+    {
+        return 0;
+    }
+    ssize_t n = ::splice(m_rd, nullptr, fd, nullptr, m_buffered, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0)
+    {
+        m_buffered -= static_cast<size_t>(n);
+    }
+    return static_cast<long>(n);
+#else
+    (void)fd;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+inline size_t trane::SplicePipe::buffered() const
+{
+    return m_buffered;
+}
+
+
+inline size_t trane::SplicePipe::capacity() const
+{
+    return m_capacity;
+}
+
+
+inline bool trane::SplicePipe::full() const
+{
+    return m_buffered >= m_capacity;
+}
+
+#endif
@@ -0,0 +1,260 @@
+#ifndef TRANE_TIMER_WHEEL_HPP
+#define TRANE_TIMER_WHEEL_HPP
+
+#include "asio_standalone.hpp"
+#include "utils.hpp"
+#include "logging.hpp"
+
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#define TRANE_WHEEL_TICK 100                // milliseconds per timer wheel tick
+#define TRANE_WHEEL_LEVELS 4                // wheel levels of 64 slots, 4 cover 2^24 ticks
+#define TRANE_WHEEL_BITS 6
+
+namespace trane
+{
+    /*
+     * Hierarchical timer wheel shared by everything running on one io_service. Scheduling and cancelling a timer are
+     * O(1), and the wheel keeps a single steady_timer armed at the tick rate while it has timers pending instead of
+     * one timer per session in the reactor's heap. Timers fire on the tick after they are due, so they are late by up
+     * to TRANE_WHEEL_TICK. Timers further out than the wheel covers are carried on the top level until they are due.
+     *
+     * There is one wheel per io_service, created on first use with get(). It is not locked, so it may only be used
+     * from the io_service's own thread.
+     */
+    class TimerWheel : public asio::detail::service_base<TimerWheel>
+    {
+    public:
+        using Callback = std::function<void()>;
+        using Duration = std::chrono::steady_clock::duration;
+
+        explicit TimerWheel(asio::io_service& ios);
+
+        static TimerWheel& get(asio::io_service& ios);
+
+        // call back after delay, returns an ID to cancel the timer with, never 0
+        uint64_t schedule(Duration delay, Callback callback);
+        void cancel(uint64_t id);
+
+        size_t pending() const;
+
+        // ticks elapsed since the wheel started
+        uint64_t now() const;
+        Duration tick() const;
+
+    private:
+        struct Entry
+        {
+            uint64_t deadline;
+            Callback callback;
+        };
+
+        static constexpr uint64_t SLOTS = 1 << TRANE_WHEEL_BITS;
+        static constexpr uint64_t SPAN = 1ULL << (TRANE_WHEEL_BITS * TRANE_WHEEL_LEVELS);
+
+        void shutdown() override;
+
+        void place(uint64_t id, uint64_t deadline);
+        void advance();
+        void do_tick();
+        void handle_tick(const asio::error_code& err);
+
+        asio::steady_timer m_timer;
+        Duration m_tick;
+        std::chrono::steady_clock::time_point m_start;
+        uint64_t m_now{0}, m_next_id{0};
+        bool m_ticking{false};
+        std::unordered_map<uint64_t, Entry> m_entries;
+        std::vector<uint64_t> m_slots[TRANE_WHEEL_LEVELS][SLOTS];
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline trane::TimerWheel::TimerWheel(asio::io_service& ios)
+    : asio::detail::service_base<TimerWheel>(ios), m_timer{ios}, m_tick{MSEC(TRANE_WHEEL_TICK)},
+    m_start{std::chrono::steady_clock::now()}
+{ }
+
+
+inline trane::TimerWheel& trane::TimerWheel::get(asio::io_service& ios)
+{
+    return asio::use_service<TimerWheel>(ios);
+}
+
+
+inline void trane::TimerWheel::shutdown()
+{
+    // callbacks may own what scheduled them, drop them along with the io_service
+    m_entries.clear();
+    for(auto& level : m_slots)
+    {
+        for(auto& slot : level)
+        {
+            slot.clear();
+        }
+    }
+}
+
+
+inline uint64_t trane::TimerWheel::schedule(Duration delay, Callback callback)
+{
+    if(!m_ticking)
+    {
+        // the wheel stands still while nothing is pending, pick up the ticks missed meanwhile
+        uint64_t target = (std::chrono::steady_clock::now() - m_start) / m_tick;
+        m_now = target > m_now ? target : m_now;
+    }
+
+    uint64_t ticks = delay > m_tick ? (delay + m_tick - Duration(1)) / m_tick : 1;
+    uint64_t id = ++m_next_id;
+    uint64_t deadline = m_now + ticks;
+    m_entries.emplace(id, Entry{deadline, std::move(callback)});
+    this->place(id, deadline);
+
+    if(!m_ticking)
+    {
+        m_ticking = true;
+        this->do_tick();
+    }
+    return id;
+}
+
+
+inline void trane::TimerWheel::cancel(uint64_t id)
+{
+    // the ID is left in its slot and skipped when the slot comes up
+    m_entries.erase(id);
+}
+
+
+inline size_t trane::TimerWheel::pending() const
+{
+    return m_entries.size();
+}
+
+
+inline uint64_t trane::TimerWheel::now() const
+{
+    return m_now;
+}
+
+
+inline trane::TimerWheel::Duration trane::TimerWheel::tick() const
+{
+    return m_tick;
+}
+
+
+/*
+ * A timer goes on the lowest level whose slots still tell its deadline apart from now, and moves down a level each
+ * time the slot it is in comes up.
+ */
+inline void trane::TimerWheel::place(uint64_t id, uint64_t deadline)
+{
+    if(deadline - m_now >= SPAN)
+    {
+        deadline = m_now + SPAN - 1;
+    }
+    unsigned level = 0;
+    while(level + 1 < TRANE_WHEEL_LEVELS && (deadline >> (TRANE_WHEEL_BITS * (level + 1))) != (m_now >> (TRANE_WHEEL_BITS * (level + 1))))
+    {
+        ++level;
+    }
+    m_slots[level][(deadline >> (TRANE_WHEEL_BITS * level)) & (SLOTS - 1)].push_back(id);
+}
+
+
+inline void trane::TimerWheel::advance()
+{
+    ++m_now;
+
+    // cascade the slots of the upper levels that just came up, highest first
+    unsigned levels = 1;
+    while(levels < TRANE_WHEEL_LEVELS && (m_now & ((1ULL << (TRANE_WHEEL_BITS * levels)) - 1)) == 0)
+    {
+        ++levels;
+    }
+    for(unsigned level = levels - 1; level > 0; --level)
+    {
+        auto ids = std::move(m_slots[level][(m_now >> (TRANE_WHEEL_BITS * level)) & (SLOTS - 1)]);
+        m_slots[level][(m_now >> (TRANE_WHEEL_BITS * level)) & (SLOTS - 1)].clear();
+        for(uint64_t id : ids)
+        {
+            auto entry = m_entries.find(id);
+            if(entry != m_entries.end())
+            {
+                this->place(id, entry->second.deadline);
+            }
+        }
+    }
+
+    auto& slot = m_slots[0][m_now & (SLOTS - 1)];
+    if(slot.empty())
+    {
+        return;
+    }
+    auto ids = std::move(slot);
+    slot.clear();
+    for(uint64_t id : ids)
+    {
+        auto entry = m_entries.find(id);
+        if(entry == m_entries.end())
+        {
+            continue;
+        }
+        if(entry->second.deadline > m_now)
+        {
+            // carried beyond the span of the wheel
+            this->place(id, entry->second.deadline);
+            continue;
+        }
+        // callbacks may schedule and cancel timers themselves
+        auto callback = std::move(entry->second.callback);
+        m_entries.erase(entry);
+        callback();
+    }
+}
+
+
+inline void trane::TimerWheel::do_tick()
+{
+    m_timer.expires_at(m_start + m_tick * static_cast<Duration::rep>(m_now + 1));
+    m_timer.async_wait(
+        [this](const asio::error_code& err){
+            this->handle_tick(err);
+        }
+    );
+}
+
+
+inline void trane::TimerWheel::handle_tick(const asio::error_code& err)
+{
+    if(err)
+    {
+        m_ticking = false;
+        return;
+    }
+    // catch up on the ticks missed while the io_service was busy
+    uint64_t target = (std::chrono::steady_clock::now() - m_start) / m_tick;
+    do
+    {
+        this->advance();
+    } while(m_now < target);
+
+    if(m_entries.empty())
+    {
+        m_ticking = false;
+        return;
+    }
+    this->do_tick();
+}
+
+#endif
@@ -0,0 +1,366 @@
+#ifndef TRANE_UDP_BATCH_HPP
+#define TRANE_UDP_BATCH_HPP
+
+#include "asio_standalone.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#define TRANE_HAS_MMSG 1
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#endif
+
+#define TRANE_UDP_BATCH 32              // datagrams moved per recvmmsg/sendmmsg
+#define TRANE_UDP_SLOT 65536            // room for one GRO coalesced receive or GSO train, only touched as far as used
+#define TRANE_UDP_GSO_BYTES 65000       // a GSO train has to fit in a single IP datagram
+#define TRANE_UDP_GSO_SEGMENTS 64
+
+namespace trane
+{
+    /*
+     * A batch of datagrams moved with a single recvmmsg(2) or sendmmsg(2). Receives coalesced by UDP GRO are split
+     * back into their datagrams, and runs of equally sized datagrams to the same destination are sent as one UDP GSO
+     * train. Platforms without these calls fall back to one datagram per call behind the same interface.
+     */
+    class UdpBatch
+    {
+    public:
+        struct Datagram
+        {
+            const unsigned char* data;
+            size_t size;
+            unsigned slot;          // receive slot, whose sender is from(slot)
+        };
+
+        explicit UdpBatch(size_t count = TRANE_UDP_BATCH);
+        UdpBatch(const UdpBatch&) = delete;
+        UdpBatch& operator=(const UdpBatch&) = delete;
+
+        /*
+         * Ask the kernel to coalesce received datagrams (GRO) or accept datagram trains (GSO) on a socket. Both return
+         * false where unsupported, which is harmless.
+         */
+        bool enable_gro(udp::socket& sock);
+        bool enable_gso(udp::socket& sock);
+
+        /*
+         * Receive as many datagrams as are waiting, up to the batch size, without blocking. Returns the number of
+         * datagrams, with would_block in ec when nothing was waiting.
+         */
+        size_t recv(udp::socket& sock, asio::error_code& ec);
+        const std::vector<Datagram>& received() const;
+        udp::endpoint from(unsigned slot) const;
+
+        /*
+         * Queue a datagram for the next send(). The destination may be null on a connected socket. Returns false when
+         * the batch is full and has to be sent first.
+         */
+        bool add(const void* data, size_t size, const udp::endpoint* to);
+        bool empty() const;
+
+        // send everything queued. Datagrams the socket has no room for are dropped and counted, as UDP would
+        size_t send(udp::socket& sock, asio::error_code& ec);
+        size_t dropped() const;
+
+    private:
+        struct Slot
+        {
+            size_t size{0}, segment{0}, segments{0};
+            size_t namelen{0};
+        };
+
+        unsigned char* slot_data(size_t i);
+
+        size_t m_count;
+        std::unique_ptr<unsigned char[]> m_data;        // never initialized, so untouched pages stay unallocated
+        std::vector<Slot> m_slots;
+        std::vector<asio::ip::udp::endpoint> m_names;
+        std::vector<Datagram> m_received;
+        size_t m_queued{0}, m_dropped{0};
+        bool m_gso{false};
+#ifdef TRANE_HAS_MMSG
+        std::vector<struct mmsghdr> m_msgs;
+        std::vector<struct iovec> m_iovs;
+        std::vector<struct sockaddr_storage> m_addrs;
+        std::vector<char> m_control;
+        static const size_t control_size = CMSG_SPACE(sizeof(int));
+#endif
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+inline trane::UdpBatch::UdpBatch(size_t count)
+    : m_count{count}, m_data{new unsigned char[count * TRANE_UDP_SLOT]}, m_slots(count), m_names(count)
+#ifdef TRANE_HAS_MMSG
+    , m_msgs(count), m_iovs(count), m_addrs(count), m_control(count * control_size)
+#endif
+{
+    m_received.reserve(count);
+}
+
+
+inline unsigned char* trane::UdpBatch::slot_data(size_t i)
+{
+    return m_data.get() + i * TRANE_UDP_SLOT;
+}
+
+
+inline bool trane::UdpBatch::enable_gro(udp::socket& sock)
+{
+#ifdef TRANE_HAS_MMSG
+    int on = 1;
+    return ::setsockopt(sock.native_handle(), IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+#else
+    (void)sock;
+    return false;
+#endif
+}
+
+
+inline bool trane::UdpBatch::enable_gso(udp::socket& sock)
+{
+#ifdef TRANE_HAS_MMSG
+    // a zero segment size leaves the socket as it was, but only kernels with GSO accept the option
+    int size = 0;
+    m_gso = ::setsockopt(sock.native_handle(), IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+#else
+    (void)sock;
+#endif
+    return m_gso;
+}
+
+
+inline size_t trane::UdpBatch::recv(udp::socket& sock, asio::error_code& ec)
+{
+    m_received.clear();
+    ec = asio::error_code();
+#ifdef TRANE_HAS_MMSG
+    for(size_t i = 0; i < m_count; ++i)
+    {
+        m_iovs[i].iov_base = slot_data(i);
+        m_iovs[i].iov_len = TRANE_UDP_SLOT;
+        std::memset(&m_msgs[i].msg_hdr, 0, sizeof(m_msgs[i].msg_hdr));
+        m_msgs[i].msg_hdr.msg_name = &m_addrs[i];
+        m_msgs[i].msg_hdr.msg_namelen = sizeof(m_addrs[i]);
+        m_msgs[i].msg_hdr.msg_iov = &m_iovs[i];
+        m_msgs[i].msg_hdr.msg_iovlen = 1;
+        m_msgs[i].msg_hdr.msg_control = &m_control[i * control_size];
+        m_msgs[i].msg_hdr.msg_controllen = control_size;
+    }
+    int n = ::recvmmsg(sock.native_handle(), m_msgs.data(), static_cast<unsigned>(m_count), MSG_DONTWAIT, nullptr);
+    if(n < 0)
+    {
+        ec = asio::error_code(errno, asio::error::get_system_category());
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            ec = asio::error::would_block;
+        }
+        return 0;
+    }
+    for(unsigned i = 0; i < static_cast<unsigned>(n); ++i)
+    {
+        size_t size = m_msgs[i].msg_len;
+        size_t segment = size;
+        for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&m_msgs[i].msg_hdr); cmsg; cmsg = CMSG_NXTHDR(&m_msgs[i].msg_hdr, cmsg))
+        {
+            if(cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO)
+            {
+                int gso_size;
+                std::memcpy(&gso_size, CMSG_DATA(cmsg), sizeof(gso_size));
+                segment = gso_size > 0 ? static_cast<size_t>(gso_size) : size;
+            }
+        }
+        m_slots[i].namelen = m_msgs[i].msg_hdr.msg_namelen;
+        for(size_t offset = 0; offset < size; offset += segment)
+        {
+            m_received.push_back(Datagram{slot_data(i) + offset, size - offset < segment ? size - offset : segment, i});
+        }
+    }
+#else
+    for(unsigned i = 0; i < m_count; ++i)
+    {
+        size_t size = sock.receive_from(asio::buffer(slot_data(i), TRANE_UDP_SLOT), m_names[i], 0, ec);
+        if(ec)
+        {
+            if(!m_received.empty() && (ec == asio::error::would_block || ec == asio::error::try_again))
+            {
+                ec = asio::error_code();
+            }
+            break;
+        }
+        m_received.push_back(Datagram{slot_data(i), size, i});
+    }
+#endif
+    return m_received.size();
+}
+
+
+inline const std::vector<trane::UdpBatch::Datagram>& trane::UdpBatch::received() const
+{
+    return m_received;
+}
+
+
+inline udp::endpoint trane::UdpBatch::from(unsigned slot) const
+{
+#ifdef TRANE_HAS_MMSG
+    udp::endpoint endpoint;
+    std::memcpy(endpoint.data(), &m_addrs[slot], m_slots[slot].namelen);
+    endpoint.resize(m_slots[slot].namelen);
+    return endpoint;
+#else
+    return m_names[slot];
+#endif
+}
+
+
+inline bool trane::UdpBatch::add(const void* data, size_t size, const udp::endpoint* to)
+{
+    if(size > TRANE_UDP_SLOT)
+    {
+        ++m_dropped;
+        return true;
+    }
+
+    // extend the previous train while the datagrams are full segments to the same destination
+    if(m_gso && m_queued)
+    {
+        Slot& last = m_slots[m_queued - 1];
+        bool same = to ? m_names[m_queued - 1] == *to : true;
+        if(same && last.size == last.segment * last.segments && size <= last.segment
+            && last.size + size <= TRANE_UDP_GSO_BYTES && last.segments < TRANE_UDP_GSO_SEGMENTS)
+        {
+            std::memcpy(slot_data(m_queued - 1) + last.size, data, size);
+            last.size += size;
+            ++last.segments;
+            return true;
+        }
+    }
+    if(m_queued == m_count)
+    {
+        return false;
+    }
+    Slot& slot = m_slots[m_queued];
+    std::memcpy(slot_data(m_queued), data, size);
+    slot.size = slot.segment = size;
+    slot.segments = 1;
+    slot.namelen = 0;
+    if(to)
+    {
+        m_names[m_queued] = *to;
+        slot.namelen = to->size();
+    }
+    ++m_queued;
+    return true;
+}
+
+
+inline bool trane::UdpBatch::empty() const
+{
+    return m_queued == 0;
+}
+
+
+inline size_t trane::UdpBatch::send(udp::socket& sock, asio::error_code& ec)
+{
+    ec = asio::error_code();
+    size_t sent = 0;
+#ifdef TRANE_HAS_MMSG
+    for(size_t i = 0; i < m_queued; ++i)
+    {
+        auto& hdr = m_msgs[i].msg_hdr;
+        std::memset(&hdr, 0, sizeof(hdr));
+        m_iovs[i].iov_base = slot_data(i);
+        m_iovs[i].iov_len = m_slots[i].size;
+        hdr.msg_iov = &m_iovs[i];
+        hdr.msg_iovlen = 1;
+        if(m_slots[i].namelen)
+        {
+            hdr.msg_name = m_names[i].data();
+            hdr.msg_namelen = static_cast<socklen_t>(m_slots[i].namelen);
+        }
+        if(m_slots[i].segments > 1)
+        {
+            hdr.msg_control = &m_control[i * control_size];
+            hdr.msg_controllen = control_size;
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+            cmsg->cmsg_level = IPPROTO_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t segment = static_cast<uint16_t>(m_slots[i].segment);
+            std::memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+        }
+    }
+    size_t done = 0;
+    while(done < m_queued)
+    {
+        int n = ::sendmmsg(sock.native_handle(), &m_msgs[done], static_cast<unsigned>(m_queued - done), MSG_DONTWAIT);
+        if(n < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                ec = asio::error_code(errno, asio::error::get_system_category());
+            }
+            // the message that failed is skipped so one bad destination does not hold up the others
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                for(; done < m_queued; ++done)
+                {
+                    m_dropped += m_slots[done].segments;
+                }
+                break;
+            }
+            m_dropped += m_slots[done++].segments;
+            continue;
+        }
+        for(int i = 0; i < n; ++i)
+        {
+            sent += m_slots[done++].segments;
+        }
+    }
+#else
+    for(size_t i = 0; i < m_queued; ++i)
+    {
+        if(m_slots[i].namelen)
+        {
+            sock.send_to(asio::buffer(slot_data(i), m_slots[i].size), m_names[i], 0, ec);
+        }
+        else
+        {
+            sock.send(asio::buffer(slot_data(i), m_slots[i].size), 0, ec);
+        }
+        if(ec)
+        {
+            ++m_dropped;
+            continue;
+        }
+        ++sent;
+    }
+#endif
+    m_queued = 0;
+    return sent;
+}
+
+
+inline size_t trane::UdpBatch::dropped() const
+{
+    return m_dropped;
+}
+
+#endif
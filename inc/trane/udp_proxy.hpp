@@ -0,0 +1,878 @@
+#ifndef TRANE_UDP_PROXY_HPP
+#define TRANE_UDP_PROXY_HPP
+
+#include "asio_standalone.hpp"
+#include "buffer_pool.hpp"
+#include "logging.hpp"
+#include "port_pool.hpp"
+#include "resolver.hpp"
+#include "udp_batch.hpp"
+#include "utils.hpp"
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#define TRANE_UDP_FRAME_HEADER 6            // 32 bit peer ID and 16 bit length, both big endian
+#define TRANE_UDP_PEER_IDLE SEC(60)         // peers without traffic for this long are forgotten
+
+namespace trane
+{
+    /*
+     * Datagrams relayed over a single TCP data connection. Every datagram is framed with the ID of the peer it came
+     * from or is going to, and all datagrams received in one batch are written to the data connection together.
+     * Datagrams that arrive while the data connection is more than the relay high watermark behind are dropped rather
+     * than queued, as the network would.
+     */
+    template<size_t BufSize>
+    class UdpTunnel
+    {
+    public:
+        struct Stats
+        {
+            uint64_t packets_in;        // datagrams received from UDP sockets
+            uint64_t packets_out;       // datagrams sent to UDP sockets
+            uint64_t dropped;
+            size_t peers;
+        };
+
+        UdpTunnel(asio::io_service& ios);
+        virtual ~UdpTunnel();
+
+        void set_tunnelid(uint64_t tunnelid);
+        uint64_t tunnelid() const;
+        void set_sessionid(uint64_t sessionid);
+        uint64_t sessionid() const;
+
+        virtual void close();
+        void set_close_handler(std::function<void()> handler);
+        Stats stats() const;
+
+    protected:
+        /*
+         * Framing over the data connection
+         */
+        void queue_frame(uint32_t peer, const unsigned char* data, size_t size);
+        void do_up_write();
+        void do_up_read();
+        void handle_up_write(const asio::error_code& err, size_t bytes_transferred);
+        void handle_up_read(const asio::error_code& err, size_t bytes_transferred);
+
+        // a datagram arrived over the data connection, and all datagrams of the last read have been handed over
+        virtual void handle_frame(uint32_t peer, const unsigned char* data, size_t size) = 0;
+        virtual void handle_frames_done() = 0;
+
+        // the data connection failed or was closed by the other end
+        virtual void handle_up_closed();
+
+        asio::io_service& m_ios;
+        uint64_t m_tunnelid{0}, m_sessionid{0};
+        std::shared_ptr<tcp::socket> m_sock_up;
+        std::deque<std::pair<Buffer, size_t>> m_queue;      // frames waiting to be written, in pooled buffers
+        size_t m_queued{0};
+        bool m_writing{false}, m_reading{false}, m_closed{false};
+        std::vector<unsigned char> m_rbuf;                  // holds at least one whole frame
+        size_t m_rsize{0};
+        UdpBatch m_rx, m_tx;
+        asio::steady_timer m_sweep;
+        Stats m_stats{0, 0, 0, 0};
+        std::function<void()> m_on_close;
+    };
+
+
+    /*
+     * Receives datagrams from any number of admin peers on a UDP port and relays them over a data connection accepted
+     * from a UdpClientProxy. Replies are sent back to the peer they belong to.
+     */
+    template<size_t BufSize>
+    class UdpServerProxy : public UdpTunnel<BufSize>
+    {
+    public:
+        typedef std::function<void(uint64_t)> DemandHandler;
+
+        UdpServerProxy(asio::io_service& ios, uint16_t port_dn, uint16_t port_up);
+
+        // a tunnel whose ports are taken from port pools by open(), and given back when it is destroyed
+        explicit UdpServerProxy(asio::io_service& ios);
+
+        // bind the admin socket and the data connection listener to ports from the pools
+        bool open(PortPool& pool_dn, PortPool& pool_up);
+        void listen();
+        void close();
+
+        // called when there is no data connection to relay over, so a new one can be requested from the client
+        void set_demand_handler(DemandHandler handler);
+
+        uint16_t port_up() const;
+        uint16_t port_dn() const;
+
+    protected:
+        void do_up_accept();
+        void handle_up_accept(std::shared_ptr<tcp::socket> sock, const asio::error_code& err);
+        void do_dn_read();
+        void handle_dn_read(const asio::error_code& err);
+        void do_sweep();
+
+        void handle_frame(uint32_t peer, const unsigned char* data, size_t size);
+        void handle_frames_done();
+        void handle_up_closed();
+        void setup_dn();
+
+        struct Peer
+        {
+            uint32_t id;
+            std::chrono::steady_clock::time_point seen;
+        };
+
+        uint16_t m_port_dn, m_port_up;
+        PortLease m_lease_dn, m_lease_up;       // outlive the sockets bound to them
+        tcp::acceptor m_acc_up;
+        udp::socket m_sock_dn;
+        std::map<udp::endpoint, Peer> m_peers;
+        std::unordered_map<uint32_t, udp::endpoint> m_endpoints;
+        uint32_t m_next_peer{0};
+        bool m_requested{false};
+        DemandHandler m_on_demand;
+    };
+
+
+    /*
+     * Connects to a UdpServerProxy and gives every peer seen there a UDP socket of its own towards the target, so the
+     * target's replies find their way back to the right peer.
+     */
+    template<size_t BufSize>
+    class UdpClientProxy : public UdpTunnel<BufSize>
+    {
+    public:
+        UdpClientProxy(asio::io_service& ios, const tcp::endpoint& trane_server, const std::string& host, uint16_t port);
+        void start();
+        void close();
+
+    protected:
+        struct Peer
+        {
+            udp::socket sock;
+            std::chrono::steady_clock::time_point seen;
+            bool reading{false};
+
+            Peer(asio::io_service& ios) : sock{ios} { }
+        };
+
+        void handle_resolve(const asio::error_code& err, udp::resolver::iterator endpoints);
+        void handle_up_connect(const asio::error_code& err);
+        void do_peer_read(uint32_t id, std::shared_ptr<Peer> peer);
+        void handle_peer_read(uint32_t id, std::shared_ptr<Peer> peer, const asio::error_code& err);
+        void flush_peer();
+        void do_sweep();
+
+        void handle_frame(uint32_t peer, const unsigned char* data, size_t size);
+        void handle_frames_done();
+
+        tcp::endpoint m_trane_server;
+        std::string m_host;
+        uint16_t m_port;
+        trane::Resolver<udp> m_resolver;
+        udp::endpoint m_target;
+        std::unordered_map<uint32_t, std::shared_ptr<Peer>> m_peers;
+        std::shared_ptr<Peer> m_tx_peer;        // the peer whose datagrams are batched in m_tx
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+template<size_t BufSize>
+trane::UdpTunnel<BufSize>::UdpTunnel(asio::io_service& ios)
+    : m_ios{ios}, m_rbuf(TRANE_UDP_FRAME_HEADER + 65535 + BufSize), m_sweep{ios}
+{ }
+
+
+template<size_t BufSize>
+trane::UdpTunnel<BufSize>::~UdpTunnel()
+{
+    LOG(VERBOSE);
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::set_tunnelid(uint64_t tunnelid)
+{
+    m_tunnelid = tunnelid;
+}
+
+
+template<size_t BufSize>
+uint64_t trane::UdpTunnel<BufSize>::tunnelid() const
+{
+    return m_tunnelid;
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::set_sessionid(uint64_t sessionid)
+{
+    m_sessionid = sessionid;
+}
+
+
+template<size_t BufSize>
+uint64_t trane::UdpTunnel<BufSize>::sessionid() const
+{
+    return m_sessionid;
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::close()
+{
+    if(m_closed)
+    {
+        return;
+    }
+    m_closed = true;
+    asio::error_code ec;
+    if(m_sock_up)
+    {
+        m_sock_up->close(ec);
+    }
+    m_sweep.cancel(ec);
+    if(m_on_close)
+    {
+        m_ios.post(m_on_close);
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::set_close_handler(std::function<void()> handler)
+{
+    m_on_close = handler;
+}
+
+
+template<size_t BufSize>
+typename trane::UdpTunnel<BufSize>::Stats trane::UdpTunnel<BufSize>::stats() const
+{
+    Stats stats = m_stats;
+    stats.dropped += m_rx.dropped() + m_tx.dropped();
+    return stats;
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::queue_frame(uint32_t peer, const unsigned char* data, size_t size)
+{
+    size_t frame = TRANE_UDP_FRAME_HEADER + size;
+    if(!m_sock_up || m_queued + frame > TRANE_RELAY_HIGH_WATERMARK)
+    {
+        ++m_stats.dropped;
+        return;
+    }
+
+    // frames are packed back to back into the last buffer while it has room
+    if(m_queue.empty() || m_queue.back().first.capacity() - m_queue.back().second < frame
+        || (m_writing && m_queue.size() == 1))
+    {
+        Buffer buf = BufferPool::instance().acquire(frame > TRANE_BUFSIZE ? BULK : STANDARD);
+        if(!buf || buf.capacity() < frame)
+        {
+            ++m_stats.dropped;
+            return;
+        }
+        m_queue.emplace_back(std::move(buf), 0);
+    }
+    auto& back = m_queue.back();
+    unsigned char* p = back.first.data() + back.second;
+    p[0] = static_cast<unsigned char>(peer >> 24);
+    p[1] = static_cast<unsigned char>(peer >> 16);
+    p[2] = static_cast<unsigned char>(peer >> 8);
+    p[3] = static_cast<unsigned char>(peer);
+    p[4] = static_cast<unsigned char>(size >> 8);
+    p[5] = static_cast<unsigned char>(size);
+    std::memcpy(p + TRANE_UDP_FRAME_HEADER, data, size);
+    back.second += frame;
+    m_queued += frame;
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::do_up_write()
+{
+    if(m_writing || m_queue.empty() || !m_sock_up || m_closed)
+    {
+        return;
+    }
+    m_writing = true;
+    auto sock = m_sock_up;
+    asio::async_write(*sock, asio::buffer(m_queue.front().first.data(), m_queue.front().second),
+        [this, sock](const asio::error_code& err, size_t bytes_transferred)
+        {
+            if(sock != this->m_sock_up)
+            {
+                return;
+            }
+            this->handle_up_write(err, bytes_transferred);
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::handle_up_write(const asio::error_code& err, size_t bytes_transferred)
+{
+    m_writing = false;
+    if(err)
+    {
+        LOG(ERROR) << err.message();
+        this->handle_up_closed();
+        return;
+    }
+    m_queued -= bytes_transferred;
+    m_queue.pop_front();
+    this->do_up_write();
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::do_up_read()
+{
+    if(m_reading || !m_sock_up || m_closed)
+    {
+        return;
+    }
+    m_reading = true;
+    auto sock = m_sock_up;
+    sock->async_read_some(asio::buffer(m_rbuf.data() + m_rsize, m_rbuf.size() - m_rsize),
+        [this, sock](const asio::error_code& err, size_t bytes_transferred)
+        {
+            if(sock != this->m_sock_up)
+            {
+                return;
+            }
+            this->handle_up_read(err, bytes_transferred);
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::handle_up_read(const asio::error_code& err, size_t bytes_transferred)
+{
+    m_reading = false;
+    if(err)
+    {
+        if(err != asio::error::eof)
+        {
+            LOG(ERROR) << err.message();
+        }
+        this->handle_up_closed();
+        return;
+    }
+    m_rsize += bytes_transferred;
+
+    size_t offset = 0;
+    while(m_rsize - offset >= TRANE_UDP_FRAME_HEADER)
+    {
+        const unsigned char* p = m_rbuf.data() + offset;
+        uint32_t peer = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+        size_t size = (size_t(p[4]) << 8) | size_t(p[5]);
+        if(m_rsize - offset < TRANE_UDP_FRAME_HEADER + size)
+        {
+            break;
+        }
+        this->handle_frame(peer, p + TRANE_UDP_FRAME_HEADER, size);
+        offset += TRANE_UDP_FRAME_HEADER + size;
+    }
+    this->handle_frames_done();
+
+    // keep the partial frame at the front, there is always room for the rest of it
+    std::memmove(m_rbuf.data(), m_rbuf.data() + offset, m_rsize - offset);
+    m_rsize -= offset;
+    this->do_up_read();
+}
+
+
+template<size_t BufSize>
+void trane::UdpTunnel<BufSize>::handle_up_closed()
+{
+    this->close();
+}
+
+
+template<size_t BufSize>
+trane::UdpServerProxy<BufSize>::UdpServerProxy(asio::io_service& ios, uint16_t port_dn, uint16_t port_up)
+    : UdpTunnel<BufSize>(ios), m_port_dn{port_dn}, m_port_up{port_up},
+    m_acc_up{ios, tcp::endpoint(tcp::v4(), port_up)}, m_sock_dn{ios, udp::endpoint(udp::v4(), port_dn)}
+{
+    this->setup_dn();
+}
+
+
+template<size_t BufSize>
+trane::UdpServerProxy<BufSize>::UdpServerProxy(asio::io_service& ios)
+    : UdpTunnel<BufSize>(ios), m_port_dn{0}, m_port_up{0}, m_acc_up{ios}, m_sock_dn{ios}
+{ }
+
+
+template<size_t BufSize>
+bool trane::UdpServerProxy<BufSize>::open(PortPool& pool_dn, PortPool& pool_up)
+{
+    asio::error_code ec;
+    if(!pool_dn.bind(m_sock_dn, m_lease_dn) || !pool_up.bind(m_acc_up, m_lease_up))
+    {
+        return false;
+    }
+    m_acc_up.listen(asio::socket_base::max_listen_connections, ec);
+    if(ec)
+    {
+        LOG(ERROR) << "could not listen on tunnel port: " << ec.message();
+        return false;
+    }
+    m_port_dn = m_lease_dn.port();
+    m_port_up = m_lease_up.port();
+    this->setup_dn();
+    return true;
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::setup_dn()
+{
+    m_sock_dn.non_blocking(true);
+    this->m_rx.enable_gro(m_sock_dn);
+    this->m_tx.enable_gso(m_sock_dn);
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::listen()
+{
+    LOG(INFO) << "Listening for trane UDP tunnel on 0.0.0.0:" << std::dec << m_port_up;
+    LOG(INFO) << "Listening for admin datagrams on 0.0.0.0:" << std::dec << m_port_dn;
+    this->do_up_accept();
+    this->do_dn_read();
+    this->do_sweep();
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::close()
+{
+    asio::error_code ec;
+    m_acc_up.close(ec);
+    m_sock_dn.close(ec);
+    this->UdpTunnel<BufSize>::close();
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::set_demand_handler(DemandHandler handler)
+{
+    m_on_demand = handler;
+}
+
+
+template<size_t BufSize>
+uint16_t trane::UdpServerProxy<BufSize>::port_up() const
+{
+    return m_port_up;
+}
+
+
+template<size_t BufSize>
+uint16_t trane::UdpServerProxy<BufSize>::port_dn() const
+{
+    return m_port_dn;
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::do_up_accept()
+{
+    auto sock = std::make_shared<tcp::socket>(this->m_ios);
+    m_acc_up.async_accept(*sock,
+        [this, sock](const asio::error_code& err)
+        {
+            this->handle_up_accept(sock, err);
+        }
+    );
+}
+
+
+/*
+ * A new data connection replaces the current one. Peers keep their IDs, so datagrams keep flowing once the client
+ * has reconnected.
+ */
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::handle_up_accept(std::shared_ptr<tcp::socket> sock, const asio::error_code& err)
+{
+    if(err)
+    {
+        if(!this->m_closed)
+        {
+            LOG(ERROR) << err.message();
+        }
+        return;
+    }
+    LOG(DEBUG) << "UDP tunnel connected";
+    asio::error_code ec;
+    sock->set_option(tcp::no_delay(true), ec);
+    if(this->m_sock_up)
+    {
+        this->m_sock_up->close(ec);
+    }
+    this->m_sock_up = sock;
+    this->m_queue.clear();
+    this->m_queued = this->m_rsize = 0;
+    this->m_writing = this->m_reading = false;
+    m_requested = false;
+    this->do_up_read();
+    this->do_up_accept();
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::do_dn_read()
+{
+    m_sock_dn.async_wait(asio::socket_base::wait_read,
+        [this](const asio::error_code& err)
+        {
+            this->handle_dn_read(err);
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::handle_dn_read(const asio::error_code& err)
+{
+    if(err)
+    {
+        if(!this->m_closed)
+        {
+            LOG(ERROR) << err.message();
+        }
+        return;
+    }
+    if(!this->m_sock_up && !m_requested && m_on_demand)
+    {
+        m_requested = true;
+        m_on_demand(this->m_tunnelid);
+    }
+
+    // drain a few batches per wakeup so one busy port cannot starve the rest of the io_service
+    auto now = std::chrono::steady_clock::now();
+    asio::error_code ec;
+    for(int i = 0; i < 8 && this->m_rx.recv(m_sock_dn, ec); ++i)
+    {
+        for(auto& datagram : this->m_rx.received())
+        {
+            udp::endpoint from = this->m_rx.from(datagram.slot);
+            auto peer = m_peers.find(from);
+            if(peer == m_peers.end())
+            {
+                while(m_endpoints.count(m_next_peer))
+                {
+                    ++m_next_peer;
+                }
+                peer = m_peers.emplace(from, Peer{m_next_peer, now}).first;
+                m_endpoints[m_next_peer++] = from;
+                LOG(DEBUG) << "new UDP peer " << from.address().to_string() << ':' << std::dec << from.port();
+            }
+            peer->second.seen = now;
+            ++this->m_stats.packets_in;
+            this->queue_frame(peer->second.id, datagram.data, datagram.size);
+        }
+    }
+    if(ec && ec != asio::error::would_block && ec != asio::error::try_again)
+    {
+        LOG(WARNING) << ec.message();
+    }
+    this->do_up_write();
+    this->do_dn_read();
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::handle_frame(uint32_t peer, const unsigned char* data, size_t size)
+{
+    auto endpoint = m_endpoints.find(peer);
+    if(endpoint == m_endpoints.end())
+    {
+        ++this->m_stats.dropped;
+        return;
+    }
+    if(!this->m_tx.add(data, size, &endpoint->second))
+    {
+        this->handle_frames_done();
+        this->m_tx.add(data, size, &endpoint->second);
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::handle_frames_done()
+{
+    if(this->m_tx.empty())
+    {
+        return;
+    }
+    asio::error_code ec;
+    this->m_stats.packets_out += this->m_tx.send(m_sock_dn, ec);
+    if(ec)
+    {
+        LOG(WARNING) << ec.message();
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::handle_up_closed()
+{
+    // keep the UDP port and the peers, only the data connection has to be replaced
+    LOG(WARNING) << "UDP tunnel data connection lost";
+    asio::error_code ec;
+    this->m_sock_up->close(ec);
+    this->m_sock_up.reset();
+    this->m_queue.clear();
+    this->m_queued = this->m_rsize = 0;
+    this->m_writing = this->m_reading = false;
+}
+
+
+template<size_t BufSize>
+void trane::UdpServerProxy<BufSize>::do_sweep()
+{
+    this->m_sweep.expires_after(TRANE_UDP_PEER_IDLE);
+    this->m_sweep.async_wait(
+        [this](const asio::error_code& err)
+        {
+            if(err)
+            {
+                return;
+            }
+            auto expired = std::chrono::steady_clock::now() - TRANE_UDP_PEER_IDLE;
+            for(auto peer = this->m_peers.begin(); peer != this->m_peers.end();)
+            {
+                if(peer->second.seen < expired)
+                {
+                    this->m_endpoints.erase(peer->second.id);
+                    peer = this->m_peers.erase(peer);
+                    continue;
+                }
+                ++peer;
+            }
+            this->do_sweep();
+        }
+    );
+}
+
+
+template<size_t BufSize>
+trane::UdpClientProxy<BufSize>::UdpClientProxy(asio::io_service& ios, const tcp::endpoint& trane_server, const std::string& host, uint16_t port)
+    : UdpTunnel<BufSize>(ios), m_trane_server{trane_server}, m_host{host}, m_port{port}, m_resolver{ios}
+{
+    LOG(VERBOSE);
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::start()
+{
+    m_resolver.resolve(m_host, m_port,
+        [this](const asio::error_code& err, udp::resolver::iterator endpoints)
+        {
+            this->handle_resolve(err, endpoints);
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::close()
+{
+    asio::error_code ec;
+    for(auto& peer : m_peers)
+    {
+        peer.second->sock.close(ec);
+    }
+    m_peers.clear();
+    m_tx_peer.reset();
+    this->UdpTunnel<BufSize>::close();
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::handle_resolve(const asio::error_code& err, udp::resolver::iterator endpoints)
+{
+    if(err)
+    {
+        LOG(ERROR) << err.message();
+        this->close();
+        return;
+    }
+    m_target = *endpoints;
+    this->m_sock_up = std::make_shared<tcp::socket>(this->m_ios);
+    this->m_sock_up->async_connect(m_trane_server,
+        [this](const asio::error_code& err)
+        {
+            this->handle_up_connect(err);
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::handle_up_connect(const asio::error_code& err)
+{
+    if(err)
+    {
+        LOG(ERROR) << err.message();
+        this->close();
+        return;
+    }
+    LOG(SUCCESS) << "Connected to UdpServerProxy";
+    asio::error_code ec;
+    this->m_sock_up->set_option(tcp::no_delay(true), ec);
+    this->do_up_read();
+    this->do_sweep();
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::handle_frame(uint32_t id, const unsigned char* data, size_t size)
+{
+    auto entry = m_peers.find(id);
+    if(entry == m_peers.end())
+    {
+        // a connected socket per peer, so the target's replies can be told apart
+        auto peer = std::make_shared<Peer>(this->m_ios);
+        asio::error_code ec;
+        peer->sock.connect(m_target, ec);
+        if(ec)
+        {
+            LOG(ERROR) << ec.message();
+            ++this->m_stats.dropped;
+            return;
+        }
+        peer->sock.non_blocking(true);
+        entry = m_peers.emplace(id, peer).first;
+        this->do_peer_read(id, peer);
+    }
+    auto& peer = entry->second;
+    peer->seen = std::chrono::steady_clock::now();
+
+    // batch consecutive datagrams of the same peer, which share a socket
+    if(m_tx_peer != peer)
+    {
+        this->flush_peer();
+        m_tx_peer = peer;
+    }
+    if(!this->m_tx.add(data, size, nullptr))
+    {
+        this->flush_peer();
+        m_tx_peer = peer;
+        this->m_tx.add(data, size, nullptr);
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::handle_frames_done()
+{
+    this->flush_peer();
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::flush_peer()
+{
+    if(!m_tx_peer || this->m_tx.empty())
+    {
+        return;
+    }
+    asio::error_code ec;
+    this->m_stats.packets_out += this->m_tx.send(m_tx_peer->sock, ec);
+    if(ec)
+    {
+        LOG(DEBUG) << ec.message();
+    }
+    m_tx_peer.reset();
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::do_peer_read(uint32_t id, std::shared_ptr<Peer> peer)
+{
+    peer->sock.async_wait(asio::socket_base::wait_read,
+        [this, id, peer](const asio::error_code& err)
+        {
+            this->handle_peer_read(id, peer, err);
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::handle_peer_read(uint32_t id, std::shared_ptr<Peer> peer, const asio::error_code& err)
+{
+    if(err || this->m_closed)
+    {
+        return;
+    }
+    asio::error_code ec;
+    for(int i = 0; i < 8 && this->m_rx.recv(peer->sock, ec); ++i)
+    {
+        for(auto& datagram : this->m_rx.received())
+        {
+            ++this->m_stats.packets_in;
+            this->queue_frame(id, datagram.data, datagram.size);
+        }
+    }
+    peer->seen = std::chrono::steady_clock::now();
+    this->do_up_write();
+
+    // ICMP errors from the target surface as failed receives, which must not stop the peer
+    if(ec == asio::error::connection_refused)
+    {
+        ++this->m_stats.dropped;
+    }
+    this->do_peer_read(id, peer);
+}
+
+
+template<size_t BufSize>
+void trane::UdpClientProxy<BufSize>::do_sweep()
+{
+    this->m_sweep.expires_after(TRANE_UDP_PEER_IDLE);
+    this->m_sweep.async_wait(
+        [this](const asio::error_code& err)
+        {
+            if(err)
+            {
+                return;
+            }
+            auto expired = std::chrono::steady_clock::now() - TRANE_UDP_PEER_IDLE;
+            for(auto peer = this->m_peers.begin(); peer != this->m_peers.end();)
+            {
+                if(peer->second->seen < expired)
+                {
+                    asio::error_code ec;
+                    peer->second->sock.close(ec);
+                    peer = this->m_peers.erase(peer);
+                    continue;
+                }
+                ++peer;
+            }
+            this->do_sweep();
+        }
+    );
+}
+
+#endif
@@ -0,0 +1,1124 @@
+#ifndef TRANE_URING_HPP
+#define TRANE_URING_HPP
+
+#include "asio_standalone.hpp"
+#include "logging.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_RECV_MULTISHOT
+#define TRANE_HAS_IO_URING 1
+#endif
+#endif
+#endif
+
+#ifdef TRANE_HAS_IO_URING
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define TRANE_URING_ENTRIES 1024
+#define TRANE_URING_SLOTS 4096               // BufSize slots in the arena shared by every tunnel on the ring
+#define TRANE_URING_CHANNEL_SLOTS 4          // slots owned by one relay direction, must be a power of two
+
+namespace trane
+{
+    /*
+     * Anything with an operation in flight on the ring. The low three bits of the submission's user_data carry a tag
+     * so one object can tell its own operations apart.
+     */
+    class UringOp
+    {
+    public:
+        virtual void complete(unsigned tag, int res, unsigned flags) = 0;
+
+        // the ring is going away with the io_service, nothing may touch it any more
+        virtual void orphan() = 0;
+
+        // submit what did not fit into the submission queue earlier
+        virtual void resume() = 0;
+
+    protected:
+        ~UringOp() = default;
+    };
+
+
+    /*
+     * One io_uring instance per io_service. Completions are signalled through an eventfd that asio waits on, so the
+     * ring is reaped on the same thread that runs the rest of the tunnel's handlers. All submissions queued while
+     * handling one batch of completions go to the kernel in a single io_uring_enter.
+     */
+    template<size_t BufSize>
+    class Uring : public asio::io_service::service
+    {
+    public:
+        static asio::io_service::id id;
+
+        explicit Uring(asio::io_service& ios);
+        ~Uring();
+        void shutdown();
+
+        bool ok() const;
+
+        /*
+         * Channels attach while they are open so that the ring is only waited on while something can complete, and
+         * are orphaned by shutdown if they are still attached then
+         */
+        void attach(UringOp* op);
+        void detach(UringOp* op);
+
+        /*
+         * BufSize slots of the buffer arena, handed to the kernel through per-channel provided buffer rings
+         */
+        bool alloc_slot(uint32_t& slot);
+        void free_slot(uint32_t slot);
+        unsigned char* slot_data(uint32_t slot);
+        bool register_group(void* ring, unsigned entries, uint16_t& bgid);
+        void unregister_group(uint16_t bgid);
+
+        /*
+         * Get a zeroed submission queue entry, or nullptr if the ring is full. An op that got none asks to be retried
+         * and is resumed once completions have been reaped or the queue has been submitted.
+         */
+        struct io_uring_sqe* sqe();
+        void submit();
+        void retry(UringOp* op);
+
+    private:
+        void setup();
+        void do_wait();
+        void reap();
+        void resume();
+
+        asio::io_service& m_ios;
+        asio::posix::stream_descriptor m_event;
+        int m_fd{-1}, m_efd{-1};
+        bool m_ok{false}, m_waiting{false}, m_submit_pending{false};
+        std::unordered_set<UringOp*> m_attached;
+        std::vector<UringOp*> m_retry;
+
+        // mapped rings
+        void *m_sq_ptr{nullptr}, *m_cq_ptr{nullptr};
+        size_t m_sq_size{0}, m_cq_size{0};
+        struct io_uring_sqe* m_sqes{nullptr};
+        unsigned *m_sq_head{nullptr}, *m_sq_tail{nullptr}, *m_sq_array{nullptr};
+        unsigned *m_cq_head{nullptr}, *m_cq_tail{nullptr};
+        struct io_uring_cqe* m_cqes{nullptr};
+        unsigned m_sq_mask{0}, m_sq_entries{0}, m_cq_mask{0};
+        unsigned m_sq_local{0}, m_sq_submitted{0};
+
+        // buffer arena
+        unsigned char* m_arena{nullptr};
+        std::vector<uint32_t> m_free_slots;
+        std::vector<uint16_t> m_free_groups;
+    };
+
+
+    /*
+     * One direction of an io_uring relay: a multishot receive from one socket into this channel's provided buffers,
+     * and writes of those buffers to the other socket in order. Running out of buffers ends the multishot receive,
+     * which is how backpressure reaches the sending peer; it is re-armed as soon as a write returns a buffer.
+     */
+    template<size_t BufSize>
+    class UringChannel
+    {
+    public:
+        typedef std::function<void()> Notify;
+        typedef std::function<void(int err)> Failure;
+
+        UringChannel() = default;
+        UringChannel(const UringChannel&) = delete;
+        UringChannel& operator=(const UringChannel&) = delete;
+        ~UringChannel();
+
+        // on_done is called once the direction has shut down its writer after a clean EOF, on_fail with the errno of a
+        // failed receive or write
+        bool open(asio::io_service& ios, Notify on_data, Notify on_done = Notify(), Failure on_fail = Failure());
+        void close();
+        bool is_open() const;
+
+        // count receives into reads, and sends and their bytes into writes and bytes, like the asio relay does
+        void count(Counter& reads, Counter& writes, Counter& bytes);
+
+        void start(int fd);         // receive from fd
+        void flush(int fd);         // write whatever has been received to fd
+
+        size_t queued() const;
+
+    private:
+        struct State;
+        State* m_state{nullptr};
+    };
+}
+
+
+/*
+ * IMPLEMENTATION
+ */
+
+
+template<size_t BufSize>
+asio::io_service::id trane::Uring<BufSize>::id;
+
+
+#ifdef TRANE_HAS_IO_URING
+
+namespace trane
+{
+    namespace uring
+    {
+        enum Tag : unsigned
+        {
+            RECV = 1,
+            WRITE = 2,
+            CANCEL = 3,
+        };
+
+        inline int setup(unsigned entries, struct io_uring_params* p)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+        }
+
+        inline int enter(int fd, unsigned to_submit)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, nullptr, 0));
+        }
+
+        inline int do_register(int fd, unsigned opcode, const void* arg, unsigned nr_args)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+        }
+    }
+}
+
+
+template<size_t BufSize>
+trane::Uring<BufSize>::Uring(asio::io_service& ios)
+    : asio::io_service::service(ios), m_ios{ios}, m_event{ios}
+{
+    this->setup();
+}
+
+
+template<size_t BufSize>
+trane::Uring<BufSize>::~Uring()
+{
+    this->shutdown();
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::setup()
+{
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CLAMP;
+    m_fd = uring::setup(TRANE_URING_ENTRIES, &p);
+    if(m_fd < 0)
+    {
+        LOG(WARNING) << "io_uring_setup: " << std::strerror(errno);
+        return;
+    }
+
+    m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if(single)
+    {
+        m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+    }
+
+    m_sq_ptr = ::mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if(m_sq_ptr == MAP_FAILED)
+    {
+        m_sq_ptr = nullptr;
+        return;
+    }
+    m_cq_ptr = single ? m_sq_ptr : ::mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+    if(m_cq_ptr == MAP_FAILED)
+    {
+        m_cq_ptr = nullptr;
+        return;
+    }
+    void* sqes = ::mmap(nullptr, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED)
+    {
+        return;
+    }
+    m_sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    auto sq = static_cast<unsigned char*>(m_sq_ptr);
+    auto cq = static_cast<unsigned char*>(m_cq_ptr);
+    m_sq_head = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+    m_sq_tail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+    m_sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+    m_sq_mask = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+    m_sq_entries = p.sq_entries;
+    m_sq_local = m_sq_submitted = *m_sq_tail;
+    m_cq_head = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+    m_cq_tail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+    m_cq_mask = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+    m_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+    m_efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(m_efd < 0 || uring::do_register(m_fd, IORING_REGISTER_EVENTFD, &m_efd, 1) < 0)
+    {
+        LOG(WARNING) << "io_uring eventfd: " << std::strerror(errno);
+        return;
+    }
+    m_event.assign(m_efd);
+
+    void* arena = ::mmap(nullptr, TRANE_URING_SLOTS * BufSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(arena == MAP_FAILED)
+    {
+        return;
+    }
+    m_arena = static_cast<unsigned char*>(arena);
+
+    m_free_slots.reserve(TRANE_URING_SLOTS);
+    for(uint32_t i = TRANE_URING_SLOTS; i > 0; --i)
+    {
+        m_free_slots.push_back(i - 1);
+    }
+    for(uint32_t i = TRANE_URING_SLOTS / TRANE_URING_CHANNEL_SLOTS; i > 0; --i)
+    {
+        m_free_groups.push_back(static_cast<uint16_t>(i - 1));
+    }
+    m_ok = true;
+}
+
+
+/*
+ * Runs before the handlers still queued on the io_service are destroyed, and with them the proxies owning channels,
+ * so every channel is cut loose from the ring before it is unmapped.
+ */
+template<size_t BufSize>
+void trane::Uring<BufSize>::shutdown()
+{
+    m_ok = false;
+    auto attached = std::move(m_attached);
+    m_attached.clear();
+    m_retry.clear();
+    for(UringOp* op : attached)
+    {
+        op->orphan();
+    }
+    asio::error_code ec;
+    m_event.close(ec);
+    m_efd = -1;
+    if(m_arena)
+    {
+        ::munmap(m_arena, TRANE_URING_SLOTS * BufSize);
+        m_arena = nullptr;
+    }
+    if(m_sqes)
+    {
+        ::munmap(m_sqes, m_sq_entries * sizeof(struct io_uring_sqe));
+        m_sqes = nullptr;
+    }
+    if(m_cq_ptr && m_cq_ptr != m_sq_ptr)
+    {
+        ::munmap(m_cq_ptr, m_cq_size);
+    }
+    if(m_sq_ptr)
+    {
+        ::munmap(m_sq_ptr, m_sq_size);
+    }
+    m_sq_ptr = m_cq_ptr = nullptr;
+    if(m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+
+template<size_t BufSize>
+bool trane::Uring<BufSize>::ok() const
+{
+    return m_ok;
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::attach(UringOp* op)
+{
+    m_attached.insert(op);
+    this->do_wait();
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::detach(UringOp* op)
+{
+    m_retry.erase(std::remove(m_retry.begin(), m_retry.end(), op), m_retry.end());
+    if(m_attached.erase(op) && m_attached.empty() && m_waiting)
+    {
+        asio::error_code ec;
+        m_event.cancel(ec);
+    }
+}
+
+
+template<size_t BufSize>
+bool trane::Uring<BufSize>::alloc_slot(uint32_t& slot)
+{
+    if(m_free_slots.empty())
+    {
+        return false;
+    }
+    slot = m_free_slots.back();
+    m_free_slots.pop_back();
+    return true;
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::free_slot(uint32_t slot)
+{
+    m_free_slots.push_back(slot);
+}
+
+
+template<size_t BufSize>
+unsigned char* trane::Uring<BufSize>::slot_data(uint32_t slot)
+{
+    return m_arena + static_cast<size_t>(slot) * BufSize;
+}
+
+
+template<size_t BufSize>
+bool trane::Uring<BufSize>::register_group(void* ring, unsigned entries, uint16_t& bgid)
+{
+    if(m_free_groups.empty())
+    {
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+    reg.ring_entries = entries;
+    reg.bgid = m_free_groups.back();
+    if(uring::do_register(m_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        LOG(WARNING) << "io_uring provided buffers: " << std::strerror(errno);
+        return false;
+    }
+    bgid = reg.bgid;
+    m_free_groups.pop_back();
+    return true;
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::unregister_group(uint16_t bgid)
+{
+    struct io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.bgid = bgid;
+    if(m_fd >= 0)
+    {
+        uring::do_register(m_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    }
+    m_free_groups.push_back(bgid);
+}
+
+
+template<size_t BufSize>
+struct io_uring_sqe* trane::Uring<BufSize>::sqe()
+{
+    if(!m_ok)
+    {
+        return nullptr;
+    }
+    if(m_sq_local - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+    {
+        this->submit();
+        if(m_sq_local - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+        {
+            return nullptr;
+        }
+    }
+    unsigned index = m_sq_local & m_sq_mask;
+    struct io_uring_sqe* sqe = &m_sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    ++m_sq_local;
+
+    if(!m_submit_pending)
+    {
+        m_submit_pending = true;
+        m_ios.post([this]{
+            this->m_submit_pending = false;
+            this->submit();
+            this->resume();
+        });
+    }
+    return sqe;
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::submit()
+{
+    if(m_fd < 0 || m_sq_local == m_sq_submitted)
+    {
+        return;
+    }
+    __atomic_store_n(m_sq_tail, m_sq_local, __ATOMIC_RELEASE);
+    int n = uring::enter(m_fd, m_sq_local - m_sq_submitted);
+    if(n < 0)
+    {
+        LOG(ERROR) << "io_uring_enter: " << std::strerror(errno);
+        return;
+    }
+    m_sq_submitted += static_cast<unsigned>(n);
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::retry(UringOp* op)
+{
+    m_retry.push_back(op);
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::resume()
+{
+    if(m_retry.empty())
+    {
+        return;
+    }
+    // resumed ops may ask again, or release themselves
+    std::vector<UringOp*> retry;
+    retry.swap(m_retry);
+    for(UringOp* op : retry)
+    {
+        if(m_attached.count(op))
+        {
+            op->resume();
+        }
+    }
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::do_wait()
+{
+    if(m_waiting || !m_ok || m_attached.empty())
+    {
+        return;
+    }
+    m_waiting = true;
+    m_event.async_wait(asio::posix::stream_descriptor::wait_read,
+        [this](const asio::error_code& err)
+        {
+            this->m_waiting = false;
+            if(err)
+            {
+                return;
+            }
+            uint64_t count;
+            while(::read(this->m_efd, &count, sizeof(count)) > 0)
+            {}
+            this->reap();
+            this->do_wait();
+        }
+    );
+}
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::reap()
+{
+    unsigned head = *m_cq_head;
+    while(true)
+    {
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        if(head == tail)
+        {
+            break;
+        }
+        struct io_uring_cqe* cqe = &m_cqes[head & m_cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        __atomic_store_n(m_cq_head, ++head, __ATOMIC_RELEASE);
+
+        auto op = reinterpret_cast<UringOp*>(user_data & ~static_cast<uint64_t>(7));
+        if(op)
+        {
+            op->complete(static_cast<unsigned>(user_data & 7), res, flags);
+        }
+    }
+    this->resume();
+}
+
+
+template<size_t BufSize>
+struct trane::UringChannel<BufSize>::State final : public trane::UringOp
+{
+    struct Slice
+    {
+        uint16_t bid;
+        uint32_t offset, size;
+    };
+
+    void provide(uint16_t bid);
+    void arm();
+    void write();
+    void cancel();
+    void defer(bool& retry);
+    void finish_eof();
+    void fail(int err);
+    void complete(unsigned tag, int res, unsigned flags) override;
+    void orphan() override;
+    void resume() override;
+    void release();
+    uint64_t user_data(unsigned tag) { return reinterpret_cast<uint64_t>(this) | tag; }
+
+    Uring<BufSize>* ring{nullptr};
+    Notify on_data, on_done;
+    Failure on_fail;
+    Counter *reads{nullptr}, *writes{nullptr}, *bytes{nullptr};
+    struct io_uring_buf* bufs{nullptr};          // provided buffer ring, one page
+    uint32_t slots[TRANE_URING_CHANNEL_SLOTS];
+    uint16_t bgid{0}, tail{0};
+    int from{-1}, to{-1};
+    std::deque<Slice> queue;
+    size_t queued{0};
+    unsigned inflight{0};
+    bool armed{false}, starved{false}, writing{false}, eof{false}, done{false}, dead{false}, orphaned{false};
+    bool retry_recv{false}, retry_write{false}, retry_cancel{false};
+};
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::provide(uint16_t bid)
+{
+    struct io_uring_buf& buf = bufs[tail & (TRANE_URING_CHANNEL_SLOTS - 1)];
+    buf.addr = reinterpret_cast<uint64_t>(ring->slot_data(slots[bid]));
+    buf.len = BufSize;
+    buf.bid = bid;
+    __atomic_store_n(&bufs[0].resv, ++tail, __ATOMIC_RELEASE);
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::arm()
+{
+    if(armed || eof || dead || orphaned || from < 0)
+    {
+        return;
+    }
+    struct io_uring_sqe* sqe = ring->sqe();
+    if(!sqe)
+    {
+        this->defer(retry_recv);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = from;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data(uring::RECV);
+    armed = true;
+    starved = false;
+    ++inflight;
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::write()
+{
+    if(writing || dead || orphaned || to < 0)
+    {
+        return;
+    }
+    if(queue.empty())
+    {
+        this->finish_eof();
+        return;
+    }
+    struct io_uring_sqe* sqe = ring->sqe();
+    if(!sqe)
+    {
+        this->defer(retry_write);
+        return;
+    }
+    const Slice& slice = queue.front();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = to;
+    sqe->addr = reinterpret_cast<uint64_t>(ring->slot_data(slots[slice.bid]) + slice.offset);
+    sqe->len = slice.size - slice.offset;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = user_data(uring::WRITE);
+    writing = true;
+    ++inflight;
+}
+
+
+/*
+ * Cancel the multishot receive of a closed channel, which keeps the state alive until it completes
+ */
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::cancel()
+{
+    if(!armed || orphaned)
+    {
+        return;
+    }
+    struct io_uring_sqe* sqe = ring->sqe();
+    if(!sqe)
+    {
+        this->defer(retry_cancel);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data(uring::RECV);
+    sqe->user_data = user_data(uring::CANCEL);
+    ++inflight;
+}
+
+
+// the submission queue is full, the operation goes out once the ring has room again
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::defer(bool& retry)
+{
+    LOG(VERBOSE) << "io_uring submission queue full, retrying";
+    if(!retry_recv && !retry_write && !retry_cancel)
+    {
+        ring->retry(this);
+    }
+    retry = true;
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::resume()
+{
+    bool recv = retry_recv, send = retry_write, cancel = retry_cancel;
+    retry_recv = retry_write = retry_cancel = false;
+    if(cancel)
+    {
+        this->cancel();
+    }
+    if(recv)
+    {
+        this->arm();
+    }
+    if(send)
+    {
+        this->write();
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::finish_eof()
+{
+    if(!eof || armed || !queue.empty() || done)
+    {
+        return;
+    }
+    // nothing may have been received at all, in which case no writer was ever attached
+    if(to >= 0)
+    {
+        ::shutdown(to, SHUT_WR);
+        to = -1;
+    }
+    done = true;
+    if(on_done)
+    {
+        on_done();
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::fail(int err)
+{
+    eof = true;
+    to = -1;
+    if(done)
+    {
+        return;
+    }
+    done = true;
+    if(on_fail)
+    {
+        on_fail(err);
+        return;
+    }
+    LOG(ERROR) << std::strerror(err);
+    if(on_done)
+    {
+        on_done();
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::complete(unsigned tag, int res, unsigned flags)
+{
+    --inflight;
+    if(dead)
+    {
+        if(tag == uring::RECV && (flags & IORING_CQE_F_MORE))
+        {
+            ++inflight;
+        }
+        if(inflight == 0)
+        {
+            this->release();
+        }
+        return;
+    }
+
+    if(tag == uring::RECV)
+    {
+        if(flags & IORING_CQE_F_MORE)
+        {
+            ++inflight;
+        }
+        else
+        {
+            armed = false;
+        }
+        if(res > 0)
+        {
+            queue.push_back(Slice{static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT), 0, static_cast<uint32_t>(res)});
+            queued += static_cast<size_t>(res);
+            if(reads)
+            {
+                ++*reads;
+            }
+            LOG(VERBOSE) << "received " << std::dec << res;
+            if(!armed)
+            {
+                this->arm();
+            }
+            if(on_data)
+            {
+                on_data();
+            }
+        }
+        else if(res == -ENOBUFS)
+        {
+            LOG(VERBOSE) << "out of buffers with " << std::dec << queued << " bytes queued";
+            starved = true;
+        }
+        else if(res == 0)
+        {
+            LOG(DEBUG) << "peer closed";
+            eof = true;
+            this->finish_eof();
+        }
+        else
+        {
+            this->fail(-res);
+        }
+    }
+    else if(tag == uring::WRITE)
+    {
+        writing = false;
+        if(writes)
+        {
+            ++*writes;
+        }
+        if(res < 0)
+        {
+            this->fail(-res);
+            return;
+        }
+        if(bytes)
+        {
+            *bytes += static_cast<uint64_t>(res);
+        }
+        Slice& slice = queue.front();
+        slice.offset += static_cast<uint32_t>(res);
+        queued -= static_cast<size_t>(res);
+        if(slice.offset >= slice.size)
+        {
+            uint16_t bid = slice.bid;
+            queue.pop_front();
+            this->provide(bid);
+            if(starved)
+            {
+                this->arm();
+            }
+        }
+        this->write();
+    }
+}
+
+
+/*
+ * A channel whose handle is already closed only waited for completions that will never come now, the others are
+ * released once their handle closes
+ */
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::orphan()
+{
+    orphaned = true;
+    if(dead)
+    {
+        this->release();
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::State::release()
+{
+    // an orphaned channel's slots, buffer group and registration went with the ring
+    if(!orphaned)
+    {
+        if(bufs)
+        {
+            ring->unregister_group(bgid);
+        }
+        for(uint32_t slot : slots)
+        {
+            ring->free_slot(slot);
+        }
+        ring->detach(this);
+    }
+    if(bufs)
+    {
+        ::munmap(bufs, 4096);
+    }
+    delete this;
+}
+
+
+template<size_t BufSize>
+bool trane::UringChannel<BufSize>::open(asio::io_service& ios, Notify on_data, Notify on_done, Failure on_fail)
+{
+    if(m_state)
+    {
+        return true;
+    }
+    auto& ring = asio::use_service<Uring<BufSize>>(ios);
+    if(!ring.ok())
+    {
+        return false;
+    }
+
+    static_assert(TRANE_URING_CHANNEL_SLOTS * sizeof(struct io_uring_buf) <= 4096, "provided buffer ring must fit a page");
+    void* page = ::mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(page == MAP_FAILED)
+    {
+        return false;
+    }
+
+    auto state = new State;
+    state->ring = &ring;
+    state->on_data = on_data;
+    state->on_done = on_done;
+    state->on_fail = on_fail;
+    unsigned n;
+    for(n = 0; n < TRANE_URING_CHANNEL_SLOTS; ++n)
+    {
+        if(!ring.alloc_slot(state->slots[n]))
+        {
+            break;
+        }
+    }
+    if(n < TRANE_URING_CHANNEL_SLOTS || !ring.register_group(page, TRANE_URING_CHANNEL_SLOTS, state->bgid))
+    {
+        LOG(WARNING) << "io_uring buffers exhausted";
+        while(n > 0)
+        {
+            ring.free_slot(state->slots[--n]);
+        }
+        ::munmap(page, 4096);
+        delete state;
+        return false;
+    }
+    state->bufs = static_cast<struct io_uring_buf*>(page);
+    for(uint16_t bid = 0; bid < TRANE_URING_CHANNEL_SLOTS; ++bid)
+    {
+        state->provide(bid);
+    }
+    ring.attach(state);
+    m_state = state;
+    return true;
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::close()
+{
+    if(!m_state)
+    {
+        return;
+    }
+    State* state = m_state;
+    m_state = nullptr;
+    state->dead = true;
+    if(state->inflight == 0 || state->orphaned)
+    {
+        state->release();
+        return;
+    }
+    // the state lives on until the kernel has completed everything that still refers to it
+    state->reads = state->writes = state->bytes = nullptr;
+    state->cancel();
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::count(Counter& reads, Counter& writes, Counter& bytes)
+{
+    if(m_state)
+    {
+        m_state->reads = &reads;
+        m_state->writes = &writes;
+        m_state->bytes = &bytes;
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::start(int fd)
+{
+    if(m_state)
+    {
+        m_state->from = fd;
+        m_state->arm();
+    }
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::flush(int fd)
+{
+    if(m_state && !m_state->dead)
+    {
+        if(m_state->to < 0 && !m_state->eof)
+        {
+            m_state->to = fd;
+        }
+        m_state->write();
+    }
+}
+
+
+template<size_t BufSize>
+size_t trane::UringChannel<BufSize>::queued() const
+{
+    return m_state ? m_state->queued : 0;
+}
+
+#else
+
+/*
+ * Without io_uring the channel never opens and the proxy stays on its asio relay.
+ */
+
+template<size_t BufSize>
+trane::Uring<BufSize>::Uring(asio::io_service& ios)
+    : asio::io_service::service(ios), m_ios{ios}, m_event{ios}
+{ }
+
+
+template<size_t BufSize>
+trane::Uring<BufSize>::~Uring()
+{ }
+
+
+template<size_t BufSize>
+void trane::Uring<BufSize>::shutdown()
+{ }
+
+
+template<size_t BufSize>
+bool trane::Uring<BufSize>::ok() const
+{
+    return false;
+}
+
+
+template<size_t BufSize>
+struct trane::UringChannel<BufSize>::State
+{ };
+
+
+template<size_t BufSize>
+bool trane::UringChannel<BufSize>::open(asio::io_service& ios, Notify on_data, Notify on_done, Failure on_fail)
+{
+    (void)ios;
+    (void)on_data;
+    (void)on_done;
+    (void)on_fail;
+    return false;
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::close()
+{ }
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::count(Counter& reads, Counter& writes, Counter& bytes)
+{
+    (void)reads;
+    (void)writes;
+    (void)bytes;
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::start(int fd)
+{
+    (void)fd;
+}
+
+
+template<size_t BufSize>
+void trane::UringChannel<BufSize>::flush(int fd)
+{
+    (void)fd;
+}
+
+
+template<size_t BufSize>
+size_t trane::UringChannel<BufSize>::queued() const
+{
+    return 0;
+}
+
+#endif
+
+
+template<size_t BufSize>
+trane::UringChannel<BufSize>::~UringChannel()
+{
+    this->close();
+}
+
+
+template<size_t BufSize>
+bool trane::UringChannel<BufSize>::is_open() const
+{
+    return m_state != nullptr;
+}
+
+#endif
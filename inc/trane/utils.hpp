@@ -3,12 +3,29 @@
 
 #include <mutex>
 #include <chrono>
+#include <string>
 
 #include "logging.hpp"
 #include "msgpack.hpp"
 
 #define SCOPELOCK(mu) std::lock_guard<std::mutex> __lock(mu)
 #define TRANE_BUFSIZE 32 * 1024
+#define TRANE_RELAY_HIGH_WATERMARK (4 * TRANE_BUFSIZE)
+#define TRANE_RELAY_LOW_WATERMARK (TRANE_BUFSIZE)
+#define TRANE_MUX_WINDOW (256 * 1024)
+#define TRANE_TUNNEL_SPARES 1               // idle data connections each tunnel keeps ready for new admins
+#define TRANE_WRITE_GATHER 64               // queued chunks gathered into a single write
+#define TRANE_COALESCE_WINDOW 0             // microseconds a small write may wait for more data, 0 writes right away
+#define TRANE_BUFFER_BACKOFF 1              // milliseconds a read waits for the buffer pool to refill when it ran dry
+#define TRANE_IO_THREADS 1                  // io_service shards, 0 runs one per core
+#define TRANE_HEARTBEAT 10                  // seconds between a client's PINGs
+#define TRANE_IDLE_TIMEOUT 30               // seconds without a command before a control connection is dropped, 0 never
+#define TRANE_TUNNEL_IDLE 0                 // seconds without traffic before a tunnel is closed, 0 never
+#define TRANE_METRICS_PORT 0                // loopback port of the metrics endpoint, 0 for none
+#define TRANE_DNS_TTL 60                    // seconds a resolved address is reused before it is looked up again
+#ifndef TRANE_RELAY_MODE
+#define TRANE_RELAY_MODE trane::PIPELINED
+#endif
 #define NOP(x) (void)(x);
 
 #define SEC(x)  std::chrono::seconds(x)
@@ -22,6 +39,7 @@
 #define P3(x) std::get<3>(x)
 #define P4(x) std::get<4>(x)
 #define P5(x) std::get<5>(x)
+#define P6(x) std::get<6>(x)
 
 namespace trane {
     const unsigned TRANE_ADMIN_PORT_BEGIN = 40000;
@@ -44,6 +62,10 @@ namespace trane {
         PONG,           // Heartbeat response sent by Server
         TUNNEL_REQ,     // Create a Trane Tunnel request
         TUNNEL_RES,     // Tunnel creation response
+        STREAM_OPEN,    // Open a stream multiplexed over the control connection to the given host and port
+        STREAM_DATA,    // Stream payload, counted against the receiver's window
+        STREAM_WINDOW,  // Receiver has consumed data and grants the sender more window
+        STREAM_CLOSE,   // Sender has no more data for the stream, or resets it
     };
 
     enum TraneType : unsigned char {
@@ -51,6 +73,138 @@ namespace trane {
         UDP,            // any request sent from a machine will reply to that same machine.
     };
 
+    enum RelayMode : unsigned char {
+        LOCKSTEP,       // read a buffer, write it out, then read the next one
+        PIPELINED,      // keep reading while writes are in flight, bounded by the relay watermarks
+        SPLICE,         // move TCP payloads through a kernel pipe with splice(2), falls back to PIPELINED
+        URING,          // drive TCP relay I/O through io_uring, falls back to PIPELINED
+    };
+
+    /*
+     * Relay mode given to every new tunnel. Defaults to TRANE_RELAY_MODE and may be changed at startup.
+     */
+    inline RelayMode& default_relay_mode()
+    {
+        static RelayMode mode = TRANE_RELAY_MODE;
+        return mode;
+    }
+
+    inline bool parse_relay_mode(const std::string& name, RelayMode& mode)
+    {
+        static const char* names[] = {"lockstep", "pipelined", "splice", "uring"};
+        for(unsigned char i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        {
+            if(name == names[i])
+            {
+                mode = static_cast<RelayMode>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    enum BufferProfile : unsigned char {
+        INTERACTIVE,    // small relay buffers for chatty, low volume tunnels
+        STANDARD,       // TRANE_BUFSIZE relay buffers
+        BULK,           // large relay buffers for file transfers and other bulk tunnels
+    };
+
+    /*
+     * Buffer profile given to every new tunnel. May be changed at startup.
+     */
+    inline BufferProfile& default_buffer_profile()
+    {
+        static BufferProfile profile = STANDARD;
+        return profile;
+    }
+
+    inline bool parse_buffer_profile(const std::string& name, BufferProfile& profile)
+    {
+        static const char* names[] = {"interactive", "standard", "bulk"};
+        for(unsigned char i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        {
+            if(name == names[i])
+            {
+                profile = static_cast<BufferProfile>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Idle, already connected data connections kept per tunnel. May be changed at startup.
+     */
+    inline size_t& default_tunnel_spares()
+    {
+        static size_t spares = TRANE_TUNNEL_SPARES;
+        return spares;
+    }
+
+    /*
+     * Write coalescing window given to every new tunnel. May be changed at startup.
+     */
+    inline std::chrono::microseconds& default_coalesce_window()
+    {
+        static std::chrono::microseconds window{TRANE_COALESCE_WINDOW};
+        return window;
+    }
+
+    /*
+     * Number of io_service shards sessions and tunnels are spread over. May be changed at startup.
+     */
+    inline size_t& default_io_threads()
+    {
+        static size_t threads = TRANE_IO_THREADS;
+        return threads;
+    }
+
+    /*
+     * Liveness of control connections and tunnels. May be changed at startup. With keepalive set, dead peers of a
+     * control connection are detected by the kernel within the idle timeout instead of by timers.
+     */
+    inline std::chrono::seconds& default_heartbeat()
+    {
+        static std::chrono::seconds interval{TRANE_HEARTBEAT};
+        return interval;
+    }
+
+    inline std::chrono::seconds& default_idle_timeout()
+    {
+        static std::chrono::seconds timeout{TRANE_IDLE_TIMEOUT};
+        return timeout;
+    }
+
+    inline std::chrono::seconds& default_tunnel_idle()
+    {
+        static std::chrono::seconds timeout{TRANE_TUNNEL_IDLE};
+        return timeout;
+    }
+
+    inline bool& default_keepalive()
+    {
+        static bool keepalive = false;
+        return keepalive;
+    }
+
+    /*
+     * Port on 127.0.0.1 the traffic metrics are served on. May be changed at startup.
+     */
+    inline uint16_t& default_metrics_port()
+    {
+        static uint16_t port = TRANE_METRICS_PORT;
+        return port;
+    }
+
+    /*
+     * How long resolved addresses are cached, getaddrinfo does not tell the TTL of a record. May be changed at startup.
+     */
+    inline std::chrono::seconds& default_dns_ttl()
+    {
+        static std::chrono::seconds ttl{TRANE_DNS_TTL};
+        return ttl;
+    }
+
 }
 
 #endif
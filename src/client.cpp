@@ -3,6 +3,7 @@
 
 #include <string>
 #include <sstream>
+#include <cstdlib>
 
 
 const int RECONNECT_INTERVAL = 3;
@@ -32,14 +33,111 @@ int main(int argc, char **argv)
         iss >> port;
     }
 
+    if(const char* relay = std::getenv("TRANE_RELAY"))
+    {
+        if(!trane::parse_relay_mode(relay, trane::default_relay_mode()))
+        {
+            std::cerr << "Unknown relay mode " << relay << ", expected lockstep, pipelined, splice or uring\n";
+            return 1;
+        }
+    }
+    if(const char* profile = std::getenv("TRANE_BUFFERS"))
+    {
+        if(!trane::parse_buffer_profile(profile, trane::default_buffer_profile()))
+        {
+            std::cerr << "Unknown buffer profile " << profile << ", expected interactive, standard or bulk\n";
+            return 1;
+        }
+    }
+    if(const char* window = std::getenv("TRANE_COALESCE_US"))
+    {
+        std::istringstream iss(window);
+        unsigned long usec;
+        if(!(iss >> usec))
+        {
+            std::cerr << "Invalid write coalescing window " << window << '\n';
+            return 1;
+        }
+        trane::default_coalesce_window() = USEC(usec);
+    }
+    if(const char* threads = std::getenv("TRANE_THREADS"))
+    {
+        std::istringstream iss(threads);
+        if(!(iss >> trane::default_io_threads()))
+        {
+            std::cerr << "Invalid number of threads " << threads << '\n';
+            return 1;
+        }
+    }
+    if(const char* heartbeat = std::getenv("TRANE_HEARTBEAT"))
+    {
+        std::istringstream iss(heartbeat);
+        unsigned long sec;
+        if(!(iss >> sec))
+        {
+            std::cerr << "Invalid heartbeat interval " << heartbeat << '\n';
+            return 1;
+        }
+        trane::default_heartbeat() = SEC(sec);
+    }
+    if(const char* idle_timeout = std::getenv("TRANE_IDLE_TIMEOUT"))
+    {
+        std::istringstream iss(idle_timeout);
+        unsigned long sec;
+        if(!(iss >> sec))
+        {
+            std::cerr << "Invalid idle timeout " << idle_timeout << '\n';
+            return 1;
+        }
+        trane::default_idle_timeout() = SEC(sec);
+    }
+    if(std::getenv("TRANE_KEEPALIVE"))
+    {
+        trane::default_keepalive() = true;
+    }
+    if(const char* metrics_port = std::getenv("TRANE_METRICS_PORT"))
+    {
+        std::istringstream iss(metrics_port);
+        if(!(iss >> trane::default_metrics_port()))
+        {
+            std::cerr << "Invalid metrics port " << metrics_port << '\n';
+            return 1;
+        }
+    }
+    if(const char* dns_ttl = std::getenv("TRANE_DNS_TTL"))
+    {
+        std::istringstream iss(dns_ttl);
+        unsigned long sec;
+        if(!(iss >> sec))
+        {
+            std::cerr << "Invalid DNS TTL " << dns_ttl << '\n';
+            return 1;
+        }
+        trane::default_dns_ttl() = SEC(sec);
+    }
+    if(std::getenv("TRANE_HUGE_PAGES"))
+    {
+        trane::BufferPool::instance().set_huge_pages(true);
+    }
+
     while(true)
     {
+        // tunnels get shards of their own when more than one thread is asked for, the control connection keeps
+        // running on this thread. The pool is stopped before the client and its tunnels are destroyed.
+        trane::IoPool pool(trane::default_io_threads());
+        pool.set_affinity(std::getenv("TRANE_AFFINITY") != nullptr);
         asio::io_service ios;
         int i;
         trane::Client<TRANE_BUFSIZE> client(ios, argv[1], argv[2], port, &onerror);
+        if(trane::default_io_threads() != 1)
+        {
+            client.set_io_pool(&pool);
+            pool.start();
+        }
         client.start();
 
         ios.run();
+        pool.stop();
 
         std::cout << "Connection Error.\n";
 
@@ -2,6 +2,8 @@
 #ifdef TRANE_SERVER
 #include "../inc/trane/server.hpp"
 
+#include <cstdlib>
+
 #ifdef _DEBUG
 LogLevel LOGLEVEL = INFO;
 #else
@@ -12,14 +14,31 @@ LogLevel LOGLEVEL = ERROR;
 template<size_t BufSize>
 void foo(const trane::Server<BufSize>& server)
 {
-    const auto& sessions = server.sessions();
-    std::for_each(sessions.entries().begin(), sessions.entries().end(), [](const std::pair<uint64_t, std::shared_ptr<trane::Session<>>>& entry){
-        if(entry.second->state() == trane::ConnectionState::CONNECTED)
-        {
-            std::cout << "Session " << std::setw(16) << std::setfill('0') << std::hex << entry.first << ":\n";
+    auto accepts = server.accept_stats();
+    std::cout << std::dec << accepts.accepted << " sessions accepted in " << accepts.wakeups << " wakeups, "
+        << (accepts.accepted ? accepts.total_usec / accepts.accepted : 0) << "us average and " << accepts.max_usec
+        << "us worst accept latency\n";
+
+    // every session is looked up again on its own shard, so it is only ever touched and released there
+    auto& sessions = server.sessions();
+    sessions.for_each([&sessions](uint64_t sessionid, const trane::Session<BufSize>& session){
+        session.ios().post([&sessions, sessionid]{
+            auto session = sessions.get(sessionid);
+            if(session == nullptr || session->state() != trane::ConnectionState::CONNECTED)
+            {
+                return;
+            }
+            std::ostringstream oss;
+            oss << "Session " << std::setw(16) << std::setfill('0') << std::hex << sessionid << ":\n";
+            std::cout << oss.str();
+            if(std::getenv("TRANE_MUX"))
+            {
+                session->create_mux_tunnel(trane::TraneType::TCP, "10.1.1.252", 22);
+                return;
+            }
             auto trane_server = asio::ip::address::from_string("10.1.1.47");
-            entry.second->create_tunnel(trane_server, trane::TraneType::TCP, "10.1.1.252", 22);
-        }
+            session->create_tunnel(trane_server, trane::TraneType::TCP, "10.1.1.252", 22);
+        });
     });
 }
 
@@ -34,15 +53,117 @@ int main(int argc, char **argv)
         iss >> port;
     }
 
-    asio::io_service ios;
-    trane::Server<TRANE_BUFSIZE> server(ios, port);
-    server.listen();
+    if(const char* relay = std::getenv("TRANE_RELAY"))
+    {
+        if(!trane::parse_relay_mode(relay, trane::default_relay_mode()))
+        {
+            std::cerr << "Unknown relay mode " << relay << ", expected lockstep, pipelined, splice or uring\n";
+            return 1;
+        }
+    }
+    if(const char* profile = std::getenv("TRANE_BUFFERS"))
+    {
+        if(!trane::parse_buffer_profile(profile, trane::default_buffer_profile()))
+        {
+            std::cerr << "Unknown buffer profile " << profile << ", expected interactive, standard or bulk\n";
+            return 1;
+        }
+    }
+    if(const char* spares = std::getenv("TRANE_SPARES"))
+    {
+        std::istringstream iss(spares);
+        if(!(iss >> trane::default_tunnel_spares()))
+        {
+            std::cerr << "Invalid number of spare tunnel connections " << spares << '\n';
+            return 1;
+        }
+    }
+    if(const char* codec = std::getenv("TRANE_CODEC"))
+    {
+        if(*codec && !trane::make_codec(codec))
+        {
+            std::cerr << "Unknown codec " << codec << ", expected lz4\n";
+            return 1;
+        }
+        trane::default_codec() = codec;
+    }
+    if(const char* window = std::getenv("TRANE_COALESCE_US"))
+    {
+        std::istringstream iss(window);
+        unsigned long usec;
+        if(!(iss >> usec))
+        {
+            std::cerr << "Invalid write coalescing window " << window << '\n';
+            return 1;
+        }
+        trane::default_coalesce_window() = USEC(usec);
+    }
+    if(const char* threads = std::getenv("TRANE_THREADS"))
+    {
+        std::istringstream iss(threads);
+        if(!(iss >> trane::default_io_threads()))
+        {
+            std::cerr << "Invalid number of threads " << threads << '\n';
+            return 1;
+        }
+    }
+    if(const char* idle_timeout = std::getenv("TRANE_IDLE_TIMEOUT"))
+    {
+        std::istringstream iss(idle_timeout);
+        unsigned long sec;
+        if(!(iss >> sec))
+        {
+            std::cerr << "Invalid idle timeout " << idle_timeout << '\n';
+            return 1;
+        }
+        trane::default_idle_timeout() = SEC(sec);
+    }
+    if(const char* tunnel_idle = std::getenv("TRANE_TUNNEL_IDLE"))
+    {
+        std::istringstream iss(tunnel_idle);
+        unsigned long sec;
+        if(!(iss >> sec))
+        {
+            std::cerr << "Invalid tunnel idle timeout " << tunnel_idle << '\n';
+            return 1;
+        }
+        trane::default_tunnel_idle() = SEC(sec);
+    }
+    if(std::getenv("TRANE_KEEPALIVE"))
+    {
+        trane::default_keepalive() = true;
+    }
+    if(const char* metrics_port = std::getenv("TRANE_METRICS_PORT"))
+    {
+        std::istringstream iss(metrics_port);
+        if(!(iss >> trane::default_metrics_port()))
+        {
+            std::cerr << "Invalid metrics port " << metrics_port << '\n';
+            return 1;
+        }
+    }
+    if(std::getenv("TRANE_HUGE_PAGES"))
+    {
+        trane::BufferPool::instance().set_huge_pages(true);
+    }
 
-    LOG(DEBUG) << "Starting Server on 0.0.0.0:" << port;
+    trane::IoPool pool(trane::default_io_threads());
+    pool.set_affinity(std::getenv("TRANE_AFFINITY") != nullptr);
+    trane::Server<TRANE_BUFSIZE> server(pool, port);
+    server.listen();
 
-    std::thread t([&ios]{
-        ios.run();
+    // scraped on the first shard, which reads the other shards' counters without stopping them
+    trane::MetricsServer metrics(pool.get(0), [&server](std::ostream& out){
+        server.metrics(out);
     });
+    if(trane::default_metrics_port())
+    {
+        metrics.listen(trane::default_metrics_port());
+    }
+
+    LOG(DEBUG) << "Starting Server on 0.0.0.0:" << port << " with " << pool.size() << " threads";
+
+    pool.start();
 
     while(1)
     {
@@ -51,7 +172,7 @@ int main(int argc, char **argv)
         foo(server);
     }
 
-    t.join();
+    pool.stop();
 
     return 0;
 }